@@ -0,0 +1,221 @@
+#include "chunkcache.h"
+
+#include <algorithm>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+#include <tuple>
+
+#include "ffmpeg.h"
+#include "fileops.h"
+#include "home-dir.h"
+#include "json.hpp"
+
+namespace fs = std::filesystem;
+using json = nlohmann::json;
+
+const std::string kConfigFile = "ffmpeg-restorer.cfg";
+const std::string kConfigChunkCache = "chunk_cache";
+const std::string kConfigSize = "size";
+const std::string kConfigDir = "dir";
+const std::string kTempExtension = ".tmp";
+const uint64_t kMegabyte = 1048576;
+const uint64_t kFnvOffsetBasis = 14695981039346656037ULL;
+const uint64_t kFnvPrime = 1099511628211ULL;
+
+
+ChunkCache::ChunkCache(): limit_(0) {}
+
+ChunkCache::~ChunkCache() {}
+
+
+bool ChunkCache::Open(const fs::path& default_dir) {
+  dir_.clear();
+  limit_ = 0;
+  try {
+    fs::path cfg = fs::path(HomeDirLibrary::GetDataDir()) / kConfigFile;
+    std::ifstream f(cfg);
+    if (!f) {
+      return false;
+    }
+    json data = json::parse(f);
+    auto it = data.find(kConfigChunkCache);
+    if (it == data.end()) {
+      return false;
+    }
+    uint64_t size = 0;
+    auto size_it = it->find(kConfigSize);
+    if (size_it != it->end()) {
+      if (!size_it->is_number_unsigned()) {
+        throw std::invalid_argument(
+            "chunk cache size must be a non-negative integer");
+      }
+      size = size_it->get<uint64_t>();
+      if (size > std::numeric_limits<uint64_t>::max() / kMegabyte) {
+        throw std::invalid_argument("chunk cache size is too large");
+      }
+    }
+    fs::path dir = it->value(kConfigDir, default_dir.string());
+    if (size == 0 || dir.empty()) {
+      return false;
+    }
+    std::error_code err;
+    fs::create_directories(dir, err);
+    if (err) {
+      std::cerr << "WARNING: Can't create chunk cache directory " << dir
+                << std::endl;
+      return false;
+    }
+    // Результат другой версии ffmpeg может отличаться
+    FFmpeg fm;
+    if (!fm.RequestVersion(version_)) {
+      return false;
+    }
+    dir_ = fs::absolute(dir);
+    limit_ = size * kMegabyte;
+    return true;
+  } catch (std::exception& err) {
+    std::cerr << "WARNING: Wrong configuration file: " << err.what()
+              << std::endl;
+  }
+  return false;
+}
+
+
+bool ChunkCache::IsOpen() const { return !dir_.empty(); }
+
+
+std::string ChunkCache::MakeKey(const std::vector<std::string>& parts) const {
+  std::vector<std::string> all = {version_};
+  all.insert(all.end(), parts.begin(), parts.end());
+  return HashParts(all);
+}
+
+
+std::string ChunkCache::HashParts(const std::vector<std::string>& parts) {
+  uint64_t hash = kFnvOffsetBasis;
+  auto add = [&hash](const std::string& value) {
+    for (auto c : value) {
+      hash ^= static_cast<unsigned char>(c);
+      hash *= kFnvPrime;
+    }
+    // Нулевой байт после части: части "ab","c" и "a","bc" дают разные ключи
+    hash *= kFnvPrime;
+  };
+  for (const auto& part : parts) {
+    add(part);
+  }
+  std::stringstream key;
+  key << std::hex << std::setw(16) << std::setfill('0') << hash;
+  return key.str();
+}
+
+
+std::string ChunkCache::FileIdentity(const fs::path& file) {
+  std::error_code err;
+  auto size = fs::file_size(file, err);
+  if (err) {
+    return std::string();
+  }
+  auto mtime = fs::last_write_time(file, err);
+  if (err) {
+    return std::string();
+  }
+  std::stringstream identity;
+  identity << fs::absolute(file).string() << "|" << size << "|"
+           << mtime.time_since_epoch().count();
+  return identity.str();
+}
+
+
+bool ChunkCache::Restore(
+    const std::string& key, const fs::path& target, uint64_t& size) {
+  if (!IsOpen()) {
+    return false;
+  }
+  auto entry = dir_ / key;
+  std::error_code err;
+  size = fs::file_size(entry, err);
+  if (err || size == 0) {
+    return false;
+  }
+  fs::remove(target, err);
+  if (!LinkFile(entry, target)) {
+    return false;
+  }
+  // Использованная запись удаляется последней
+  fs::last_write_time(entry, fs::file_time_type::clock::now(), err);
+  return true;
+}
+
+
+bool ChunkCache::Store(const std::string& key, const fs::path& source) {
+  if (!IsOpen()) {
+    return false;
+  }
+  auto entry = dir_ / key;
+  auto temp = entry;
+  temp += kTempExtension;
+  std::error_code err;
+  fs::remove(temp, err);
+  // Запись появляется переименованием: недописанный файл не попадёт в кэш
+  if (!LinkFile(source, temp)) {
+    fs::remove(temp, err);
+    return false;
+  }
+  fs::last_write_time(temp, fs::file_time_type::clock::now(), err);
+  fs::rename(temp, entry, err);
+  if (err) {
+    fs::remove(temp, err);
+    return false;
+  }
+  Evict();
+  return true;
+}
+
+
+void ChunkCache::Evict() {
+  std::vector<std::tuple<fs::file_time_type, uint64_t, fs::path>> entries;
+  uint64_t total = 0;
+  std::error_code err;
+  for (fs::directory_iterator it(dir_, err), end; !err && it != end;
+       it.increment(err)) {
+    if (!it->is_regular_file(err)) {
+      continue;
+    }
+    auto size = it->file_size(err);
+    auto mtime = it->last_write_time(err);
+    if (err) {
+      err.clear();
+      continue;
+    }
+    entries.emplace_back(mtime, size, it->path());
+    total += size;
+  }
+  if (total <= limit_) {
+    return;
+  }
+  std::sort(entries.begin(), entries.end());
+  for (const auto& entry : entries) {
+    if (total <= limit_) {
+      break;
+    }
+    if (fs::remove(std::get<2>(entry), err)) {
+      total -= std::get<1>(entry);
+    }
+  }
+}
+
+
+bool ChunkCache::LinkFile(const fs::path& source, const fs::path& target) {
+  std::error_code err;
+  fs::create_hard_link(source, target, err);
+  if (!err) {
+    return true;
+  }
+  TransferMethod method;
+  return TransferFile(source, target, false, method);
+}
@@ -0,0 +1,78 @@
+#ifndef CHUNKCACHE_H
+#define CHUNKCACHE_H
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+
+/*! Кэш готовых файлов фрагментов для повторных конвертаций. Запись кэша -
+файл с именем по ключу (FNV-1a от исходного файла, границ фрагмента,
+аргументов и версии ffmpeg). Файлы переносятся жёсткой ссылкой, а между
+файловыми системами - клонированием блоков или копированием. Размер кэша
+ограничен: при превышении удаляются давно не использованные записи (по
+времени изменения файла, которое обновляется при каждом использовании).
+Настройки - основной конфигурационный файл ffmpeg-restorer.cfg, ключ
+"chunk_cache": {"size": Мб, "dir": путь}. Без размера кэш выключен */
+class ChunkCache {
+ public:
+  ChunkCache();
+  virtual ~ChunkCache();
+
+  /*! Включить кэш по настройкам. Запрашивает версию ffmpeg для ключей
+  \param default_dir папка кэша, если она не задана в настройках
+  \return признак, что кэш включён */
+  bool Open(const std::filesystem::path& default_dir);
+
+  /*! Проверить, что кэш включён
+  \return признак включённого кэша */
+  bool IsOpen() const;
+
+  /*! Вычислить ключ записи. К частям добавляется версия ffmpeg
+  \param parts части ключа: идентичность исходного файла (см. FileIdentity),
+  границы фрагмента, аргументы ffmpeg и т.д.
+  \return ключ (16 шестнадцатеричных цифр) */
+  std::string MakeKey(const std::vector<std::string>& parts) const;
+
+  /*! Вычислить хэш FNV-1a от последовательности частей
+  \param parts части
+  \return хэш (16 шестнадцатеричных цифр) */
+  static std::string HashParts(const std::vector<std::string>& parts);
+
+  /*! Выдать идентичность файла для ключа: полный путь, размер и время
+  изменения
+  \param file файл
+  \return строка идентичности, пустая - файл недоступен */
+  static std::string FileIdentity(const std::filesystem::path& file);
+
+  /*! Получить файл из кэша. Существующий целевой файл заменяется
+  \param key ключ записи
+  \param target целевой файл
+  \param size возвращает размер файла
+  \return признак, что запись найдена и перенесена */
+  bool Restore(
+      const std::string& key, const std::filesystem::path& target,
+      uint64_t& size);
+
+  /*! Поместить файл в кэш и удалить старые записи сверх размера кэша
+  \param key ключ записи
+  \param source файл, остаётся на месте
+  \return признак успешного помещения */
+  bool Store(const std::string& key, const std::filesystem::path& source);
+
+  /*! Перенести файл в целевой: жёсткой ссылкой или копированием
+  \return признак успешного переноса */
+  static bool LinkFile(
+      const std::filesystem::path& source, const std::filesystem::path& target);
+
+ private:
+  std::filesystem::path dir_;  //!< Папка кэша, пустая - кэш выключен
+  uint64_t limit_;  //!< Максимальный размер, в байтах
+  std::string version_;  //!< Версия ffmpeg
+
+  /*! Удалить давно не использованные записи сверх размера кэша */
+  void Evict();
+};
+
+#endif  // CHUNKCACHE_H
@@ -1,8 +1,12 @@
 #include "ffmpeg.h"
 
+#include <algorithm>
 #include <cassert>
+#include <filesystem>
 #include <iostream>
 #include <limits>
+#include <map>
+#include <mutex>
 #include <sstream>
 #include <string>
 #include <vector>
@@ -124,6 +128,61 @@ bool RunApplication(const std::string& application,
 }
 
 
+// Кэш результатов ffprobe. Ключ - аргументы запроса и идентичность файла
+// (размер и время изменения), поэтому изменившийся файл запрашивается заново.
+// Кэш живёт всё время работы процесса и полезен в режиме сервиса
+const size_t kProbeCacheLimit = 4096;
+std::map<std::string, std::string> g_ProbeCache;
+std::mutex g_ProbeCacheLock;
+
+
+/*! Запустить ffprobe с кэшированием результата
+\param arguments аргументы ffprobe
+\param file исследуемый файл
+\param output возвращаемый вывод ffprobe
+\param errout возвращаемый вывод ошибок ffprobe
+\return признак успешного выполнения */
+bool RunProbe(const std::vector<std::string>& arguments,
+    const std::filesystem::path& file, std::string& output,
+    std::string& errout) {
+  // Файл без известной идентичности запрашивается без кэша
+  std::error_code err;
+  auto size = std::filesystem::file_size(file, err);
+  if (err) {
+    return RunApplication("ffprobe", arguments, output, errout);
+  }
+  auto mtime = std::filesystem::last_write_time(file, err);
+  if (err) {
+    return RunApplication("ffprobe", arguments, output, errout);
+  }
+
+  std::stringstream key;
+  key << size << "|" << mtime.time_since_epoch().count();
+  for (auto it = arguments.begin(); it != arguments.end(); ++it) {
+    key << "|" << *it;
+  }
+  {
+    std::lock_guard<std::mutex> lk(g_ProbeCacheLock);
+    auto cit = g_ProbeCache.find(key.str());
+    if (cit != g_ProbeCache.end()) {
+      output = cit->second;
+      return true;
+    }
+  }
+
+  if (!RunApplication("ffprobe", arguments, output, errout)) {
+    return false;
+  }
+
+  std::lock_guard<std::mutex> lk(g_ProbeCacheLock);
+  if (g_ProbeCache.size() >= kProbeCacheLimit) {
+    g_ProbeCache.clear();
+  }
+  g_ProbeCache[key.str()] = output;
+  return true;
+}
+
+
 FFmpeg::FFmpeg() {}
 
 bool FFmpeg::ParseDuration(const std::string& value, size_t& duration_mcs) {
@@ -177,7 +236,7 @@ bool FFmpeg::RequestDuration(
 
     std::string output;
     std::string errout;
-    if (!RunApplication("ffprobe", arguments, output, errout)) {
+    if (!RunProbe(arguments, fname, output, errout)) {
       return false;
     }
 
@@ -192,24 +251,41 @@ bool FFmpeg::RequestDuration(
   return false;
 }
 
+bool FFmpeg::RequestVersion(std::string& version) {
+  try {
+    std::string output;
+    std::string errout;
+    if (!RunApplication("ffmpeg", {"-version"}, output, errout)) {
+      return false;
+    }
+    std::stringstream os(output);
+    std::getline(os, version);
+    return !version.empty();
+  } catch (std::exception& err) {
+    std::cerr << "Error: " << err.what() << std::endl;
+  }
+  return false;
+}
+
 bool FFmpeg::RequestFrames(const std::filesystem::path& fname,
     size_t search_start, size_t search_interval, size_t& ordinary_frame,
-    size_t& key_frame) {
+    size_t& key_frame, size_t& key_position) {
   ordinary_frame = 0;
   key_frame = 0;
+  key_position = kUnknownPosition;
   try {
     std::stringstream intarg;
     intarg << search_start / 1000000 << "." << std::setw(6) << std::setfill('0')
            << search_start % 1000000 << "%+" << search_interval / 1000000 << "."
            << std::setw(6) << std::setfill('0') << search_interval % 1000000;
     std::vector<std::string> arguments = {"-select_streams", "v",
-        "-show_frames", "-show_entries", "frame=pkt_pts_time,pict_type",
+        "-show_frames", "-show_entries", "frame=pkt_pts_time,pkt_pos,pict_type",
         "-sexagesimal", "-read_intervals", intarg.str(), "-of", "csv"};
     arguments.push_back(fname.string());
 
     std::string output;
     std::string errout;
-    if (!RunApplication("ffprobe", arguments, output, errout)) {
+    if (!RunProbe(arguments, fname, output, errout)) {
       return false;
     }
 
@@ -218,6 +294,8 @@ bool FFmpeg::RequestFrames(const std::filesystem::path& fname,
     while (std::getline(os, line)) {
       const std::string kFrameField = "frame";
       const std::string kKeyType = "I";
+      // Поля: frame,время[,смещение],тип кадра. Смещение pkt_pos выдаётся
+      // не всеми сборками ffprobe и не для всех контейнеров
       auto c1 = line.find(',');
       if (c1 == line.npos) {
         continue;
@@ -226,6 +304,7 @@ bool FFmpeg::RequestFrames(const std::filesystem::path& fname,
       if (c2 == line.npos) {
         continue;
       }
+      auto c3 = line.find(',', c2 + 1);
       if (line.substr(0, c1) != kFrameField) {
         continue;
       }
@@ -237,8 +316,16 @@ bool FFmpeg::RequestFrames(const std::filesystem::path& fname,
       if (ordinary_frame == 0) {
         ordinary_frame = mark;
       }
-      if (key_frame == 0 && line.substr(c2 + 1) == kKeyType) {
+      auto type = line.substr((c3 == line.npos ? c2 : c3) + 1);
+      if (key_frame == 0 && type == kKeyType) {
         key_frame = mark;
+        // Смещение может быть неизвестно (N/A) или не выдано
+        auto pos = c3 == line.npos ? std::string()
+                                   : line.substr(c2 + 1, c3 - c2 - 1);
+        if (!pos.empty() &&
+            pos.find_first_not_of("0123456789") == std::string::npos) {
+          key_position = std::stoull(pos);
+        }
       }
       if (ordinary_frame != 0 && key_frame != 0) {
         break;
@@ -252,11 +339,86 @@ bool FFmpeg::RequestFrames(const std::filesystem::path& fname,
 }
 
 
+bool FFmpeg::RequestKeyFrames(const std::filesystem::path& fname,
+    size_t search_start, size_t search_interval,
+    std::vector<size_t>& key_frames) {
+  key_frames.clear();
+  try {
+    std::stringstream intarg;
+    intarg << search_start / 1000000 << "." << std::setw(6) << std::setfill('0')
+           << search_start % 1000000 << "%+" << search_interval / 1000000 << "."
+           << std::setw(6) << std::setfill('0') << search_interval % 1000000;
+    std::vector<std::string> arguments = {"-select_streams", "v:0",
+        "-show_packets", "-show_entries", "packet=pts_time,flags",
+        "-sexagesimal", "-read_intervals", intarg.str(), "-of", "csv"};
+    arguments.push_back(fname.string());
+
+    std::string output;
+    std::string errout;
+    if (!RunProbe(arguments, fname, output, errout)) {
+      return false;
+    }
+
+    // Флаг K ставится и на точки восстановления открытой группы кадров
+    // (CRA в HEVC, I-кадр с последующими B-кадрами предыдущей группы). Пакеты
+    // таких кадров (RASL) идут в порядке декодирования после ключевого, но
+    // показываются раньше него и ссылаются на предыдущую группу. Ключевой кадр
+    // подходит для копирования, только если следующий за ним пакет
+    // показывается позже
+    std::optional<size_t> key;
+    bool clean = false;
+    bool followed = false;
+    auto finish = [&]() {
+      if (key && clean && followed) {
+        key_frames.push_back(key.value());
+      }
+    };
+    std::stringstream os(output);
+    std::string line;
+    while (std::getline(os, line)) {
+      const std::string kPacketField = "packet";
+      const char kKeyFlag = 'K';
+      auto c1 = line.find(',');
+      if (c1 == line.npos) {
+        continue;
+      }
+      auto c2 = line.find(',', c1 + 1);
+      if (c2 == line.npos) {
+        continue;
+      }
+      size_t mark;
+      if (line.substr(0, c1) != kPacketField ||
+          !ParseDuration(line.substr(c1 + 1, c2 - c1 - 1), mark)) {
+        continue;
+      }
+      if (line.find(kKeyFlag, c2 + 1) != line.npos) {
+        // Следующий ключевой кадр завершает группу предыдущего
+        followed = true;
+        finish();
+        key = mark;
+        clean = true;
+        followed = false;
+      } else if (key && !followed) {
+        followed = true;
+        clean = mark > key.value();
+      }
+    }
+    finish();
+    std::sort(key_frames.begin(), key_frames.end());
+    return true;
+  } catch (std::exception& err) {
+    std::cerr << "Error: " << err.what() << std::endl;
+  }
+  return false;
+}
+
+
 FFmpeg::ProcessResult FFmpeg::DoConvertation(std::filesystem::path input_file,
     std::filesystem::path output_file, std::optional<size_t> start_time,
     std::optional<size_t> interval,
     const std::vector<std::string>& input_arguments,
-    const std::vector<std::string>& output_arguments) {
+    const std::vector<std::string>& output_arguments,
+    const std::vector<Output>& extra_outputs) {
   try {
     std::vector<std::string> raw_args = {"-hide_banner", "-y"};
     if (start_time && interval) {
@@ -275,6 +437,11 @@ FFmpeg::ProcessResult FFmpeg::DoConvertation(std::filesystem::path input_file,
     raw_args.insert(std::end(raw_args), std::begin(output_arguments),
         std::end(output_arguments));
     raw_args.push_back(output_file.string());
+    for (const auto& out : extra_outputs) {
+      raw_args.insert(
+          std::end(raw_args), std::begin(out.Arguments), std::end(out.Arguments));
+      raw_args.push_back(out.File.string());
+    }
 
     std::string output;
     std::string errout;
@@ -301,20 +468,28 @@ bool FFmpeg::MergeVideoAndData(std::filesystem::path video_file,
     // clang-format off
     std::vector<std::string> raw_args = {"-hide_banner", "-y",
         // Source #0 (video)
-        "-i", video_file.string(),
-        // Source #1 (audio, subtitle, data)
-        "-i", data_file.string(),
-        // Copy video
-        "-map", "0:v?", "-c:v", "copy",
-        // Copy audio
-        "-map", "1:a?", "-c:a", "copy",
-        // Copy subtitle
-        "-map", "1:s?", "-c:s", "copy",
-        // Copy data
-        "-map", "1:d?", "-c:d", "copy",
-        // Destination
-        output_file.string()};
+        "-i", video_file.string()};
     // clang-format on
+    if (!data_file.empty()) {
+      // Source #1 (audio, subtitle, data)
+      raw_args.push_back("-i");
+      raw_args.push_back(data_file.string());
+    }
+    // Copy video
+    raw_args.insert(raw_args.end(), {"-map", "0:v?", "-c:v", "copy"});
+    if (!data_file.empty()) {
+      // clang-format off
+      raw_args.insert(raw_args.end(), {
+          // Copy audio
+          "-map", "1:a?", "-c:a", "copy",
+          // Copy subtitle
+          "-map", "1:s?", "-c:s", "copy",
+          // Copy data
+          "-map", "1:d?", "-c:d", "copy"});
+      // clang-format on
+    }
+    // Destination
+    raw_args.push_back(output_file.string());
 
     std::string output;
     std::string errout;
@@ -333,7 +508,7 @@ bool FFmpeg::DoConcatenation(
     std::filesystem::path list_file, std::filesystem::path output_file) {
   try {
     std::vector<std::string> raw_args = {"-hide_banner", "-safe", "0", "-f",
-        "concat", "-y", "-i", list_file.string(), "-c", "copy",
+        "concat", "-y", "-i", list_file.string(), "-map", "0", "-c", "copy",
         output_file.string()};
 
     std::string output;
@@ -351,13 +526,55 @@ bool FFmpeg::DoConcatenation(
   return false;
 }
 
+bool FFmpeg::ConcatenateAndMerge(std::filesystem::path list_file,
+    std::filesystem::path data_file, std::filesystem::path output_file) {
+  try {
+    // clang-format off
+    std::vector<std::string> raw_args = {"-hide_banner", "-y",
+        // Source #0 (video chunks)
+        "-safe", "0", "-f", "concat", "-i", list_file.string()};
+    // clang-format on
+    if (!data_file.empty()) {
+      // Source #1 (audio, subtitle, data)
+      raw_args.push_back("-i");
+      raw_args.push_back(data_file.string());
+    }
+    // Copy video
+    raw_args.insert(raw_args.end(), {"-map", "0:v?", "-c:v", "copy"});
+    if (!data_file.empty()) {
+      // clang-format off
+      raw_args.insert(raw_args.end(), {
+          // Copy audio
+          "-map", "1:a?", "-c:a", "copy",
+          // Copy subtitle
+          "-map", "1:s?", "-c:s", "copy",
+          // Copy data
+          "-map", "1:d?", "-c:d", "copy"});
+      // clang-format on
+    }
+    // Destination
+    raw_args.push_back(output_file.string());
+
+    std::string output;
+    std::string errout;
+    if (!RunApplication("ffmpeg", raw_args, output, errout)) {
+      std::cout << "ERROR:" << std::endl << errout << std::endl;
+      return false;
+    }
+    return true;
+  } catch (std::exception& err) {
+    std::cerr << "Error: " << err.what() << std::endl;
+  }
+  return false;
+}
+
 std::string FFmpeg::RequestStreamInfo(const std::filesystem::path& file) {
   try {
     std::vector<std::string> raw_args = {
         "-v", "quiet", "-print_format", "json", "-show_streams", file.string()};
     std::string output;
     std::string errout;
-    if (!RunApplication("ffprobe", raw_args, output, errout)) {
+    if (!RunProbe(raw_args, file, output, errout)) {
       std::cout << "ERROR:" << std::endl << errout << std::endl;
       return {};
     }
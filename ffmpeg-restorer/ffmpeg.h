@@ -17,6 +17,15 @@ class FFmpeg {
     kProcessSuccess  // Команда выполнилась успешно
   };
 
+  //! Смещение в файле неизвестно
+  static constexpr size_t kUnknownPosition = static_cast<size_t>(-1);
+
+  /*! Дополнительный выходной файл конвертации */
+  struct Output {
+    std::filesystem::path File;
+    std::vector<std::string> Arguments;  //!< Аргументы для этого файла
+  };
+
   /*! Запросить длительность медиафайла
   \param fname полный путь к файлу
   \param duration_mcs возвращаемая длительность в микросекундах
@@ -24,6 +33,11 @@ class FFmpeg {
   bool RequestDuration(
       const std::filesystem::path& fname, size_t& duration_mcs);
 
+  /*! Запросить версию ffmpeg
+  \param version возвращает первую строку вывода ffmpeg -version
+  \return признак успешности запроса */
+  bool RequestVersion(std::string& version);
+
   /*! Запросить фреймы во временном диапазоне: первый обычный и первый ключевой.
   Вернуть время через аргументы в микросекундах. Если кадра требуемого типа нет,
   то возвращается значение 0. Время старта поиска АБСОЛЮТНО неточно, и может
@@ -31,9 +45,26 @@ class FFmpeg {
   \param fname полный путь к файлу
   \param search_start, search_interval время и длительность интервала, в котором осуществляется поиск
   \param ordinary_frame, key_frame время любого кадра и время ключевого кадра
+  \param key_position смещение пакета ключевого кадра в файле, в байтах.
+  Если смещение неизвестно, возвращается kUnknownPosition
   \return признак успешности выполнения запроса */
   bool RequestFrames(const std::filesystem::path& fname, size_t search_start,
-      size_t search_interval, size_t& ordinary_frame, size_t& key_frame);
+      size_t search_interval, size_t& ordinary_frame, size_t& key_frame,
+      size_t& key_position);
+
+  /*! Запросить ключевые кадры видео во временном диапазоне по пакетам
+  (без декодирования). Время поиска, как и в RequestFrames, неточно
+  \param fname полный путь к файлу
+  \param search_start, search_interval время и длительность интервала, в
+  котором осуществляется поиск
+  \param key_frames возвращает время ключевых кадров по возрастанию, в мкс.
+  Выдаются только кадры, с которых видео декодируется без предыдущей группы
+  кадров (IDR, закрытая группа). Последний кадр интервала без следующих за ним
+  пакетов не выдаётся
+  \return признак успешности выполнения запроса */
+  bool RequestKeyFrames(const std::filesystem::path& fname,
+      size_t search_start, size_t search_interval,
+      std::vector<size_t>& key_frames);
 
   /*! Выполнить конвертацию фрагмента в отдельный файл. Если выходной файл
   существует, то он будет перезаписан (предполагается, что был ранее сбой в
@@ -45,28 +76,42 @@ class FFmpeg {
   \param длительность фрагмента для конвертации, в микросекундах
   \param input_arguments аргументы конвертации для входного файла ffmpeg
   \param arguments аргументы конвертации для выходного файла ffmpeg
+  \param extra_outputs дополнительные выходные файлы. Исходный файл читается
+  и декодируется один раз для всех выходных файлов
   \return признак успешно сделанной конвертации */
   ProcessResult DoConvertation(std::filesystem::path input_file,
       std::filesystem::path output_file, std::optional<size_t> start_time,
       std::optional<size_t> interval,
       const std::vector<std::string>& input_arguments,
-      const std::vector<std::string>& output_arguments);
+      const std::vector<std::string>& output_arguments,
+      const std::vector<Output>& extra_outputs = {});
 
   /*! Объединить видепоток с остальными потоками (звуковые, субтитры и данные)
   \param video_file файл с видеодорожкой
-  \param data_file файл с остальными потоками
+  \param data_file файл с остальными потоками. Если пустой, то видео только
+  перепаковывается в контейнер выходного файла
   \param output_file выходной файл с миксом потоков
   \return признак успешного объединения */
   bool MergeVideoAndData(std::filesystem::path video_file,
       std::filesystem::path data_file, std::filesystem::path output_file);
 
-  /*! Объединить фрагменты видео в один файл
+  /*! Объединить фрагменты в один файл. Копируются все потоки фрагментов
   \param list_file имя файл со списком фуйлов-фрагметов
   \param output_file имя суммарного файла
   \return признак успешного объединения */
   bool DoConcatenation(
       std::filesystem::path list_file, std::filesystem::path output_file);
 
+  /*! Объединить фрагменты видео и добавить остальные потоки за один проход.
+  Результат записывается сразу в выходной файл, без промежуточного видеофайла
+  \param list_file имя файла со списком файлов-фрагментов
+  \param data_file файл с остальными потоками (звук, субтитры и данные). Если
+  пустой, то в выходной файл попадает только видео
+  \param output_file выходной файл с миксом потоков
+  \return признак успешного объединения */
+  bool ConcatenateAndMerge(std::filesystem::path list_file,
+      std::filesystem::path data_file, std::filesystem::path output_file);
+
   /*! Получить информацию о потоках в виде json-строки
   \param file файл, о котором выдаётся информация
   \return json-строка с информацией. В случае ошибки выдаётся пустая строка */
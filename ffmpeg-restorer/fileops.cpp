@@ -0,0 +1,389 @@
+#include "fileops.h"
+
+#include <fstream>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif  // _WIN32
+
+#ifdef __linux__
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#endif  // __linux__
+
+namespace fs = std::filesystem;
+namespace chr = std::chrono;
+
+const size_t kCopyBufferSize = 1048576;
+const size_t kTsPacketSize = 188;
+const char kTsSyncByte = 0x47;
+// Количество пакетов в начале фрагмента, среди которых ищутся первые пакеты
+// потоков
+const size_t kTsScanPackets = 1024;
+const chr::milliseconds kLockRetry(50);
+
+
+#ifdef _WIN32
+
+bool AppendFile(const fs::path& source, const fs::path& target,
+    uint64_t offset, uint64_t& appended) {
+  try {
+    appended = 0;
+    if (!fs::exists(target)) {
+      std::ofstream create(target, std::ios_base::binary);
+    }
+    fs::resize_file(target, offset);
+
+    std::ifstream in(source, std::ios_base::binary);
+    std::ofstream out(target, std::ios_base::binary | std::ios_base::app);
+    if (!in || !out) {
+      return false;
+    }
+    std::vector<char> buf(kCopyBufferSize);
+    while (in) {
+      in.read(buf.data(), buf.size());
+      auto size = in.gcount();
+      if (size <= 0) {
+        break;
+      }
+      out.write(buf.data(), size);
+      appended += size;
+    }
+    out.flush();
+    return in.eof() && out.good();
+  } catch (std::exception&) {
+  }
+  return false;
+}
+
+#else  // _WIN32
+
+/*! Скопировать данные между файлами с их текущих позиций до конца источника.
+Сначала используется copy_file_range (данные не переносятся в память
+приложения), при его недоступности - копирование через буфер
+\param in, out дескрипторы источника и целевого файла
+\param copied возвращает количество скопированных байт
+\return признак успешного копирования */
+bool CopyData(int in, int out, uint64_t& copied) {
+  copied = 0;
+#ifdef __linux__
+  while (true) {
+    auto size = copy_file_range(in, nullptr, out, nullptr, kCopyBufferSize, 0);
+    if (size < 0) {
+      if (copied > 0 || (errno != EXDEV && errno != ENOSYS &&
+                            errno != EINVAL && errno != EOPNOTSUPP)) {
+        return false;
+      }
+      break;
+    }
+    if (size == 0) {
+      return true;
+    }
+    copied += size;
+  }
+#endif  // __linux__
+
+  std::vector<char> buf(kCopyBufferSize);
+  while (true) {
+    auto size = read(in, buf.data(), buf.size());
+    if (size < 0) {
+      return false;
+    }
+    if (size == 0) {
+      return true;
+    }
+    for (ssize_t written = 0; written < size;) {
+      auto res = write(out, buf.data() + written, size - written);
+      if (res <= 0) {
+        return false;
+      }
+      written += res;
+    }
+    copied += size;
+  }
+}
+
+
+bool AppendFile(const fs::path& source, const fs::path& target,
+    uint64_t offset, uint64_t& appended) {
+  appended = 0;
+  int in = open(source.c_str(), O_RDONLY);
+  if (in < 0) {
+    return false;
+  }
+  int out = open(target.c_str(), O_WRONLY | O_CREAT, 0644);
+  if (out < 0) {
+    close(in);
+    return false;
+  }
+
+  bool result = ftruncate(out, static_cast<off_t>(offset)) == 0 &&
+                lseek(out, 0, SEEK_END) == static_cast<off_t>(offset) &&
+                CopyData(in, out, appended) && fsync(out) == 0;
+
+  close(out);
+  close(in);
+  return result;
+}
+
+#endif  // _WIN32
+
+
+bool MarkTsDiscontinuity(const fs::path& file, uint64_t offset) {
+  try {
+    std::fstream f(file, std::ios_base::binary | std::ios_base::in |
+                             std::ios_base::out);
+    if (!f) {
+      return false;
+    }
+    std::set<unsigned int> pids;
+    char packet[kTsPacketSize];
+    for (size_t i = 0; i < kTsScanPackets; ++i) {
+      auto pos = offset + i * kTsPacketSize;
+      f.seekg(static_cast<std::streamoff>(pos));
+      f.read(packet, kTsPacketSize);
+      if (f.gcount() != static_cast<std::streamsize>(kTsPacketSize)) {
+        break;
+      }
+      if (packet[0] != kTsSyncByte) {
+        return false;
+      }
+      auto b1 = static_cast<unsigned char>(packet[1]);
+      auto b2 = static_cast<unsigned char>(packet[2]);
+      auto b3 = static_cast<unsigned char>(packet[3]);
+      unsigned int pid = ((b1 & 0x1f) << 8) | b2;
+      if (!pids.insert(pid).second) {
+        continue;
+      }
+      bool adaptation = (b3 & 0x20) != 0;
+      if (!adaptation || packet[4] == 0) {
+        continue;
+      }
+      // Флаги поля адаптации: старший бит - discontinuity_indicator
+      packet[5] = static_cast<char>(packet[5] | 0x80);
+      f.seekp(static_cast<std::streamoff>(pos + 5));
+      f.write(packet + 5, 1);
+    }
+    f.clear();
+    f.flush();
+    return f.good();
+  } catch (std::exception&) {
+  }
+  return false;
+}
+
+
+#ifdef __linux__
+
+/*! Скопировать файл средствами ядра: клонированием блоков или
+copy_file_range. Частично записанный целевой файл остаётся на месте
+\param source, target файл-источник и целевой файл
+\param method возвращает использованный способ
+\return признак успешного копирования */
+bool KernelCopy(const fs::path& source, const fs::path& target,
+    TransferMethod& method) {
+  int in = open(source.c_str(), O_RDONLY);
+  if (in < 0) {
+    return false;
+  }
+  int out = open(target.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (out < 0) {
+    close(in);
+    return false;
+  }
+
+  bool result = false;
+  if (ioctl(out, FICLONE, in) == 0) {
+    method = kTransferReflink;
+    result = true;
+  } else {
+    // Данные копируются без переноса в память приложения. Ошибка на первом
+    // вызове (другая файловая система, старое ядро) ведёт к обычному
+    // копированию
+    result = true;
+    while (true) {
+      auto size = copy_file_range(in, nullptr, out, nullptr, kCopyBufferSize, 0);
+      if (size < 0) {
+        result = false;
+        break;
+      }
+      if (size == 0) {
+        break;
+      }
+    }
+    method = kTransferCopyRange;
+  }
+  if (result && fsync(out) != 0) {
+    result = false;
+  }
+
+  close(out);
+  close(in);
+  return result;
+}
+
+#endif  // __linux__
+
+
+bool TransferFile(const fs::path& source, const fs::path& target,
+    bool allow_rename, TransferMethod& method) {
+  std::error_code err;
+  if (allow_rename) {
+    fs::rename(source, target, err);
+    if (!err) {
+      method = kTransferRename;
+      return true;
+    }
+  }
+
+#ifdef __linux__
+  if (KernelCopy(source, target, method)) {
+    return true;
+  }
+#endif  // __linux__
+
+  err.clear();
+  fs::copy_file(source, target, fs::copy_options::overwrite_existing, err);
+  if (err) {
+    return false;
+  }
+  method = kTransferCopy;
+  return true;
+}
+
+
+bool AdviseFileRange(const fs::path& file, uint64_t offset, uint64_t length,
+    ReadAdvice advice) {
+#ifdef __linux__
+  int fd = open(file.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  int flag =
+      advice == kAdviceWillNeed ? POSIX_FADV_WILLNEED : POSIX_FADV_DONTNEED;
+  bool result = posix_fadvise(fd, static_cast<off_t>(offset),
+                    static_cast<off_t>(length), flag) == 0;
+  close(fd);
+  return result;
+#else  // __linux__
+  return false;
+#endif  // __linux__
+}
+
+
+FileWriteState GetFileWriteState(const fs::path& file) {
+#if defined(_WIN32)
+  // Без совместной записи файл открывается, только если никто не держит его
+  // открытым на запись
+  HANDLE handle = CreateFileW(file.c_str(), GENERIC_READ, FILE_SHARE_READ,
+      NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (handle == INVALID_HANDLE_VALUE) {
+    return GetLastError() == ERROR_SHARING_VIOLATION ? kWriteOpen
+                                                     : kWriteUnknown;
+  }
+  CloseHandle(handle);
+  return kWriteClosed;
+#elif defined(__linux__)
+  // Открытые файлы процессов перечисляются в /proc/<pid>/fd, режим
+  // открытия - в поле flags файла /proc/<pid>/fdinfo/<fd>
+  struct stat target;
+  if (stat(file.c_str(), &target) != 0) {
+    return kWriteUnknown;
+  }
+  try {
+    std::error_code err;
+    for (const auto& proc : fs::directory_iterator("/proc")) {
+      auto pid = proc.path().filename().string();
+      if (pid.find_first_not_of("0123456789") != std::string::npos) {
+        continue;
+      }
+      // Дескрипторы процессов других пользователей недоступны
+      fs::directory_iterator fds(proc.path() / "fd", err);
+      for (; !err && fds != fs::directory_iterator(); fds.increment(err)) {
+        struct stat link;
+        if (stat(fds->path().c_str(), &link) != 0 ||
+            link.st_dev != target.st_dev || link.st_ino != target.st_ino) {
+          continue;
+        }
+        std::ifstream info(proc.path() / "fdinfo" / fds->path().filename());
+        std::string line;
+        const std::string kFlagsField = "flags:";
+        while (std::getline(info, line)) {
+          if (line.rfind(kFlagsField, 0) == 0 &&
+              (std::stoul(line.substr(kFlagsField.size()), nullptr, 8) &
+                  O_ACCMODE) != O_RDONLY) {
+            return kWriteOpen;
+          }
+        }
+      }
+      err.clear();
+    }
+  } catch (std::exception&) {
+    // Процесс завершился во время перебора: результат проверки неполон
+    return kWriteUnknown;
+  }
+  return kWriteClosed;
+#else
+  return kWriteUnknown;
+#endif
+}
+
+
+#ifdef _WIN32
+
+FileLock::FileLock(const fs::path& file) {
+  handle_ = CreateFileW(file.c_str(), GENERIC_READ | GENERIC_WRITE, 0, NULL,
+      OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+  if (handle_ == INVALID_HANDLE_VALUE) {
+    throw std::runtime_error("can't lock file " + file.string());
+  }
+}
+
+FileLock::~FileLock() { CloseHandle(static_cast<HANDLE>(handle_)); }
+
+#else  // _WIN32
+
+FileLock::FileLock(const fs::path& file) {
+  fd_ = open(file.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+  if (fd_ < 0) {
+    throw std::runtime_error("can't open lock file " + file.string());
+  }
+  if (flock(fd_, LOCK_EX | LOCK_NB) != 0) {
+    close(fd_);
+    throw std::runtime_error("can't lock file " + file.string());
+  }
+}
+
+FileLock::~FileLock() {
+  // Закрытие дескриптора снимает блокировку
+  close(fd_);
+}
+
+#endif  // _WIN32
+
+
+std::shared_ptr<FileLock> WaitLock(
+    const fs::path& file, chr::milliseconds timeout) {
+  auto finish = chr::steady_clock::now() + timeout;
+  while (true) {
+    try {
+      return std::make_shared<FileLock>(file);
+    } catch (std::runtime_error&) {
+    }
+    if (chr::steady_clock::now() > finish) {
+      return nullptr;
+    }
+    std::this_thread::sleep_for(kLockRetry);
+  }
+}
@@ -0,0 +1,115 @@
+#ifndef FILEOPS_H
+#define FILEOPS_H
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <memory>
+
+
+/*! Дописать содержимое файла в конец другого файла. Перед записью целевой
+файл обрезается (или создаётся) до заданного размера: так отбрасываются
+остатки прерванной ранее записи. После записи данные сбрасываются на диск
+\param source файл-источник
+\param target целевой файл
+\param offset размер целевого файла перед дописыванием
+\param appended возвращает количество дописанных байт
+\return признак успешного дописывания */
+bool AppendFile(const std::filesystem::path& source,
+    const std::filesystem::path& target, uint64_t offset, uint64_t& appended);
+
+/*! Отметить начало дописанного фрагмента MPEG-TS как разрыв. В первом пакете
+каждого потока с полем адаптации выставляется discontinuity_indicator, чтобы
+демультиплексор не считал ошибкой сброс счётчиков непрерывности и меток
+времени на стыке фрагментов. Пакеты без поля адаптации не меняются
+\param file файл MPEG-TS
+\param offset смещение начала фрагмента (кратно размеру пакета)
+\return признак успешной обработки */
+bool MarkTsDiscontinuity(const std::filesystem::path& file, uint64_t offset);
+
+/*! Способ, которым файл перенесён в TransferFile */
+enum TransferMethod {
+  kTransferRename,  // Переименование в пределах файловой системы
+  kTransferReflink,  // Клонирование блоков (ioctl FICLONE: Btrfs, XFS)
+  kTransferCopyRange,  // Копирование в ядре (copy_file_range)
+  kTransferCopy  // Копирование через буфер приложения
+};
+
+/*! Перенести содержимое файла в целевой файл наиболее быстрым доступным
+способом: переименование (если разрешено), клонирование блоков,
+copy_file_range и, в последнюю очередь, обычное копирование. Существующий
+целевой файл перезаписывается
+\param source файл-источник
+\param target целевой файл
+\param allow_rename источник больше не нужен и может быть переименован
+\param method возвращает использованный способ
+\return признак успешного переноса */
+bool TransferFile(const std::filesystem::path& source,
+    const std::filesystem::path& target, bool allow_rename,
+    TransferMethod& method);
+
+/*! Подсказка ядру о чтении участка файла */
+enum ReadAdvice {
+  kAdviceWillNeed,  // Участок скоро будет прочитан: начать чтение в кэш
+  kAdviceDontNeed  // Участок больше не нужен: убрать из страничного кэша
+};
+
+/*! Передать ядру подсказку о чтении участка файла (posix_fadvise). Чтение
+по kAdviceWillNeed выполняется ядром асинхронно. Там, где подсказки не
+поддерживаются, ничего не делает
+\param file файл
+\param offset, length начало и длина участка, в байтах
+\param advice подсказка
+\return признак, что подсказка передана */
+bool AdviseFileRange(const std::filesystem::path& file, uint64_t offset,
+    uint64_t length, ReadAdvice advice);
+
+/*! Состояние записи файла процессами (см. GetFileWriteState) */
+enum FileWriteState {
+  kWriteUnknown,  // Определить нельзя: нет доступа или не поддерживается
+  kWriteOpen,  // Файл открыт на запись
+  kWriteClosed  // Файл никем не открыт на запись
+};
+
+/*! Проверить, открыт ли файл на запись каким-либо процессом. В Linux
+перебираются открытые файлы процессов в /proc (видны только процессы,
+доступные текущему пользователю), в Windows файл открывается без совместной
+записи. На остальных системах состояние неизвестно
+\param file файл
+\return состояние записи файла */
+FileWriteState GetFileWriteState(const std::filesystem::path& file);
+
+/*! Исключительная блокировка файла между процессами (flock, в Windows -
+открытие без совместного доступа). Блокировка удерживается, пока существует
+объект. Файл блокировки создаётся при необходимости и не удаляется: иначе
+процесс, открывший файл перед удалением, и процесс, создавший новый файл,
+получили бы блокировку одновременно */
+class FileLock {
+ public:
+  /*! Захватить блокировку без ожидания. Если блокировка занята другим
+  процессом или файл нельзя открыть, выбрасывается std::runtime_error
+  \param file файл блокировки */
+  explicit FileLock(const std::filesystem::path& file);
+  virtual ~FileLock();
+
+ private:
+  FileLock(const FileLock&) = delete;
+  FileLock(FileLock&&) = delete;
+  FileLock& operator=(const FileLock&) = delete;
+  FileLock& operator=(FileLock&&) = delete;
+
+#ifdef _WIN32
+  void* handle_;
+#else
+  int fd_;
+#endif  // _WIN32
+};
+
+/*! Захватить блокировку, ожидая её освобождения другим процессом
+\param file файл блокировки
+\param timeout максимальное время ожидания
+\return объект блокировки или nullptr, если блокировку не удалось получить */
+std::shared_ptr<FileLock> WaitLock(
+    const std::filesystem::path& file, std::chrono::milliseconds timeout);
+
+#endif  // FILEOPS_H
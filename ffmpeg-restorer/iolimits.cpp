@@ -0,0 +1,211 @@
+#include "iolimits.h"
+
+#include <algorithm>
+#include <condition_variable>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#endif  // _WIN32
+
+#include "home-dir.h"
+#include "json.hpp"
+
+namespace fs = std::filesystem;
+using json = nlohmann::json;
+
+const std::string kConfigFile = "ffmpeg-restorer.cfg";
+const std::string kConfigIoLimits = "io_limits";
+const std::string kConfigReaders = "readers";
+const std::string kConfigWriters = "writers";
+const std::string kConfigDevices = "devices";
+
+
+/*! Лимиты и занятость устройств, общие для процесса */
+struct DeviceRegistry {
+  std::mutex Lock;
+  std::condition_variable Released;  //!< Освобождение мест
+  bool Loaded = false;  //!< Лимиты прочитаны из конфигурационного файла
+  size_t Readers = 0;  //!< Общий лимит читателей, 0 - без ограничения
+  size_t Writers = 0;  //!< Общий лимит писателей, 0 - без ограничения
+  std::map<uint64_t, std::pair<size_t, size_t>> Limits;  //!< Лимиты
+                                                          //!< (читатели,
+                                                          //!< писатели) для
+                                                          //!< устройств
+  std::map<std::pair<uint64_t, bool>, size_t> Busy;  //!< Занятые места
+};
+
+
+DeviceRegistry& GetRegistry() {
+  static DeviceRegistry registry;
+  return registry;
+}
+
+
+/*! Определить устройство, на котором расположен файл
+\param path файл или папка. Для несуществующего файла берётся его папка
+\param device возвращает идентификатор устройства
+\return признак успешного определения */
+bool GetDevice(const fs::path& path, uint64_t& device) {
+#ifdef _WIN32
+  std::error_code err;
+  auto root = fs::absolute(path, err).root_name().string();
+  device = std::hash<std::string>()(root);
+  return !err;
+#else
+  struct stat st;
+  if (stat(path.c_str(), &st) != 0) {
+    std::error_code err;
+    auto dir = fs::absolute(path, err).parent_path();
+    if (err || stat(dir.c_str(), &st) != 0) {
+      return false;
+    }
+  }
+  device = static_cast<uint64_t>(st.st_dev);
+  return true;
+#endif  // _WIN32
+}
+
+
+/*! Прочитать лимит из конфигурации
+\param limits объект с лимитами
+\param key ключ лимита
+\param def значение, если лимит не задан
+\return лимит. Отрицательное или нечисловое значение - ошибка конфигурации */
+size_t ReadLimit(const json& limits, const std::string& key, size_t def) {
+  auto it = limits.find(key);
+  if (it == limits.end()) {
+    return def;
+  }
+  if (!it->is_number_unsigned()) {
+    throw std::invalid_argument(
+        "I/O limit '" + key + "' must be a non-negative integer");
+  }
+  return it->get<size_t>();
+}
+
+
+/*! Прочитать лимиты из конфигурационного файла. При ошибке ограничений нет.
+Вызывается под Lock
+\param registry заполняемые лимиты */
+void LoadLimits(DeviceRegistry& registry) {
+  registry.Loaded = true;
+  try {
+    fs::path cfg = fs::path(HomeDirLibrary::GetDataDir()) / kConfigFile;
+    std::ifstream f(cfg);
+    if (!f) {
+      return;
+    }
+    json data = json::parse(f);
+    auto it = data.find(kConfigIoLimits);
+    if (it == data.end()) {
+      return;
+    }
+    registry.Readers = ReadLimit(*it, kConfigReaders, 0);
+    registry.Writers = ReadLimit(*it, kConfigWriters, 0);
+    auto devices = it->find(kConfigDevices);
+    if (devices == it->end()) {
+      return;
+    }
+    for (const auto& item : devices->items()) {
+      uint64_t device;
+      if (!GetDevice(item.key(), device)) {
+        std::cerr << "WARNING: Unknown device for I/O limits: " << item.key()
+                  << std::endl;
+        continue;
+      }
+      registry.Limits[device] = {
+          ReadLimit(item.value(), kConfigReaders, registry.Readers),
+          ReadLimit(item.value(), kConfigWriters, registry.Writers)};
+    }
+  } catch (std::exception& err) {
+    std::cerr << "WARNING: Wrong configuration file: " << err.what()
+              << std::endl;
+    registry.Readers = 0;
+    registry.Writers = 0;
+    registry.Limits.clear();
+  }
+}
+
+
+DeviceLease::DeviceLease() {}
+
+DeviceLease::~DeviceLease() { Release(); }
+
+
+void DeviceLease::Acquire(const std::vector<IoAccess>& access) {
+  Release();
+  Take(access, true);
+}
+
+
+bool DeviceLease::TryAcquire(const std::vector<IoAccess>& access) {
+  Release();
+  return Take(access, false);
+}
+
+
+void DeviceLease::Release() {
+  if (held_.empty()) {
+    return;
+  }
+  auto& registry = GetRegistry();
+  {
+    std::lock_guard<std::mutex> lk(registry.Lock);
+    for (const auto& slot : held_) {
+      --registry.Busy[slot];
+    }
+  }
+  held_.clear();
+  registry.Released.notify_all();
+}
+
+
+bool DeviceLease::Take(const std::vector<IoAccess>& access, bool wait) {
+  // Несколько файлов операции на одном устройстве занимают одно место
+  std::vector<Slot> slots;
+  for (const auto& item : access) {
+    uint64_t device;
+    if (GetDevice(item.File, device)) {
+      slots.push_back({device, item.Write});
+    }
+  }
+  std::sort(slots.begin(), slots.end());
+  slots.erase(std::unique(slots.begin(), slots.end()), slots.end());
+
+  auto& registry = GetRegistry();
+  std::unique_lock<std::mutex> lk(registry.Lock);
+  if (!registry.Loaded) {
+    LoadLimits(registry);
+  }
+  auto available = [&]() {
+    for (const auto& slot : slots) {
+      size_t limit = slot.second ? registry.Writers : registry.Readers;
+      auto it = registry.Limits.find(slot.first);
+      if (it != registry.Limits.end()) {
+        limit = slot.second ? it->second.second : it->second.first;
+      }
+      if (limit != 0 && registry.Busy[slot] >= limit) {
+        return false;
+      }
+    }
+    return true;
+  };
+  if (!available()) {
+    if (!wait) {
+      return false;
+    }
+    registry.Released.wait(lk, available);
+  }
+  for (const auto& slot : slots) {
+    ++registry.Busy[slot];
+  }
+  held_ = slots;
+  return true;
+}
@@ -0,0 +1,62 @@
+#ifndef IOLIMITS_H
+#define IOLIMITS_H
+
+#include <cstdint>
+#include <filesystem>
+#include <utility>
+#include <vector>
+
+
+/*! Обращение операции к файлу: чтение или запись */
+struct IoAccess {
+  std::filesystem::path File;  //!< Файл. Для ещё не созданного файла
+                               //!< устройство определяется по его папке
+  bool Write;  //!< Запись, иначе чтение
+};
+
+/*! Занятость блочных устройств (st_dev) операциями ввода-вывода. На время
+операции (конвертация фрагмента, выделение и объединение потоков, проверка
+фрагментов, сборка выходного файла) она занимает устройства своих файлов:
+одно место читателя и/или писателя на каждое устройство, сколько бы файлов на
+нём ни было. Дописывание готовых фрагментов в промежуточный файл места не
+занимает: оно выполняется между конвертациями тем же потоком задачи.
+Количество мест ограничивается основным конфигурационным файлом
+ffmpeg-restorer.cfg, ключ "io_limits": {"readers": N, "writers": N,
+"devices": {"путь": {"readers": N, "writers": N}}}. Общие значения действуют
+для каждого устройства, значения для пути - для его устройства. 0 или
+отсутствие значения - без ограничения. Отрицательное значение - ошибка
+конфигурации, тогда ограничений нет. Счётчики общие для процесса: задачи
+выполняются одним процессом, удерживающим блокировку запуска */
+class DeviceLease {
+ public:
+  DeviceLease();
+  virtual ~DeviceLease();
+
+  /*! Занять устройства файлов, ожидая освобождения мест. Устройства
+  занимаются все сразу, поэтому ожидающие операции не блокируют друг друга.
+  Ранее занятые этим объектом устройства освобождаются
+  \param access файлы операции */
+  void Acquire(const std::vector<IoAccess>& access);
+
+  /*! Занять устройства файлов, если на всех есть свободные места
+  \param access файлы операции
+  \return признак, что устройства заняты */
+  bool TryAcquire(const std::vector<IoAccess>& access);
+
+  /*! Освободить занятые устройства */
+  void Release();
+
+ private:
+  DeviceLease(const DeviceLease&) = delete;
+  DeviceLease(DeviceLease&&) = delete;
+  DeviceLease& operator=(const DeviceLease&) = delete;
+  DeviceLease& operator=(DeviceLease&&) = delete;
+
+  using Slot = std::pair<uint64_t, bool>;  // Устройство, запись
+
+  std::vector<Slot> held_;  //!< Занятые места
+
+  bool Take(const std::vector<IoAccess>& access, bool wait);
+};
+
+#endif  // IOLIMITS_H
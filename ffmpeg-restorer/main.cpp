@@ -1,18 +1,42 @@
 #include <algorithm>
 #include <cassert>
+#include <chrono>
+#include <ctime>
 #include <filesystem>
+#include <iomanip>
 #include <iostream>
+#include <map>
 #include <set>
+#include <sstream>
+#include <thread>
 #include <vector>
 
-#include "exclusive-lock-file.h"
+#include "fileops.h"
 #include "home-dir.h"
+#include "server.h"
+#include "status.h"
 #include "task.h"
 
 
 namespace fs = std::filesystem;
 
 const std::string kRunLockFile = "run.lock";
+const std::string kStatusFile = "status.shm";
+
+// Пауза перед повторным просмотром задач, занятых другими процессами
+const std::chrono::milliseconds kBusyTaskRetry(1000);
+// Период проверки появления более приоритетных задач
+const std::chrono::milliseconds kPreemptCheckInterval(10000);
+
+const std::string kOptionPriority = "--priority";
+const std::string kOptionDeadline = "--deadline";
+const std::string kOptionStreamConcat = "--stream-concat";
+const std::string kOptionInterim = "--interim";
+const std::string kOptionScratch = "--scratch";
+const std::string kOptionRange = "--range";
+const std::string kOptionSmart = "--smart";
+const std::string kOptionFollow = "--follow";
+const std::string kOptionFollowIdle = "--follow-idle";
 
 const std::string kCommandHelp1 = "help";
 const std::string kCommandHelp2 = "--help";
@@ -20,6 +44,8 @@ const std::string kCommandList = "list";
 const std::string kCommandAdd = "add";
 const std::string kCommandFlush = "flush";
 const std::string kCommandRemoveAll = "removeall";
+const std::string kCommandServe = "serve";
+const std::string kCommandStatus = "status";
 const std::string kCommandVersion = "version";
 
 // Примечание
@@ -39,12 +65,67 @@ const char kHelpMessage[] =
     "Usage:\n"
     "  ffmpegrr [command [arguments]]\n"
     "Commands:\n"
-    "  add [ffmpeg arguments] - add new task for convertation\n"
+    "  add [options] [ffmpeg arguments] - add new task for convertation\n"
+    "    --priority N - tasks with higher priority run first and preempt\n"
+    "      lower priority tasks at chunk boundaries (default 0)\n"
+    "    --deadline TIME - desired completion time: YYYY-MM-DDTHH:MM (local)\n"
+    "      or seconds since epoch. Tasks of equal priority run earliest\n"
+    "      deadline first, taking the estimated remaining time into account\n"
+    "    --stream-concat - convert chunks to MPEG-TS and append them to the\n"
+    "      interim video file as soon as the leading chunks are ready\n"
+    "    --interim FORMAT - format of video chunks: native (container of the\n"
+    "      output file, default), ts (MPEG-TS, joined without ffmpeg), fmp4\n"
+    "      (fragmented MP4) or mkv (Matroska without index). Chunks are muxed\n"
+    "      into the output container once, at the final pass\n"
+    "    --scratch DIR - directory for chunks and interim files, may be\n"
+    "      repeated. The directory with enough free space on a device other\n"
+    "      than the source is chosen. Default list is the \"scratch\" array\n"
+    "      in ~/.config/ffmpeg-restorer.cfg, otherwise the task directory\n"
+    "    --range START-END - convert only this time range, may be repeated.\n"
+    "      Ranges are joined in the given order. Time is in seconds or\n"
+    "      [HH:]MM:SS. Input -ss/-t/-to arguments are treated as a range\n"
+    "    --smart - with time ranges, copy whole closed GOPs (starting with\n"
+    "      IDR frames) of the source and re-encode only the partial GOPs at\n"
+    "      cut points. The encoder must produce the source codec, video\n"
+    "      filters are not allowed. If the re-encoded video differs from the\n"
+    "      source in profile, level, refs or SAR, the whole video is\n"
+    "      re-encoded. Chunks are kept in MPEG-TS: codec parameters travel\n"
+    "      with each key frame\n"
+    "    --follow - the input file is still being written: chunks are\n"
+    "      converted as soon as enough data follows them. The recording is\n"
+    "      complete when file INPUT.end appears or when the process that\n"
+    "      was writing the file closes it. While waiting for new data the\n"
+    "      task gives way to other tasks\n"
+    "    --follow-idle SECONDS - with --follow, the recording is also\n"
+    "      complete when the input file hasn't grown for SECONDS\n"
+    "    Output file with .m3u8 extension is an HLS playlist: video chunks\n"
+    "      are written next to it as MPEG-TS segments and listed in the\n"
+    "      playlist as soon as the leading ones are ready. Audio is encoded\n"
+    "      in one pass as a separate rendition (NAME_audio.m3u8), the output\n"
+    "      file becomes a master playlist. For a growing source the audio\n"
+    "      rendition is added when the recording is complete\n"
+    "    Several output files, each with its own arguments and separated by\n"
+    "      --next-output, are converted by one ffmpeg run per chunk: the\n"
+    "      source is decoded once\n"
+    "    Several input files (-i ... -i ...) are converted as one timeline\n"
+    "      into one output, chunks don't cross file boundaries\n"
     "  flush - remove completed (finished) tasks\n"
     "  help, --help - print help\n"
     "  list - print list of tasks\n"
     "  removeall - remove all tasks\n"
+    "  serve - run as a service: process tasks as they appear and accept\n"
+    "    control requests (add, cancel, pause, resume, status) on\n"
+    "    ~/.ffmpegrr/control.sock\n"
+    "  status - print progress of the running conversion\n"
     "Run without command resume tasks, added earlier\n"
+    "Concurrent reads and writes per storage device are limited by the\n"
+    "  \"io_limits\" object in ~/.config/ffmpeg-restorer.cfg: {\"readers\": N,\n"
+    "  \"writers\": N, \"devices\": {\"PATH\": {\"readers\": N, ...}}}. While a\n"
+    "  device of the next chunk is busy, chunks on other devices are converted\n"
+    "Converted chunks are kept in a cache and reused by identical tasks when\n"
+    "  \"chunk_cache\": {\"size\": MB, \"dir\": PATH} is set in the same file.\n"
+    "  The cache is keyed by source file, chunk bounds, ffmpeg arguments and\n"
+    "  version; least recently used chunks are removed above the size\n"
     "\n"
     "Examples:\n"
     "Add task for video stream copy:\n"
@@ -59,7 +140,9 @@ const char kTitleMessage[] =
 
 // clang-format on
 
+fs::path g_AppDir;
 std::string g_RunLockPath;
+fs::path g_StatusPath;
 
 void PrintHelp() { std::cout << kHelpMessage << std::endl; }
 
@@ -78,12 +161,105 @@ bool InitFolders() {
     return false;
   }
 
+  g_AppDir = app_dir;
   auto lp = app_dir / kRunLockFile;
   g_RunLockPath = lp.string();
+  g_StatusPath = app_dir / kStatusFile;
   return true;
 }
 
 
+/*! Разобрать срок готовности задачи
+\param value строка со сроком: YYYY-MM-DDTHH:MM[:SS] (местное время) или
+секунды от эпохи
+\param deadline возвращаемый срок, секунды от эпохи
+\return признак успешного разбора */
+bool ParseDeadline(const std::string& value, long long& deadline) {
+  if (!value.empty() &&
+      value.find_first_not_of("0123456789") == std::string::npos) {
+    deadline = std::stoll(value);
+    return true;
+  }
+  std::tm tm = {};
+  std::istringstream ss(value);
+  ss >> std::get_time(&tm, "%Y-%m-%dT%H:%M");
+  if (ss.fail()) {
+    return false;
+  }
+  if (ss.peek() == ':') {
+    ss.ignore();
+    ss >> tm.tm_sec;
+  }
+  tm.tm_isdst = -1;
+  auto t = std::mktime(&tm);
+  if (t == -1) {
+    return false;
+  }
+  deadline = static_cast<long long>(t);
+  return true;
+}
+
+
+/*! Разобрать параметры задачи, указанные перед аргументами ffmpeg.
+Разобранные аргументы пропускаются
+\param argc, argv аргументы команды add, возвращаются без разобранных
+\param options возвращаемые параметры задачи
+\return признак успешного разбора */
+bool ParseTaskOptions(int& argc, char**& argv, TaskOptions& options) {
+  try {
+    while (argc >= 1) {
+      std::string name = argv[0];
+      if (name == kOptionStreamConcat) {
+        options.StreamConcat = true;
+        argc -= 1;
+        argv += 1;
+        continue;
+      }
+      if (name == kOptionSmart) {
+        options.SmartRender = true;
+        argc -= 1;
+        argv += 1;
+        continue;
+      }
+      if (name == kOptionFollow) {
+        options.Follow = true;
+        argc -= 1;
+        argv += 1;
+        continue;
+      }
+      if (argc < 2) {
+        break;
+      }
+      std::string value = argv[1];
+      if (name == kOptionPriority) {
+        options.Priority = std::stoi(value);
+      } else if (name == kOptionInterim) {
+        options.InterimFormat = value;
+      } else if (name == kOptionScratch) {
+        options.Scratch.push_back(value);
+      } else if (name == kOptionRange) {
+        options.Ranges.push_back(value);
+      } else if (name == kOptionFollowIdle) {
+        options.FollowIdle = std::stoll(value);
+      } else if (name == kOptionDeadline) {
+        if (!ParseDeadline(value, options.Deadline)) {
+          std::cerr << "Wrong deadline '" << value << "'" << std::endl;
+          return false;
+        }
+      } else {
+        break;
+      }
+      argc -= 2;
+      argv += 2;
+    }
+    return true;
+  } catch (std::exception&) {
+    std::cerr << "Wrong value of option " << argv[0] << std::endl;
+  }
+  return false;
+}
+
+
 /*! Выполнить команду list - выдать список задач */
 void CommandList() {
   auto tasks = Task::GetTasks();
@@ -93,54 +269,142 @@ void CommandList() {
 }
 
 
-/*! Обработать все задачи по-очереди */
+/*! Проверить, есть ли задачи, которые ещё не обрабатывались
+\param processed уже обработанные задачи
+\return признак наличия необработанных задач */
+bool HasUnprocessedTasks(const std::set<size_t>& processed) {
+  auto tasks = Task::GetTasks();
+  for (auto it = tasks.begin(); it != tasks.end(); ++it) {
+    if (processed.find(*it) == processed.end()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+
+/*! Обработать все задачи по-очереди в порядке приоритета (см.
+Task::GetSchedule). Список задач просматривается заново после каждой задачи,
+поэтому задачи, добавленные во время обработки, тоже будут выполнены. Задача
+вытесняется на границе фрагмента, если появилась задача с более высоким
+приоритетом. Задачи, занятые другими процессами (например, ещё создаваемые),
+и задачи, ожидающие роста исходного файла, ожидаются */
 void ProcessAllTasks() {
   std::set<size_t> processed;  //!< Уже обработанные/удалённые задачи
+  std::map<size_t, std::chrono::steady_clock::time_point>
+      waiting;  //!< Задачи, ожидающие роста исходного файла, и время повтора
+  auto ready = [&](size_t id) {
+    auto w = waiting.find(id);
+    return w == waiting.end() || w->second <= std::chrono::steady_clock::now();
+  };
   bool runmore = true;
   while (runmore) {
+    bool busy = false;  // Есть задачи, занятые другими процессами или
+                        // ожидающие роста исходного файла
     try {
       runmore = false;
 
-      exclusive_lock_file fl(g_RunLockPath);
+      FileLock fl(g_RunLockPath);
+      LiveStatus status;
+      if (!status.OpenForWrite(g_StatusPath)) {
+        std::cerr << "WARNING: Can't publish status of processing" << std::endl;
+      }
 
-      auto tasks = Task::GetTasks();
+      auto schedule = Task::GetSchedule();
 
-      for (auto it = tasks.begin(); it != tasks.end(); ++it) {
-        if (processed.find(*it) != processed.end()) {
+      for (auto si = schedule.begin(); si != schedule.end(); ++si) {
+        size_t id = si->Id;
+        if (processed.find(id) != processed.end()) {
+          continue;
+        }
+        if (!ready(id)) {
+          busy = true;
+          continue;
+        }
+        waiting.erase(id);
+
+        auto tl = Task::LockTask(id);
+        if (!tl) {
+          busy = true;
+          continue;
+        }
+        if (!Task::TaskExists(id)) {
+          // Задача удалена другим процессом после получения списка
+          processed.insert(id);
           continue;
         }
 
         Task t;
-        if (t.CreateFromID(*it)) {
-          t.Run();
+        bool preempted = false;
+        if (t.CreateFromID(id)) {
+          if (!t.CheckDiskSpace()) {
+            // Задача не поместится на диск. Оставим её до следующего запуска
+            processed.insert(id);
+            continue;
+          }
+          auto priority = t.GetPriority();
+          auto last_check = std::chrono::steady_clock::now();
+          t.Run(&status, [&]() {
+            auto now = std::chrono::steady_clock::now();
+            if (now - last_check < kPreemptCheckInterval) {
+              return false;
+            }
+            last_check = now;
+            preempted = Task::HasPreemptingTask(id, priority,
+                [&](size_t other) {
+                  return processed.count(other) == 0 && ready(other);
+                });
+            return preempted;
+          });
         } else {
-          std::cerr << "Task " << *it << " is corrupted and will be removed"
+          std::cerr << "Task " << id << " is corrupted and will be removed"
                     << std::endl;
-          Task::DeleteTask(*it);
+          Task::DeleteTask(id);
         }
-        processed.insert(*it);
+        if (t.IsWaitingSource()) {
+          waiting[id] = std::chrono::steady_clock::now() + kFollowPollInterval;
+        } else if (!preempted) {
+          processed.insert(id);
+        }
+        // Очередь могла измениться: выберем следующую задачу заново
         runmore = true;
+        break;
       }
     } catch (std::runtime_error&) {
-      // Уже есть запущенный процесс для обработки задач
+      // Уже есть запущенный процесс для обработки задач. Он сам подхватит
+      // новые задачи
       std::cout << "Tasks are already being processed by another process"
                 << std::endl;
+      return;
+    }
+
+    if (!runmore && busy) {
+      std::this_thread::sleep_for(kBusyTaskRetry);
+      runmore = true;
+    }
+    if (!runmore) {
+      // Задача могла быть добавлена после последнего просмотра списка, но до
+      // снятия блокировки: процесс добавления в этом случае на нас надеется
+      runmore = HasUnprocessedTasks(processed);
     }
   }
 }
 
 
-/*! Удалить все завершенные задачи */
+/*! Удалить все завершенные задачи. Задачи, занятые другими процессами,
+пропускаются */
 void CommandFlush() {
   try {
-    exclusive_lock_file fl(g_RunLockPath);
-
     size_t amount = 0;
     auto tasks = Task::GetTasks();
 
     for (auto it = tasks.begin(); it != tasks.end(); ++it) {
+      auto tl = Task::LockTask(*it);
+      if (!tl) {
+        continue;
+      }
       Task t;
-      if (t.CreateFromID(*it)) {
+      if (t.CreateFromID(*it, false)) {
         if (!t.TaskCompleted()) {
           continue;
         }
@@ -152,28 +416,104 @@ void CommandFlush() {
     }
 
     std::cout << "Flushed " << amount << " tasks" << std::endl;
-  } catch (std::runtime_error&) {
-    std::cout << "Flush is blocked while processing tasks" << std::endl;
+  } catch (std::exception& err) {
+    std::cerr << "ERROR: Flush failed: " << err.what() << std::endl;
   }
 }
 
 
-/*! Удалить все задачи */
+/*! Удалить все задачи, кроме занятых другими процессами */
 void CommandRemoveAll() {
   try {
-    exclusive_lock_file fl(g_RunLockPath);
+    size_t amount = 0;
+    size_t busy = 0;
     auto tasks = Task::GetTasks();
 
     for (auto it = tasks.begin(); it != tasks.end(); ++it) {
+      auto tl = Task::LockTask(*it);
+      if (!tl) {
+        ++busy;
+        continue;
+      }
       Task::DeleteTask(*it);
+      ++amount;
     }
 
-    std::cout << "Removed " << tasks.size() << " tasks" << std::endl;
+    std::cout << "Removed " << amount << " tasks" << std::endl;
+    if (busy > 0) {
+      std::cout << busy << " tasks are being processed and weren't removed"
+                << std::endl;
+    }
+  } catch (std::exception& err) {
+    std::cerr << "ERROR: Remove failed: " << err.what() << std::endl;
+  }
+}
+
+/*! Выполнить команду serve - работать в режиме сервиса
+\return признак штатного завершения */
+bool CommandServe() {
+  try {
+    FileLock fl(g_RunLockPath);
+    Server srv;
+    return srv.Run(g_AppDir, g_StatusPath);
   } catch (std::runtime_error&) {
-    std::cout << "RemoveAll is blocked while processing tasks" << std::endl;
+    std::cout << "Tasks are already being processed by another process"
+              << std::endl;
+  }
+  return false;
+}
+
+
+/*! Выполнить команду status - вывести состояние запущенной обработки задач.
+Блокировка запуска задач не требуется */
+void CommandStatus() {
+  const char* kPhaseNames[] = {"idle", "Extract non-video streams",
+      "Video convertation", "Concatenate video chunks and merge streams",
+      "Merge streams", "Join video chunks",
+      "Direct conversion (stream copy)"};
+
+  LiveStatus status;
+  LiveStatus::Snapshot snap;
+  if (!status.OpenForRead(g_StatusPath) || !status.Read(snap) ||
+      snap.Pid == 0) {
+    std::cout << "Tasks aren't being processed" << std::endl;
+    return;
+  }
+
+  std::cout << "Process: " << snap.Pid << std::endl;
+  if (snap.TaskId == 0) {
+    std::cout << "No task in progress" << std::endl;
+    return;
+  }
+  std::cout << "Task " << snap.TaskId << ": ";
+  if (snap.Phase < sizeof(kPhaseNames) / sizeof(kPhaseNames[0])) {
+    std::cout << kPhaseNames[snap.Phase];
+  }
+  std::cout << std::endl;
+  std::cout << "  Chunks: " << snap.ChunksCompleted << "/" << snap.ChunksTotal
+            << std::endl;
+  for (uint32_t i = 0; i < snap.WorkerAmount && i < LiveStatus::kMaxWorkers;
+       ++i) {
+    std::cout << "  Worker " << i << ": ";
+    if (snap.WorkerChunk[i] == LiveStatus::kNoChunk) {
+      std::cout << "idle" << std::endl;
+    } else {
+      std::cout << "chunk " << snap.WorkerChunk[i] + 1 << std::endl;
+    }
   }
+  if (snap.Speed > 0.0) {
+    uint64_t eta = snap.Eta / 1000000;
+    std::cout << "  Speed: " << std::fixed << std::setprecision(2)
+              << snap.Speed << "x" << std::endl;
+    std::cout << "  ETA: " << eta / 3600 << ":" << std::setw(2)
+              << std::setfill('0') << eta % 3600 / 60 << ":" << std::setw(2)
+              << std::setfill('0') << eta % 60 << std::endl;
+  }
+  std::cout << "  Written: " << snap.BytesWritten / 1048576 << " MB"
+            << std::endl;
 }
 
+
 /*! Вывести версию приложения */
 void CommandVersion() {
   std::cout << "Version: " << kApplicationVersion << std::endl;
@@ -190,18 +530,19 @@ int main(int argc, char** argv) {
     std::string command = argv[1];
 
     if (command == kCommandAdd) {
-      try {
-        exclusive_lock_file fl(g_RunLockPath);
-        Task t;
-        if (!t.CreateFromArguments(argc - 2, argv + 2)) {
-          std::cerr << "Failed to create new task from specified arguments"
-                    << std::endl;
-          return 1;
-        }
-      } catch (std::runtime_error&) {
-        std::cout << "Add is blocked while processing tasks" << std::endl;
-        return 0;
+      int targc = argc - 2;
+      char** targv = argv + 2;
+      TaskOptions options;
+      if (!ParseTaskOptions(targc, targv, options)) {
+        return 1;
       }
+      Task t;
+      if (!t.CreateFromArguments(targc, targv, options)) {
+        std::cerr << "Failed to create new task from specified arguments"
+                  << std::endl;
+        return 1;
+      }
+      t.Clear();
       ProcessAllTasks();
     } else if (command == kCommandHelp1 || command == kCommandHelp2) {
       PrintHelp();
@@ -211,6 +552,12 @@ int main(int argc, char** argv) {
       CommandFlush();
     } else if (command == kCommandRemoveAll) {
       CommandRemoveAll();
+    } else if (command == kCommandServe) {
+      if (!CommandServe()) {
+        return 1;
+      }
+    } else if (command == kCommandStatus) {
+      CommandStatus();
     } else if (command == kCommandVersion) {
       CommandVersion();
     } else {
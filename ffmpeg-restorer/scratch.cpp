@@ -0,0 +1,102 @@
+#include "scratch.h"
+
+#include <fstream>
+#include <iostream>
+#include <tuple>
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#endif  // _WIN32
+
+#ifdef __linux__
+#include <linux/magic.h>
+#include <sys/vfs.h>
+#endif  // __linux__
+
+#include "home-dir.h"
+#include "json.hpp"
+
+namespace fs = std::filesystem;
+using json = nlohmann::json;
+
+const std::string kConfigFile = "ffmpeg-restorer.cfg";
+const std::string kConfigScratch = "scratch";
+
+
+bool SameDevice(const fs::path& path1, const fs::path& path2) {
+#ifdef _WIN32
+  return path1.root_name() == path2.root_name();
+#else
+  struct stat st1, st2;
+  if (stat(path1.c_str(), &st1) != 0 || stat(path2.c_str(), &st2) != 0) {
+    return false;
+  }
+  return st1.st_dev == st2.st_dev;
+#endif  // _WIN32
+}
+
+
+/*! Проверить, что папка расположена в оперативной памяти
+\param path путь к папке
+\return признак файловой системы tmpfs */
+bool IsMemoryFs(const fs::path& path) {
+#ifdef __linux__
+  struct statfs st;
+  if (statfs(path.c_str(), &st) != 0) {
+    return false;
+  }
+  return st.f_type == TMPFS_MAGIC;
+#else
+  return false;
+#endif  // __linux__
+}
+
+
+std::vector<fs::path> GetGlobalScratchDirs() {
+  std::vector<fs::path> dirs;
+  try {
+    fs::path cfg = fs::path(HomeDirLibrary::GetDataDir()) / kConfigFile;
+    std::ifstream f(cfg);
+    if (!f) {
+      return dirs;
+    }
+    json data = json::parse(f);
+    auto it = data.find(kConfigScratch);
+    if (it == data.end()) {
+      return dirs;
+    }
+    for (const auto& item : *it) {
+      dirs.push_back(item.get<std::string>());
+    }
+  } catch (std::exception& err) {
+    std::cerr << "WARNING: Wrong configuration file: " << err.what()
+              << std::endl;
+    dirs.clear();
+  }
+  return dirs;
+}
+
+
+fs::path ChooseScratchDir(const std::vector<fs::path>& candidates,
+    const fs::path& source, uint64_t required) {
+  fs::path best;
+  std::tuple<bool, bool, uintmax_t> best_rank;
+  for (const auto& dir : candidates) {
+    std::error_code err;
+    if (!fs::is_directory(dir, err)) {
+      continue;
+    }
+    auto space = fs::space(dir, err);
+    if (err || space.available < required) {
+      continue;
+    }
+    bool other_device = !SameDevice(dir, source);
+    bool memory = IsMemoryFs(dir) && required <= space.available / 2;
+    auto rank = std::make_tuple(other_device, memory, space.available);
+    if (best.empty() || rank > best_rank) {
+      best = fs::absolute(dir, err);
+      best_rank = rank;
+    }
+  }
+  return best;
+}
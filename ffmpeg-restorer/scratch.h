@@ -0,0 +1,34 @@
+#ifndef SCRATCH_H
+#define SCRATCH_H
+
+#include <cstdint>
+#include <filesystem>
+#include <vector>
+
+
+/*! Прочитать папки для временных файлов задач (фрагменты, промежуточные
+файлы) из основного конфигурационного файла ffmpeg-restorer.cfg, ключ
+"scratch" - массив путей
+\return список папок, пустой - временные файлы хранятся в папке задачи */
+std::vector<std::filesystem::path> GetGlobalScratchDirs();
+
+/*! Проверить, что два пути расположены на одном устройстве
+\param path1, path2 пути к существующим файлам или папкам
+\return признак одного устройства, false - разные или неизвестно */
+bool SameDevice(
+    const std::filesystem::path& path1, const std::filesystem::path& path2);
+
+/*! Выбрать папку для временных файлов задачи. Подходят существующие папки с
+достаточным свободным местом. Предпочтение отдаётся папкам на другом
+устройстве, чем исходный файл (чтение и запись не конкурируют), затем папкам
+в оперативной памяти (tmpfs, если задача занимает не больше половины
+свободного места), затем папкам с наибольшим свободным местом
+\param candidates папки-кандидаты
+\param source исходный файл задачи
+\param required оценка необходимого места, в байтах
+\return выбранная папка или пустой путь, если ни одна не подходит */
+std::filesystem::path ChooseScratchDir(
+    const std::vector<std::filesystem::path>& candidates,
+    const std::filesystem::path& source, uint64_t required);
+
+#endif  // SCRATCH_H
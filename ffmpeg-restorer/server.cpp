@@ -0,0 +1,456 @@
+#include "server.h"
+
+#include <algorithm>
+#include <chrono>
+#include <csignal>
+#include <cstring>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif  // _WIN32
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif  // __linux__
+
+#include "fileops.h"
+#include "json.hpp"
+#include "task.h"
+
+namespace fs = std::filesystem;
+namespace chr = std::chrono;
+using json = nlohmann::json;
+
+const std::string kControlSocketFile = "control.sock";
+
+// Период повторного просмотра задач без событий (на платформах без inotify)
+const chr::milliseconds kRescanInterval(5000);
+// Период проверки задач, занятых другими процессами. Файлы блокировок не
+// удаляются, поэтому снятие блокировки не порождает событий в папке задач
+const chr::milliseconds kBusyRetryInterval(500);
+// Период проверки появления более приоритетных задач
+const chr::milliseconds kPreemptCheckInterval(10000);
+const int kPollInterval = 500;  // миллисекунды
+const int kListenBacklog = 8;
+const size_t kReadBufferSize = 4096;
+const size_t kMaxRequestSize = 1048576;
+
+
+std::atomic<bool> g_StopRequested(false);
+
+void StopSignalHandler(int) { g_StopRequested = true; }
+
+
+Server::Server(): stop_(false), rescan_(false), running_(0) {}
+
+Server::~Server() {}
+
+
+#ifdef _WIN32
+
+bool Server::Run(const std::filesystem::path& app_dir,
+    const std::filesystem::path& status_file) {
+  std::cerr << "ERROR: Service mode isn't supported on this platform"
+            << std::endl;
+  return false;
+}
+
+void Server::ClientLoop(int fd) {}
+
+#else  // _WIN32
+
+bool Server::Run(const std::filesystem::path& app_dir,
+    const std::filesystem::path& status_file) {
+  app_dir_ = app_dir;
+  if (!status_.OpenForWrite(status_file)) {
+    std::cerr << "WARNING: Can't publish status of processing" << std::endl;
+  }
+
+  auto socket_path = app_dir_ / kControlSocketFile;
+  sockaddr_un addr;
+  std::memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (socket_path.string().size() >= sizeof(addr.sun_path)) {
+    std::cerr << "ERROR: Control socket path is too long" << std::endl;
+    return false;
+  }
+  std::strcpy(addr.sun_path, socket_path.c_str());
+
+  int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd < 0) {
+    std::cerr << "ERROR: Can't create control socket" << std::endl;
+    return false;
+  }
+  // Блокировка запуска задач у нас, поэтому оставшийся файл сокета - мусор
+  std::error_code err;
+  fs::remove(socket_path, err);
+  if (bind(listen_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 ||
+      chmod(socket_path.c_str(), S_IRUSR | S_IWUSR) != 0 ||
+      listen(listen_fd, kListenBacklog) != 0) {
+    std::cerr << "ERROR: Can't listen control socket " << socket_path
+              << std::endl;
+    close(listen_fd);
+    return false;
+  }
+
+  int notify_fd = -1;
+#ifdef __linux__
+  notify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (notify_fd >= 0 &&
+      inotify_add_watch(notify_fd, app_dir_.c_str(),
+          IN_CREATE | IN_DELETE | IN_MOVED_TO | IN_MOVED_FROM) < 0) {
+    close(notify_fd);
+    notify_fd = -1;
+  }
+#endif  // __linux__
+  if (notify_fd < 0) {
+    std::cout << "Task folder isn't watched, it will be rescanned periodically"
+              << std::endl;
+  }
+
+  g_StopRequested = false;
+  auto prev_int = std::signal(SIGINT, StopSignalHandler);
+  auto prev_term = std::signal(SIGTERM, StopSignalHandler);
+  auto prev_pipe = std::signal(SIGPIPE, SIG_IGN);
+
+  std::cout << "Service is started. Control socket: " << socket_path.string()
+            << std::endl;
+  std::thread scheduler(&Server::SchedulerLoop, this);
+
+  while (!g_StopRequested) {
+    pollfd fds[2];
+    fds[0].fd = listen_fd;
+    fds[0].events = POLLIN;
+    fds[0].revents = 0;
+    fds[1].fd = notify_fd;
+    fds[1].events = POLLIN;
+    fds[1].revents = 0;
+    int res = poll(fds, notify_fd >= 0 ? 2 : 1, kPollInterval);
+    if (res <= 0) {
+      continue;
+    }
+
+    if (fds[0].revents & POLLIN) {
+      int fd = accept(listen_fd, nullptr, nullptr);
+      if (fd >= 0) {
+        std::lock_guard<std::mutex> lk(lock_);
+        client_sockets_.insert(fd);
+        std::thread(&Server::ClientLoop, this, fd).detach();
+      }
+    }
+
+    if (notify_fd >= 0 && (fds[1].revents & POLLIN)) {
+      // Содержимое событий не важно: любое изменение в папке задач (новая
+      // папка, снятая блокировка) требует повторного просмотра
+      char buf[kReadBufferSize];
+      while (read(notify_fd, buf, sizeof(buf)) > 0) {
+      }
+      Wakeup();
+    }
+  }
+
+  std::cout << "Service is stopping (the running task stops at chunk boundary)"
+            << std::endl;
+  stop_ = true;
+  Wakeup();
+  scheduler.join();
+
+  close(listen_fd);
+  fs::remove(socket_path, err);
+  if (notify_fd >= 0) {
+    close(notify_fd);
+  }
+  {
+    std::unique_lock<std::mutex> lk(lock_);
+    for (auto fd : client_sockets_) {
+      shutdown(fd, SHUT_RDWR);
+    }
+    clients_done_.wait(lk, [this]() { return client_sockets_.empty(); });
+  }
+
+  std::signal(SIGINT, prev_int);
+  std::signal(SIGTERM, prev_term);
+  std::signal(SIGPIPE, prev_pipe);
+  status_.Close();
+  return true;
+}
+
+
+void Server::ClientLoop(int fd) {
+  std::string buffer;
+  char data[kReadBufferSize];
+  while (true) {
+    auto size = recv(fd, data, sizeof(data), 0);
+    if (size <= 0) {
+      break;
+    }
+    buffer.append(data, size);
+    if (buffer.size() > kMaxRequestSize) {
+      break;
+    }
+
+    size_t pos;
+    bool failed = false;
+    while ((pos = buffer.find('\n')) != buffer.npos) {
+      auto response = HandleRequest(buffer.substr(0, pos)) + "\n";
+      buffer.erase(0, pos + 1);
+      for (size_t sent = 0; sent < response.size();) {
+        auto res = send(fd, response.data() + sent, response.size() - sent, 0);
+        if (res <= 0) {
+          failed = true;
+          break;
+        }
+        sent += res;
+      }
+      if (failed) {
+        break;
+      }
+    }
+    if (failed) {
+      break;
+    }
+  }
+
+  close(fd);
+  std::lock_guard<std::mutex> lk(lock_);
+  client_sockets_.erase(fd);
+  clients_done_.notify_all();
+}
+
+#endif  // _WIN32
+
+
+void Server::SchedulerLoop() {
+  auto last_rescan = chr::steady_clock::now();
+  while (!stop_) {
+    std::vector<size_t> candidates;
+    // Ближайший повтор задачи, ожидающей роста исходного файла
+    auto wait_until = chr::steady_clock::time_point::max();
+    {
+      auto schedule = Task::GetSchedule();
+      std::lock_guard<std::mutex> lk(lock_);
+      rescan_ = false;
+      auto now = chr::steady_clock::now();
+      for (auto& si : schedule) {
+        auto w = waiting_.find(si.Id);
+        if (w != waiting_.end()) {
+          if (w->second > now) {
+            wait_until = std::min(wait_until, w->second);
+            continue;
+          }
+          waiting_.erase(w);
+        }
+        if (processed_.count(si.Id) == 0 && paused_.count(si.Id) == 0 &&
+            deferred_.count(si.Id) == 0) {
+          candidates.push_back(si.Id);
+        }
+      }
+    }
+
+    // Первая свободная задача. Занятые (ещё создаваемые) задачи
+    // проверяются повторно через kBusyRetryInterval
+    size_t next = 0;
+    std::shared_ptr<FileLock> tl;
+    for (auto id : candidates) {
+      tl = Task::LockTask(id);
+      if (tl) {
+        next = id;
+        break;
+      }
+    }
+    if (!tl) {
+      auto interval = candidates.empty() ? kRescanInterval : kBusyRetryInterval;
+      auto deadline = std::min(chr::steady_clock::now() + interval, wait_until);
+      std::unique_lock<std::mutex> lk(lock_);
+      if (!wakeup_.wait_until(
+              lk, deadline, [this]() { return rescan_ || stop_; }) &&
+          chr::steady_clock::now() - last_rescan >= kRescanInterval) {
+        // Место на диске могло освободиться
+        deferred_.clear();
+        last_rescan = chr::steady_clock::now();
+      }
+      continue;
+    }
+
+    if (!Task::TaskExists(next)) {
+      std::lock_guard<std::mutex> lk(lock_);
+      processed_.insert(next);
+      continue;
+    }
+
+    {
+      std::lock_guard<std::mutex> lk(lock_);
+      running_ = next;
+    }
+    Task t;
+    bool preempted = false;
+    if (t.CreateFromID(next)) {
+      if (!t.CheckDiskSpace()) {
+        std::lock_guard<std::mutex> lk(lock_);
+        running_ = 0;
+        deferred_.insert(next);
+        continue;
+      }
+      auto priority = t.GetPriority();
+      auto last_check = chr::steady_clock::now();
+      t.Run(&status_, [&]() {
+        {
+          std::lock_guard<std::mutex> lk(lock_);
+          if (stop_ || paused_.count(next) != 0 ||
+              canceled_.count(next) != 0) {
+            return true;
+          }
+        }
+        auto now = chr::steady_clock::now();
+        if (now - last_check < kPreemptCheckInterval) {
+          return false;
+        }
+        last_check = now;
+        preempted = Task::HasPreemptingTask(next, priority, [this](size_t id) {
+          std::lock_guard<std::mutex> lk(lock_);
+          auto w = waiting_.find(id);
+          return processed_.count(id) == 0 && paused_.count(id) == 0 &&
+                 (w == waiting_.end() ||
+                     w->second <= chr::steady_clock::now());
+        });
+        return preempted;
+      });
+    } else {
+      std::cerr << "Task " << next << " is corrupted and will be removed"
+                << std::endl;
+      Task::DeleteTask(next);
+    }
+    t.Clear();
+
+    std::lock_guard<std::mutex> lk(lock_);
+    running_ = 0;
+    deferred_.clear();
+    if (canceled_.erase(next) != 0) {
+      Task::DeleteTask(next);
+      std::cout << "Task " << next << " is canceled" << std::endl;
+    } else if (t.IsWaitingSource()) {
+      waiting_[next] = chr::steady_clock::now() + kFollowPollInterval;
+    } else if (paused_.count(next) == 0 && !stop_ && !preempted) {
+      // Завершённая или неудавшаяся задача. Повтор - через команду resume
+      processed_.insert(next);
+    }
+  }
+}
+
+
+std::string Server::HandleRequest(const std::string& request) {
+  json resp;
+  try {
+    auto req = json::parse(request);
+    std::string command = req.value("command", "");
+
+    if (command == "add") {
+      std::vector<std::string> args = req.at("arguments");
+      std::vector<char*> argv;
+      for (auto& arg : args) {
+        argv.push_back(&arg[0]);
+      }
+      argv.push_back(nullptr);
+      TaskOptions options;
+      options.Priority = req.value("priority", 0);
+      options.Deadline = req.value("deadline", 0LL);
+      options.StreamConcat = req.value("stream_concat", false);
+      options.InterimFormat = req.value("interim", "");
+      options.Scratch =
+          req.value("scratch", std::vector<std::string>());
+      options.Ranges = req.value("ranges", std::vector<std::string>());
+      options.SmartRender = req.value("smart", false);
+      options.Follow = req.value("follow", false);
+      options.FollowIdle = req.value("follow_idle", 0LL);
+      Task t;
+      if (!t.CreateFromArguments(
+              static_cast<int>(args.size()), argv.data(), options)) {
+        throw std::invalid_argument("failed to create task");
+      }
+      resp = {{"result", "ok"}, {"task", t.GetID()}};
+      Wakeup();
+    } else if (command == "cancel") {
+      size_t id = req.at("task");
+      std::unique_lock<std::mutex> lk(lock_);
+      if (running_ == id) {
+        canceled_.insert(id);
+        resp = {{"result", "ok"}, {"state", "canceling"}};
+      } else {
+        lk.unlock();
+        auto tl = Task::LockTask(id);
+        if (!tl) {
+          throw std::runtime_error("task is busy");
+        }
+        Task::DeleteTask(id);
+        resp = {{"result", "ok"}, {"state", "canceled"}};
+      }
+    } else if (command == "pause") {
+      size_t id = req.at("task");
+      std::lock_guard<std::mutex> lk(lock_);
+      paused_.insert(id);
+      resp = {{"result", "ok"},
+          {"state", running_ == id ? "pausing" : "paused"}};
+    } else if (command == "resume") {
+      size_t id = req.at("task");
+      {
+        std::lock_guard<std::mutex> lk(lock_);
+        paused_.erase(id);
+        processed_.erase(id);
+      }
+      Wakeup();
+      resp = {{"result", "ok"}};
+    } else if (command == "status") {
+      auto tasks = Task::GetTasks();
+      LiveStatus::Snapshot snap;
+      bool has_snap = status_.Read(snap);
+      std::lock_guard<std::mutex> lk(lock_);
+      resp = {{"result", "ok"}, {"running", running_}};
+      resp["tasks"] = json::array();
+      for (auto id : tasks) {
+        std::string state = "queued";
+        if (id == running_) {
+          state = "running";
+        } else if (paused_.count(id) != 0) {
+          state = "paused";
+        } else if (processed_.count(id) != 0) {
+          state = "processed";
+        } else if (deferred_.count(id) != 0) {
+          state = "deferred";
+        }
+        resp["tasks"].push_back({{"task", id}, {"state", state}});
+      }
+      if (has_snap && snap.TaskId != 0) {
+        json cur = {{"task", snap.TaskId}, {"phase", snap.Phase},
+            {"chunks_total", snap.ChunksTotal},
+            {"chunks_completed", snap.ChunksCompleted},
+            {"speed", snap.Speed}, {"eta_us", snap.Eta},
+            {"bytes_written", snap.BytesWritten}};
+        cur["workers"] = json::array();
+        for (uint32_t i = 0;
+             i < snap.WorkerAmount && i < LiveStatus::kMaxWorkers; ++i) {
+          cur["workers"].push_back(snap.WorkerChunk[i]);
+        }
+        resp["current"] = cur;
+      }
+    } else {
+      throw std::invalid_argument("unknown command '" + command + "'");
+    }
+  } catch (std::exception& err) {
+    resp = {{"result", "error"}, {"message", err.what()}};
+  }
+  return resp.dump();
+}
+
+
+void Server::Wakeup() {
+  std::lock_guard<std::mutex> lk(lock_);
+  rescan_ = true;
+  wakeup_.notify_all();
+}
@@ -0,0 +1,87 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+
+#include "status.h"
+
+
+/*! Сервис обработки задач (команда serve). Работает постоянно: следит за
+папкой задач через inotify, выполняет задачи по мере появления и принимает
+команды через локальный UNIX-сокет. Протокол: один json-объект на строку в
+запросе и в ответе. Поддерживаемые команды (поле "command"):
+  add {"arguments": [...], "priority": N, "deadline": T,
+    "stream_concat": B, "interim": F, "scratch": [...], "ranges": [...],
+    "smart": B, "follow": B, "follow_idle": S} - создать задачу по
+    аргументам ffmpeg, приоритет, срок готовности (секунды от эпохи),
+    потоковое объединение, формат фрагментов, папки для временных файлов,
+    диапазоны времени ("НАЧАЛО-КОНЕЦ"), копирование целых GOP, растущий
+    исходный файл и предельное время без его роста (секунды) необязательны;
+  cancel {"task": id} - прервать (на границе фрагмента) и удалить задачу;
+  pause {"task": id} - приостановить задачу на границе фрагмента;
+  resume {"task": id} - продолжить приостановленную или неудавшуюся задачу;
+  status - состояние сервиса и очереди задач.
+Вызывающий должен удерживать блокировку запуска задач */
+class Server {
+ public:
+  Server();
+  virtual ~Server();
+
+  /*! Запустить сервис. Вызов синхронный, возвращается после получения
+  сигнала SIGINT/SIGTERM
+  \param app_dir папка приложения с задачами
+  \param status_file файл публикации состояния обработки
+  \return признак штатного завершения */
+  bool Run(const std::filesystem::path& app_dir,
+      const std::filesystem::path& status_file);
+
+ private:
+  Server(const Server&) = delete;
+  Server(Server&&) = delete;
+  Server& operator=(const Server&) = delete;
+  Server& operator=(Server&&) = delete;
+
+  std::filesystem::path app_dir_;
+  LiveStatus status_;
+  std::atomic<bool> stop_;
+
+  std::mutex lock_;  //!< Защита полей ниже
+  std::condition_variable wakeup_;  //!< Пробуждение планировщика
+  bool rescan_;  //!< Требуется повторный просмотр задач
+  size_t running_;  //!< Выполняемая задача, 0 - нет
+  std::set<size_t> processed_;  //!< Выполненные и неудавшиеся задачи
+  std::set<size_t> paused_;
+  std::set<size_t> canceled_;
+  std::set<size_t> deferred_;  //!< Задачи, которым не хватило места на диске.
+                               //!< Проверяются снова после завершения другой
+                               //!< задачи или через интервал просмотра
+  std::map<size_t, std::chrono::steady_clock::time_point>
+      waiting_;  //!< Задачи, ожидающие роста исходного файла, и время повтора
+
+  std::set<int> client_sockets_;  //!< Сокеты подключённых клиентов
+  std::condition_variable clients_done_;  //!< Отключение клиента
+
+  /*! Цикл планировщика: выбирает и выполняет задачи */
+  void SchedulerLoop();
+
+  /*! Обслужить подключение клиента
+  \param fd сокет клиента */
+  void ClientLoop(int fd);
+
+  /*! Обработать один запрос
+  \param request строка запроса (json)
+  \return строка ответа (json) */
+  std::string HandleRequest(const std::string& request);
+
+  /*! Запросить повторный просмотр задач */
+  void Wakeup();
+};
+
+#endif  // SERVER_H
@@ -0,0 +1,370 @@
+#include "sourcestore.h"
+
+#include <chrono>
+#include <fstream>
+#include <functional>
+#include <iostream>
+
+#include "chunkcache.h"
+#include "ffmpeg.h"
+#include "fileops.h"
+#include "json.hpp"
+
+namespace fs = std::filesystem;
+namespace chr = std::chrono;
+using json = nlohmann::json;
+
+const std::string kSourcesFolder = "sources";
+const std::string kIndexFile = "index.cfg";
+const std::string kLockFile = "index.lock";
+const std::string kTempExtension = ".tmp";
+const std::string kDataPrefix = "data-";
+const std::string kIndexFileName = "file";
+const std::string kIndexTasks = "tasks";
+const std::string kIndexDuration = "duration";
+const std::string kIndexStreams = "streams";
+const std::string kIndexFrames = "frames";
+const std::string kIndexKeyFrames = "keyframes";
+const std::string kIndexData = "data";
+const chr::milliseconds kLockTimeout(10000);
+
+
+/*! Прочитать индекс хранилища. Индекс заменяется переименованием, поэтому
+читается без блокировки
+\param dir папка хранилища
+\return индекс, пустой объект - индекса нет или он повреждён */
+json ReadIndex(const fs::path& dir) {
+  try {
+    std::ifstream f(dir / kIndexFile);
+    if (f) {
+      return json::parse(f);
+    }
+  } catch (std::exception&) {
+  }
+  return json::object();
+}
+
+
+/*! Выдать файл блокировки хранилищ. Блокировка общая для всех хранилищ и
+не удаляется: хранилище может быть удалено, пока другой процесс ждёт его
+блокировку
+\param dir папка хранилища
+\return файл блокировки в папке хранилищ */
+fs::path LockPath(const fs::path& dir) {
+  return dir.parent_path() / kLockFile;
+}
+
+
+/*! Записать индекс хранилища. Вызывается под блокировкой хранилища
+\param dir папка хранилища
+\param index индекс
+\return признак успешной записи */
+bool WriteIndex(const fs::path& dir, const json& index) {
+  auto temp = dir / (kIndexFile + kTempExtension);
+  {
+    std::ofstream f(temp, std::ios_base::out | std::ios_base::trunc);
+    f << index.dump(2);
+    if (!f) {
+      return false;
+    }
+  }
+  std::error_code err;
+  fs::rename(temp, dir / kIndexFile, err);
+  return !err;
+}
+
+
+/*! Изменить индекс хранилища под блокировкой хранилища
+\param dir папка хранилища
+\param modify изменение индекса. Возвращает false, если запись не нужна
+\return признак успешного изменения */
+bool ModifyIndex(
+    const fs::path& dir, const std::function<bool(json&)>& modify) {
+  auto lock = WaitLock(LockPath(dir), kLockTimeout);
+  if (!lock) {
+    return false;
+  }
+  try {
+    auto index = ReadIndex(dir);
+    if (!modify(index)) {
+      return true;
+    }
+    return WriteIndex(dir, index);
+  } catch (std::exception&) {
+  }
+  return false;
+}
+
+
+/*! Составить ключ участка времени для индекса
+\param start, interval начало и длительность участка, в мкс
+\return ключ */
+std::string IntervalKey(size_t start, size_t interval) {
+  return std::to_string(start) + "-" + std::to_string(interval);
+}
+
+
+SourceStore::SourceStore() {}
+
+SourceStore::~SourceStore() {}
+
+
+bool SourceStore::Open(
+    const fs::path& app_dir, const fs::path& source, size_t task) {
+  source_ = source;
+  dir_.clear();
+  auto identity = ChunkCache::FileIdentity(source);
+  if (identity.empty()) {
+    return false;
+  }
+  auto dir = app_dir / kSourcesFolder / ChunkCache::HashParts({identity});
+  std::error_code err;
+  fs::create_directories(dir.parent_path(), err);
+  if (err) {
+    return false;
+  }
+  auto id = std::to_string(task);
+  bool res = ModifyIndex(dir, [&](json& index) {
+    // Папка создаётся под блокировкой: иначе её может удалить ReleaseTask
+    // другого процесса
+    fs::create_directories(dir);
+    index[kIndexFileName] = fs::absolute(source).u8string();
+    auto& tasks = index[kIndexTasks];
+    for (const auto& item : tasks) {
+      if (item == id) {
+        return false;
+      }
+    }
+    tasks.push_back(id);
+    return true;
+  });
+  if (res) {
+    dir_ = dir;
+  }
+  return res;
+}
+
+
+bool SourceStore::RequestDuration(size_t& duration_mcs) {
+  if (!dir_.empty()) {
+    try {
+      auto index = ReadIndex(dir_);
+      if (index.contains(kIndexDuration)) {
+        duration_mcs = std::stoull(index[kIndexDuration].get<std::string>());
+        return true;
+      }
+    } catch (std::exception&) {
+    }
+  }
+  FFmpeg fm;
+  if (!fm.RequestDuration(source_, duration_mcs)) {
+    return false;
+  }
+  if (!dir_.empty()) {
+    ModifyIndex(dir_, [&](json& index) {
+      index[kIndexDuration] = std::to_string(duration_mcs);
+      return true;
+    });
+  }
+  return true;
+}
+
+
+std::string SourceStore::RequestStreamInfo() {
+  if (!dir_.empty()) {
+    try {
+      auto index = ReadIndex(dir_);
+      if (index.contains(kIndexStreams)) {
+        return index[kIndexStreams].get<std::string>();
+      }
+    } catch (std::exception&) {
+    }
+  }
+  FFmpeg fm;
+  auto info = fm.RequestStreamInfo(source_);
+  if (!dir_.empty() && !info.empty()) {
+    ModifyIndex(dir_, [&](json& index) {
+      index[kIndexStreams] = info;
+      return true;
+    });
+  }
+  return info;
+}
+
+
+bool SourceStore::RequestFrames(size_t search_start, size_t search_interval,
+    size_t& ordinary_frame, size_t& key_frame, size_t& key_position) {
+  auto key = IntervalKey(search_start, search_interval);
+  if (!dir_.empty()) {
+    try {
+      auto index = ReadIndex(dir_);
+      if (index.contains(kIndexFrames) && index[kIndexFrames].contains(key)) {
+        const auto& item = index[kIndexFrames][key];
+        ordinary_frame = std::stoull(item.at("ordinary").get<std::string>());
+        key_frame = std::stoull(item.at("key").get<std::string>());
+        key_position = std::stoull(item.at("position").get<std::string>());
+        return true;
+      }
+    } catch (std::exception&) {
+    }
+  }
+  FFmpeg fm;
+  if (!fm.RequestFrames(source_, search_start, search_interval,
+          ordinary_frame, key_frame, key_position)) {
+    return false;
+  }
+  if (!dir_.empty()) {
+    ModifyIndex(dir_, [&](json& index) {
+      auto& item = index[kIndexFrames][key];
+      item["ordinary"] = std::to_string(ordinary_frame);
+      item["key"] = std::to_string(key_frame);
+      item["position"] = std::to_string(key_position);
+      return true;
+    });
+  }
+  return true;
+}
+
+
+bool SourceStore::RequestKeyFrames(size_t search_start,
+    size_t search_interval, std::vector<size_t>& key_frames) {
+  auto key = IntervalKey(search_start, search_interval);
+  if (!dir_.empty()) {
+    try {
+      auto index = ReadIndex(dir_);
+      if (index.contains(kIndexKeyFrames) &&
+          index[kIndexKeyFrames].contains(key)) {
+        key_frames.clear();
+        for (const auto& item : index[kIndexKeyFrames][key]) {
+          key_frames.push_back(std::stoull(item.get<std::string>()));
+        }
+        return true;
+      }
+    } catch (std::exception&) {
+    }
+  }
+  FFmpeg fm;
+  if (!fm.RequestKeyFrames(
+          source_, search_start, search_interval, key_frames)) {
+    return false;
+  }
+  if (!dir_.empty()) {
+    ModifyIndex(dir_, [&](json& index) {
+      auto& item = index[kIndexKeyFrames][key];
+      item = json::array();
+      for (auto frame : key_frames) {
+        item.push_back(std::to_string(frame));
+      }
+      return true;
+    });
+  }
+  return true;
+}
+
+
+bool SourceStore::RestoreData(const std::vector<std::string>& parts,
+    const fs::path& target, bool& empty) {
+  if (dir_.empty()) {
+    return false;
+  }
+  auto key = ChunkCache::HashParts(parts);
+  std::string name;
+  try {
+    auto index = ReadIndex(dir_);
+    if (!index.contains(kIndexData) || !index[kIndexData].contains(key)) {
+      return false;
+    }
+    const auto& item = index[kIndexData][key];
+    empty = item.value("empty", false);
+    name = item.value("name", "");
+  } catch (std::exception&) {
+    return false;
+  }
+  if (empty) {
+    return true;
+  }
+  std::error_code err;
+  if (name.empty() || !fs::exists(dir_ / name, err)) {
+    return false;
+  }
+  fs::remove(target, err);
+  return ChunkCache::LinkFile(dir_ / name, target);
+}
+
+
+bool SourceStore::StoreData(const std::vector<std::string>& parts,
+    const fs::path& source, bool empty) {
+  if (dir_.empty()) {
+    return false;
+  }
+  auto key = ChunkCache::HashParts(parts);
+  std::string name;
+  if (!empty) {
+    name = kDataPrefix + key + source.extension().string();
+    auto temp = dir_ / (name + kTempExtension);
+    std::error_code err;
+    fs::remove(temp, err);
+    // Файл появляется переименованием: недописанный файл не будет выдан
+    if (!ChunkCache::LinkFile(source, temp)) {
+      fs::remove(temp, err);
+      return false;
+    }
+    fs::rename(temp, dir_ / name, err);
+    if (err) {
+      fs::remove(temp, err);
+      return false;
+    }
+  }
+  return ModifyIndex(dir_, [&](json& index) {
+    auto& item = index[kIndexData][key];
+    item["name"] = name;
+    item["empty"] = empty;
+    return true;
+  });
+}
+
+
+void SourceStore::ReleaseTask(const fs::path& app_dir, size_t task) {
+  auto id = std::to_string(task);
+  auto sources = app_dir / kSourcesFolder;
+  std::error_code err;
+  if (!fs::exists(sources, err)) {
+    return;
+  }
+  auto lock = WaitLock(sources / kLockFile, kLockTimeout);
+  if (!lock) {
+    std::cerr << "WARNING: Source stores are locked" << std::endl;
+    return;
+  }
+  for (fs::directory_iterator it(sources, err), end; !err && it != end;
+       it.increment(err)) {
+    std::error_code dir_err;
+    if (!it->is_directory(dir_err)) {
+      continue;
+    }
+    auto dir = it->path();
+    try {
+      auto index = ReadIndex(dir);
+      json rest = json::array();
+      bool found = false;
+      for (const auto& item : index[kIndexTasks]) {
+        if (item == id) {
+          found = true;
+        } else {
+          rest.push_back(item);
+        }
+      }
+      if (!found) {
+        continue;
+      }
+      if (rest.empty()) {
+        // Последняя задача: сведения и выделенные потоки больше не нужны
+        fs::remove_all(dir, dir_err);
+      } else {
+        index[kIndexTasks] = rest;
+        WriteIndex(dir, index);
+      }
+    } catch (std::exception&) {
+    }
+  }
+}
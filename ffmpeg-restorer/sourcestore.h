@@ -0,0 +1,74 @@
+#ifndef SOURCESTORE_H
+#define SOURCESTORE_H
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+
+/*! Общие для задач сведения об исходном файле: длительность, описание
+потоков, найденные границы кадров и выделенные не-видео потоки. Хранилище
+файла - папка sources/<ключ> в папке приложения, ключ вычисляется по полному
+пути, размеру и времени изменения файла (изменённый файл получает новое
+хранилище). Сведения записываются в index.cfg при первом запросе и выдаются
+следующим задачам без запуска ffprobe/ffmpeg. Хранилище учитывает
+использующие его задачи и удаляется вместе с последней из них (см.
+ReleaseTask). Если хранилище не открыто, запросы выполняются напрямую */
+class SourceStore {
+ public:
+  SourceStore();
+  virtual ~SourceStore();
+
+  /*! Открыть хранилище исходного файла и учесть в нём задачу
+  \param app_dir папка приложения с задачами
+  \param source исходный файл
+  \param task идентификатор задачи
+  \return признак, что хранилище открыто */
+  bool Open(const std::filesystem::path& app_dir,
+      const std::filesystem::path& source, size_t task);
+
+  /*! Выдать длительность исходного файла (см. FFmpeg::RequestDuration) */
+  bool RequestDuration(size_t& duration_mcs);
+
+  /*! Выдать описание потоков исходного файла (см.
+  FFmpeg::RequestStreamInfo) */
+  std::string RequestStreamInfo();
+
+  /*! Выдать кадры во временном диапазоне (см. FFmpeg::RequestFrames) */
+  bool RequestFrames(size_t search_start, size_t search_interval,
+      size_t& ordinary_frame, size_t& key_frame, size_t& key_position);
+
+  /*! Выдать ключевые кадры во временном диапазоне (см.
+  FFmpeg::RequestKeyFrames) */
+  bool RequestKeyFrames(size_t search_start, size_t search_interval,
+      std::vector<size_t>& key_frames);
+
+  /*! Получить выделенные ранее не-видео потоки
+  \param parts параметры выделения: аргументы ffmpeg, участки файла и т.д.
+  \param target целевой файл, существующий заменяется
+  \param empty возвращает признак пустого результата (потоков нет). Для
+  пустого результата файл не создаётся
+  \return признак, что результат найден */
+  bool RestoreData(const std::vector<std::string>& parts,
+      const std::filesystem::path& target, bool& empty);
+
+  /*! Сохранить выделенные не-видео потоки для других задач
+  \param parts параметры выделения (см. RestoreData)
+  \param source файл с потоками, остаётся на месте
+  \param empty признак пустого результата, файл не используется
+  \return признак успешного сохранения */
+  bool StoreData(const std::vector<std::string>& parts,
+      const std::filesystem::path& source, bool empty);
+
+  /*! Снять учёт задачи во всех хранилищах. Хранилища без задач удаляются
+  \param app_dir папка приложения с задачами
+  \param task идентификатор задачи */
+  static void ReleaseTask(const std::filesystem::path& app_dir, size_t task);
+
+ private:
+  std::filesystem::path source_;  //!< Исходный файл
+  std::filesystem::path dir_;  //!< Папка хранилища, пустая - не открыто
+};
+
+#endif  // SOURCESTORE_H
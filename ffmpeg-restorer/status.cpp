@@ -0,0 +1,269 @@
+#include "status.h"
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif  // _WIN32
+
+namespace chr = std::chrono;
+
+const uint32_t kStatusMagic = 0x52524646;  // "FFRR"
+const uint32_t kStatusVersion = 1;
+const int kReadAttempts = 1000;
+
+
+struct LiveStatus::Shared {
+  uint32_t Magic;
+  uint32_t Version;
+  std::atomic<uint32_t> Sequence;  //!< Нечётное значение - идёт запись
+  uint32_t Reserved;
+  Snapshot Data;
+};
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free,
+    "Sequence counter should be lock-free to be shared between processes");
+
+
+LiveStatus::LiveStatus(): shared_(nullptr), writer_(false) {
+  std::memset(&current_, 0, sizeof(current_));
+}
+
+LiveStatus::~LiveStatus() { Close(); }
+
+bool LiveStatus::OpenForWrite(const std::filesystem::path& file) {
+  Close();
+  if (!Map(file, true)) {
+    return false;
+  }
+  writer_ = true;
+  std::lock_guard<std::mutex> lk(lock_);
+  std::memset(&current_, 0, sizeof(current_));
+#ifdef _WIN32
+  current_.Pid = static_cast<uint64_t>(GetCurrentProcessId());
+#else
+  current_.Pid = static_cast<uint64_t>(getpid());
+#endif
+  for (size_t i = 0; i < kMaxWorkers; ++i) {
+    current_.WorkerChunk[i] = kNoChunk;
+  }
+  Publish();
+  return true;
+}
+
+bool LiveStatus::OpenForRead(const std::filesystem::path& file) {
+  Close();
+  return Map(file, false);
+}
+
+void LiveStatus::Close() {
+  if (!shared_) {
+    return;
+  }
+  if (writer_) {
+    std::lock_guard<std::mutex> lk(lock_);
+    current_.Pid = 0;
+    current_.Phase = kPhaseIdle;
+    Publish();
+  }
+#ifdef _WIN32
+  UnmapViewOfFile(shared_);
+#else
+  munmap(shared_, sizeof(Shared));
+#endif
+  shared_ = nullptr;
+  writer_ = false;
+}
+
+bool LiveStatus::Read(Snapshot& snapshot) const {
+  if (!shared_ || shared_->Magic != kStatusMagic ||
+      shared_->Version != kStatusVersion) {
+    return false;
+  }
+  for (int i = 0; i < kReadAttempts; ++i) {
+    uint32_t s1 = shared_->Sequence.load(std::memory_order_acquire);
+    if (s1 & 1) {
+      continue;
+    }
+    std::memcpy(&snapshot, &shared_->Data, sizeof(snapshot));
+    std::atomic_thread_fence(std::memory_order_acquire);
+    uint32_t s2 = shared_->Sequence.load(std::memory_order_relaxed);
+    if (s1 != s2) {
+      continue;
+    }
+    // Писатель мог аварийно завершиться, не сбросив состояние
+#ifdef _WIN32
+    if (snapshot.Pid != 0) {
+      HANDLE process = OpenProcess(PROCESS_QUERY_LIMITED_INFORMATION, FALSE,
+          static_cast<DWORD>(snapshot.Pid));
+      DWORD code = 0;
+      if (!process) {
+        if (GetLastError() == ERROR_INVALID_PARAMETER) {
+          snapshot.Pid = 0;
+        }
+      } else {
+        if (GetExitCodeProcess(process, &code) && code != STILL_ACTIVE) {
+          snapshot.Pid = 0;
+        }
+        CloseHandle(process);
+      }
+    }
+#else
+    if (snapshot.Pid != 0 && kill(static_cast<pid_t>(snapshot.Pid), 0) != 0 &&
+        errno == ESRCH) {
+      snapshot.Pid = 0;
+    }
+#endif
+    return true;
+  }
+  return false;
+}
+
+void LiveStatus::BeginTask(
+    size_t task_id, size_t chunks_total, size_t chunks_completed) {
+  std::lock_guard<std::mutex> lk(lock_);
+  current_.TaskId = task_id;
+  current_.Phase = kPhaseIdle;
+  current_.ChunksTotal = static_cast<uint32_t>(chunks_total);
+  current_.ChunksCompleted = static_cast<uint32_t>(chunks_completed);
+  current_.WorkerAmount = 0;
+  for (size_t i = 0; i < kMaxWorkers; ++i) {
+    current_.WorkerChunk[i] = kNoChunk;
+  }
+  current_.Speed = 0.0;
+  current_.Eta = 0;
+  current_.BytesWritten = 0;
+  Publish();
+}
+
+void LiveStatus::SetPhase(Phase phase) {
+  std::lock_guard<std::mutex> lk(lock_);
+  current_.Phase = phase;
+  Publish();
+}
+
+void LiveStatus::SetChunksTotal(size_t chunks_total) {
+  std::lock_guard<std::mutex> lk(lock_);
+  current_.ChunksTotal = static_cast<uint32_t>(chunks_total);
+  Publish();
+}
+
+void LiveStatus::SetWorkerChunk(size_t worker, int64_t chunk) {
+  if (worker >= kMaxWorkers) {
+    return;
+  }
+  std::lock_guard<std::mutex> lk(lock_);
+  current_.WorkerChunk[worker] = chunk;
+  if (current_.WorkerAmount <= worker) {
+    current_.WorkerAmount = static_cast<uint32_t>(worker + 1);
+  }
+  Publish();
+}
+
+void LiveStatus::SetProgress(
+    size_t chunks_completed, double speed, uint64_t eta, uint64_t bytes_written) {
+  std::lock_guard<std::mutex> lk(lock_);
+  current_.ChunksCompleted = static_cast<uint32_t>(chunks_completed);
+  current_.Speed = speed;
+  current_.Eta = eta;
+  current_.BytesWritten = bytes_written;
+  Publish();
+}
+
+void LiveStatus::EndTask() {
+  std::lock_guard<std::mutex> lk(lock_);
+  current_.TaskId = 0;
+  current_.Phase = kPhaseIdle;
+  current_.WorkerAmount = 0;
+  for (size_t i = 0; i < kMaxWorkers; ++i) {
+    current_.WorkerChunk[i] = kNoChunk;
+  }
+  Publish();
+}
+
+void LiveStatus::Publish() {
+  if (!shared_ || !writer_) {
+    return;
+  }
+  current_.UpdateTime = static_cast<uint64_t>(
+      chr::duration_cast<chr::microseconds>(
+          chr::system_clock::now().time_since_epoch())
+          .count());
+
+  uint32_t s = shared_->Sequence.load(std::memory_order_relaxed);
+  shared_->Sequence.store(s + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  std::memcpy(&shared_->Data, &current_, sizeof(current_));
+  shared_->Sequence.store(s + 2, std::memory_order_release);
+}
+
+bool LiveStatus::Map(const std::filesystem::path& file, bool write) {
+#ifdef _WIN32
+  HANDLE handle = CreateFileW(file.c_str(),
+      write ? (GENERIC_READ | GENERIC_WRITE) : GENERIC_READ,
+      FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr,
+      write ? OPEN_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+  if (handle == INVALID_HANDLE_VALUE) {
+    return false;
+  }
+  LARGE_INTEGER size;
+  if (!GetFileSizeEx(handle, &size) ||
+      (!write && size.QuadPart < (LONGLONG)sizeof(Shared))) {
+    CloseHandle(handle);
+    return false;
+  }
+  // Отображение для записи само увеличивает файл до размера Shared
+  HANDLE mapping = CreateFileMappingW(handle, nullptr,
+      write ? PAGE_READWRITE : PAGE_READONLY, 0, sizeof(Shared), nullptr);
+  CloseHandle(handle);
+  if (!mapping) {
+    return false;
+  }
+  void* mem = MapViewOfFile(
+      mapping, write ? FILE_MAP_WRITE : FILE_MAP_READ, 0, 0, sizeof(Shared));
+  // Представление удерживает отображение до UnmapViewOfFile
+  CloseHandle(mapping);
+  if (!mem) {
+    return false;
+  }
+#else
+  int fd = open(file.c_str(), write ? (O_RDWR | O_CREAT) : O_RDONLY, 0644);
+  if (fd < 0) {
+    return false;
+  }
+  if (write && ftruncate(fd, sizeof(Shared)) != 0) {
+    close(fd);
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(Shared)) {
+    close(fd);
+    return false;
+  }
+  void* mem = mmap(nullptr, sizeof(Shared),
+      write ? (PROT_READ | PROT_WRITE) : PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (mem == MAP_FAILED) {
+    return false;
+  }
+#endif  // _WIN32
+  shared_ = static_cast<Shared*>(mem);
+  if (write) {
+    // Предыдущий писатель мог аварийно завершиться во время записи.
+    // Сбросим признак записи
+    uint32_t s = shared_->Sequence.load(std::memory_order_relaxed);
+    shared_->Sequence.store(s & ~1U, std::memory_order_relaxed);
+    shared_->Version = kStatusVersion;
+    shared_->Magic = kStatusMagic;
+  }
+  return true;
+}
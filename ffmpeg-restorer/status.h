@@ -0,0 +1,114 @@
+#ifndef STATUS_H
+#define STATUS_H
+
+#include <cstdint>
+#include <filesystem>
+#include <mutex>
+
+
+/*! Текущее состояние обработки задач. Публикуется запущенным процессом через
+отображаемый в память файл и читается другими процессами без блокировок
+(seqlock). Структура имеет фиксированный размер и не содержит указателей */
+class LiveStatus {
+ public:
+  static const size_t kMaxWorkers = 16;  //!< Максимум отображаемых исполнителей
+  static const int64_t kNoChunk = -1;  //!< Исполнитель не обрабатывает фрагмент
+
+  enum Phase : uint32_t {
+    kPhaseIdle,  // Нет задачи в работе
+    kPhaseSplit,  // Выделение не-видео потоков
+    kPhaseConvert,  // Конвертация видеофрагментов
+    kPhaseConcat,  // Объединение фрагментов и потоков в выходной файл
+    kPhaseMerge,  // Объединение потоков из промежуточного видеофайла
+    kPhaseJoin,  // Дописывание фрагментов MPEG-TS в промежуточный видеофайл
+    kPhaseDirect  // Конвертация за один проход, без фрагментов
+  };
+
+  /*! Снимок состояния. Время и длительности в микросекундах */
+  struct Snapshot {
+    uint64_t Pid;  //!< Идентификатор процесса-писателя, 0 - нет писателя
+    uint64_t UpdateTime;  //!< Время обновления (от эпохи)
+    uint64_t TaskId;
+    uint32_t Phase;
+    uint32_t ChunksTotal;
+    uint32_t ChunksCompleted;
+    uint32_t WorkerAmount;
+    int64_t WorkerChunk[kMaxWorkers];  //!< Номер фрагмента у исполнителя
+    double Speed;  //!< Скорость конвертации относительно реального времени
+    uint64_t Eta;  //!< Оставшееся время конвертации видео, 0 - неизвестно
+    uint64_t BytesWritten;  //!< Объём записанных файлов задачи
+  };
+
+  LiveStatus();
+  virtual ~LiveStatus();
+
+  /*! Открыть (создать) файл состояния для публикации. Предыдущее содержимое
+  сбрасывается. Предполагается единственный писатель (процесс, захвативший
+  блокировку запуска задач)
+  \param file полный путь к файлу состояния
+  \return признак успешного открытия */
+  bool OpenForWrite(const std::filesystem::path& file);
+
+  /*! Открыть файл состояния на чтение
+  \param file полный путь к файлу состояния
+  \return признак успешного открытия */
+  bool OpenForRead(const std::filesystem::path& file);
+
+  /*! Закрыть файл состояния. Писатель перед закрытием публикует отсутствие
+  процесса */
+  void Close();
+
+  /*! Прочитать согласованный снимок состояния без блокировок
+  \param snapshot возвращаемый снимок
+  \return признак успешного чтения */
+  bool Read(Snapshot& snapshot) const;
+
+  /*! Начать публикацию новой задачи. Сбрасывает счётчики скорости
+  \param task_id идентификатор задачи
+  \param chunks_total, chunks_completed общее количество и количество готовых
+  фрагментов */
+  void BeginTask(size_t task_id, size_t chunks_total, size_t chunks_completed);
+
+  /*! Установить фазу обработки текущей задачи */
+  void SetPhase(Phase phase);
+
+  /*! Изменить общее количество фрагментов (растущий исходный файл)
+  \param chunks_total общее количество фрагментов */
+  void SetChunksTotal(size_t chunks_total);
+
+  /*! Установить фрагмент, обрабатываемый исполнителем
+  \param worker номер исполнителя
+  \param chunk номер фрагмента или kNoChunk */
+  void SetWorkerChunk(size_t worker, int64_t chunk);
+
+  /*! Обновить прогресс конвертации
+  \param chunks_completed количество готовых фрагментов
+  \param speed скорость конвертации относительно реального времени
+  \param eta оставшееся время, в микросекундах
+  \param bytes_written объём записанных файлов, в байтах */
+  void SetProgress(
+      size_t chunks_completed, double speed, uint64_t eta, uint64_t bytes_written);
+
+  /*! Завершить публикацию задачи */
+  void EndTask();
+
+ private:
+  LiveStatus(const LiveStatus&) = delete;
+  LiveStatus(LiveStatus&&) = delete;
+  LiveStatus& operator=(const LiveStatus&) = delete;
+  LiveStatus& operator=(LiveStatus&&) = delete;
+
+  struct Shared;
+
+  Shared* shared_;  //!< Отображённая в память область или nullptr
+  bool writer_;
+  Snapshot current_;  //!< Локальная копия для писателя
+  std::mutex lock_;  //!< Синхронизация писателей внутри процесса
+
+  /*! Опубликовать локальную копию состояния. Вызывается под lock_ */
+  void Publish();
+
+  bool Map(const std::filesystem::path& file, bool write);
+};
+
+#endif  // STATUS_H
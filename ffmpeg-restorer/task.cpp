@@ -1,17 +1,28 @@
 #include "task.h"
 
+#include <algorithm>
 #include <cassert>
 #include <chrono>
 #include <filesystem>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <numeric>
+#include <optional>
+#include <set>
 #include <sstream>
+#include <thread>
 #include <utility>
 
 #include "ffmpeg.h"
+#include "fileops.h"
 #include "home-dir.h"
 #include "json.hpp"
+#include "scratch.h"
+#include "sourcestore.h"
+#include "workers.h"
 
 namespace fs = std::filesystem;
 namespace chr = std::chrono;
@@ -21,6 +32,51 @@ const std::string kTaskCfgFile = "task.cfg";
 const std::string kInterimVideoFile = "video.mkv";
 const std::string kInterimDataFile = "data.mkv";
 const std::string kInterimListFile = "list.txt";
+const std::string kInterimInputListFile = "inputs.txt";
+const std::string kInterimFormatNative = "native";
+const std::string kInterimFormatTs = "ts";
+const std::string kInterimFormatFmp4 = "fmp4";
+const std::string kInterimFormatMkv = "mkv";
+const std::string kTsExtension = ".ts";
+const std::string kMp4Extension = ".mp4";
+const std::string kMkvExtension = ".mkv";
+const std::string kScratchPrefix = "ffmpegrr-";
+const std::string kTaskModeChunked = "chunked";
+const std::string kTaskModeDirect = "direct";
+const std::string kTaskModeHls = "hls";
+const std::string kHlsExtension = ".m3u8";
+// Суффиксы плейлистов видео и звука HLS рядом с основным плейлистом
+const std::string kHlsVideoSuffix = "_video";
+const std::string kHlsAudioSuffix = "_audio";
+const std::string kChunkPrefix = "chunk_";
+const std::string kRenditionListPrefix = "list_";
+const std::string kListExtension = ".txt";
+// Разделитель выходных файлов в аргументах задачи: аргументы ffmpeg не
+// позволяют отличить имя файла от значения неизвестной опции
+const std::string kOutputSeparator = "--next-output";
+// Длительность сегментов HLS (фрагментов в режиме hls) и минимальная
+const size_t kHlsSegmentSize = 6000000ULL;
+const size_t kHlsMinimalSegmentSize = 2000000ULL;
+// Сдвиг начала копируемого фрагмента за его ключевой кадр, в мкс
+const size_t kCopySeekMargin = 1000;
+// Звуковые фрагменты хранят декодированный звук без потерь и без задержки
+// кодера: сжатие выполняется одним проходом по объединённым фрагментам.
+// Контейнер NUT хранит время с точностью до отсчёта (Matroska - до мс)
+const std::string kAudioChunkExtension = ".nut";
+const std::string kAudioChunkCodec = "pcm_f32le";
+const std::string kInterimAudioListFile = "audio.txt";
+// Запас до и после звукового фрагмента при декодировании. Покрывает
+// перекрытие окон преобразования и отбрасываемые декодером отсчёты (pre-skip)
+const size_t kAudioPreroll = 200000;
+// Запас свободного места сверх оценки: 1/N от оценки
+const uint64_t kSpaceReserveRatio = 10;
+const uint64_t kMegabyte = 1048576;
+const std::string kCatalogLockFile = "catalog.lock";
+const std::string kCatalogIdFile = "catalog.id";
+const std::string kTaskLockExt = ".lock";
+const std::string kChunkCacheFolder = "cache";
+
+const chr::milliseconds kCatalogLockTimeout(10000);
 
 const size_t kDefaultChunkSize = 60000000ULL;
 const size_t kMinimalChunkSize = 20000000ULL;
@@ -29,6 +85,278 @@ static_assert(kSearchInterval < (kMinimalChunkSize / 4),
     "Seach interval should be more smaller, than minimal chunk size");
 static_assert(kMinimalChunkSize < kDefaultChunkSize,
     "Minimal size of chunk should be less than default size");
+const size_t kChunkDurationTolerance = 1000000ULL;  // 1 секунда
+static_assert(kChunkDurationTolerance < kMinimalChunkSize,
+    "Duration tolerance should be less than minimal chunk size");
+// Растущий исходный файл: запас данных за концом выделяемого фрагмента и
+// файл-метка окончания записи (добавляется к имени исходного файла)
+const size_t kFollowMargin = 10000000ULL;
+static_assert(kSearchInterval < kFollowMargin,
+    "Frames are searched inside the written part of growing file");
+const std::string kFollowEndExtension = ".end";
+// Объём исходного файла, заранее читаемого в кэш для следующих фрагментов
+const uint64_t kPrefetchBudget = 256 * kMegabyte;
+
+/*! Найти видеокодек (кодер) в аргументах выходного файла
+\param args аргументы выходного файла ffmpeg
+\return имя кодека или пустая строка, если кодек не задан */
+std::string GetVideoCodec(const std::vector<std::string>& args) {
+  // Кодек видео: общий (-c, -codec) или для видеопотоков, в том числе с
+  // номером потока (-c:v:0)
+  auto video_codec = [](const std::string& opt) {
+    return opt == "-c" || opt == "-codec" || opt == "-vcodec" ||
+           opt.rfind("-c:v", 0) == 0 || opt.rfind("-c:V", 0) == 0 ||
+           opt.rfind("-codec:v", 0) == 0 || opt.rfind("-codec:V", 0) == 0;
+  };
+  std::string codec;
+  for (size_t i = 0; i + 1 < args.size(); ++i) {
+    if (video_codec(args[i])) {
+      // Действует последнее указание кодека
+      codec = args[i + 1];
+      ++i;
+    }
+  }
+  return codec;
+}
+
+
+/*! Проверить наличие в аргументах выходного файла фильтров и изменения
+кадров видео. Они несовместимы с копированием видеопотока
+\param args аргументы выходного файла ffmpeg
+\return признак фильтрации видео */
+bool HasVideoFilters(const std::vector<std::string>& args) {
+  for (const auto& opt : args) {
+    if (opt == "-vf" || opt == "-lavfi" || opt == "-r" || opt == "-s" ||
+        opt == "-aspect" || opt.rfind("-filter", 0) == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+
+/*! Проверить, что аргументы выходного файла только копируют видео (без
+перекодирования и фильтров)
+\param args аргументы выходного файла ffmpeg
+\return признак копирования видеопотока */
+bool IsVideoStreamCopy(const std::vector<std::string>& args) {
+  return !HasVideoFilters(args) && GetVideoCodec(args) == "copy";
+}
+
+
+// Опции ffmpeg, принимающие значение (имя без спецификатора потока). Только
+// после них следующий аргумент считается значением: -map -0:v не делится на
+// две опции
+const std::set<std::string> kValueOptions = {"-aspect", "-avoid_negative_ts",
+    "-b", "-bf", "-bsf", "-bufsize", "-c", "-channel_layout",
+    "-color_primaries", "-color_range", "-color_trc", "-colorspace", "-crf",
+    "-disposition", "-f", "-filter", "-filter_complex", "-force_key_frames",
+    "-fps_mode", "-frames", "-fs", "-g", "-keyint_min", "-lavfi", "-level",
+    "-map", "-map_chapters", "-map_metadata", "-max_muxing_queue_size",
+    "-maxrate", "-metadata", "-minrate", "-movflags", "-pix_fmt", "-preset",
+    "-profile", "-q", "-qp", "-r", "-refs", "-s", "-sample_fmt", "-ar", "-ac",
+    "-sc_threshold", "-ss", "-strict", "-t", "-tag", "-threads", "-timecode",
+    "-to", "-tune", "-vsync", "-x264-params", "-x264opts", "-x265-params"};
+
+// Синонимы опций ffmpeg и их основное написание
+const std::map<std::string, std::string> kOptionAliases = {{"-codec", "-c"},
+    {"-vcodec", "-c:v"}, {"-acodec", "-c:a"}, {"-scodec", "-c:s"},
+    {"-dcodec", "-c:d"}, {"-vf", "-filter:v"}, {"-af", "-filter:a"},
+    {"-vb", "-b:v"}, {"-ab", "-b:a"}, {"-qscale", "-q"}, {"-aq", "-q:a"},
+    {"-vframes", "-frames:v"}, {"-aframes", "-frames:a"},
+    {"-dframes", "-frames:d"}, {"-vtag", "-tag:v"}, {"-atag", "-tag:a"},
+    {"-stag", "-tag:s"}, {"-absf", "-bsf:a"}, {"-vbsf", "-bsf:v"},
+    {"-sbsf", "-bsf:s"}};
+
+//! Опция ffmpeg из аргументов выходного файла
+struct ArgumentOption {
+  std::string Name;  //!< Опция в основном написании или аргумент не-опция
+  std::string Value;  //!< Значение опции
+  bool HasValue;  //!< Признак наличия значения
+};
+
+
+/*! Выдать имя опции ffmpeg без спецификатора потока
+\param opt опция (-c:v:0)
+\return имя опции (-c) */
+std::string GetOptionBase(const std::string& opt) {
+  return opt.substr(0, opt.find(':'));
+}
+
+
+/*! Привести написание опции ffmpeg к основному (-vcodec -> -c:v,
+-codec:a -> -c:a)
+\param opt опция
+\return опция в основном написании */
+std::string UnifyOption(const std::string& opt) {
+  auto colon = opt.find(':');
+  auto it = kOptionAliases.find(opt.substr(0, colon));
+  if (it == kOptionAliases.end()) {
+    return opt;
+  }
+  return colon == std::string::npos ? it->second
+                                    : it->second + opt.substr(colon);
+}
+
+
+/*! Разобрать аргументы ffmpeg на опции и их значения. Значение берётся
+только у известных опций со значением (kValueOptions); прочие аргументы
+остаются отдельными элементами
+\param args аргументы выходного файла ffmpeg
+\return опции в основном написании со значениями */
+std::vector<ArgumentOption> ParseArguments(
+    const std::vector<std::string>& args) {
+  std::vector<ArgumentOption> result;
+  for (size_t i = 0; i < args.size(); ++i) {
+    ArgumentOption opt = {args[i], std::string(), false};
+    if (args[i].size() > 1 && args[i][0] == '-') {
+      opt.Name = UnifyOption(args[i]);
+      if (kValueOptions.count(GetOptionBase(opt.Name)) != 0 &&
+          i + 1 < args.size()) {
+        opt.Value = args[++i];
+        opt.HasValue = true;
+      }
+    }
+    result.push_back(opt);
+  }
+  return result;
+}
+
+
+/*! Привести аргументы ffmpeg к единому виду: синонимы опций заменяются
+основным написанием, опции со значением упорядочиваются по имени. Порядок
+одноимённых опций (-map, -c и -c:v) сохраняется, так как от него зависит
+результат. Прочие аргументы не переставляются и разделяют участки
+упорядочивания
+\param args аргументы выходного файла ffmpeg
+\return приведённые аргументы */
+std::vector<std::string> NormalizeArguments(
+    const std::vector<std::string>& args) {
+  auto options = ParseArguments(args);
+  auto begin = options.begin();
+  while (begin != options.end()) {
+    auto end = std::find_if(begin, options.end(),
+        [](const ArgumentOption& opt) { return !opt.HasValue; });
+    std::stable_sort(begin, end,
+        [](const ArgumentOption& a, const ArgumentOption& b) {
+          return GetOptionBase(a.Name) < GetOptionBase(b.Name);
+        });
+    begin = end == options.end() ? end : end + 1;
+  }
+  std::vector<std::string> result;
+  for (const auto& opt : options) {
+    result.push_back(opt.Name);
+    if (opt.HasValue) {
+      result.push_back(opt.Value);
+    }
+  }
+  return result;
+}
+
+
+/*! Убрать из аргументов выходного файла опции, действующие только на видео.
+Остальные аргументы определяют результат выделения не-видео потоков.
+Аргументы разбираются парами опция/значение по известным опциям
+(ParseArguments): значения (например, -0:v в -map) не принимаются за опции
+\param args аргументы выходного файла ffmpeg
+\return аргументы без опций видео и их значений */
+std::vector<std::string> GetNonVideoArguments(
+    const std::vector<std::string>& args) {
+  static const std::set<std::string> kVideoOptions = {"-r", "-s", "-aspect",
+      "-pix_fmt", "-crf", "-qp", "-preset", "-tune", "-g", "-bf", "-refs",
+      "-keyint_min", "-sc_threshold", "-force_key_frames", "-level",
+      "-x264-params", "-x264opts", "-x265-params"};
+  auto video_option = [](const std::string& opt) {
+    if (kVideoOptions.find(opt) != kVideoOptions.end()) {
+      return true;
+    }
+    // Опции для видеопотоков, в том числе с номером потока (-b:v:0)
+    auto colon = opt.find(':');
+    return colon != std::string::npos && colon + 1 < opt.size() &&
+           (opt[colon + 1] == 'v' || opt[colon + 1] == 'V') &&
+           (colon + 2 == opt.size() || opt[colon + 2] == ':');
+  };
+  std::vector<std::string> result;
+  for (const auto& opt : ParseArguments(args)) {
+    if (opt.HasValue && video_option(opt.Name)) {
+      continue;
+    }
+    result.push_back(opt.Name);
+    if (opt.HasValue) {
+      result.push_back(opt.Value);
+    }
+  }
+  return result;
+}
+
+
+/*! Выдать формат сжатия (имя кодека ffprobe), в который кодирует кодер ffmpeg
+\param encoder имя кодера
+\return имя кодека */
+std::string GetEncoderFormat(const std::string& encoder) {
+  static const std::map<std::string, std::string> kFormats = {
+      {"libx264", "h264"}, {"libopenh264", "h264"}, {"h264_nvenc", "h264"},
+      {"h264_qsv", "h264"}, {"h264_vaapi", "h264"}, {"h264_amf", "h264"},
+      {"libx265", "hevc"}, {"hevc_nvenc", "hevc"}, {"hevc_qsv", "hevc"},
+      {"hevc_vaapi", "hevc"}, {"hevc_amf", "hevc"}, {"libvpx", "vp8"},
+      {"libvpx-vp9", "vp9"}, {"libaom-av1", "av1"}, {"libsvtav1", "av1"},
+      {"librav1e", "av1"}, {"libxvid", "mpeg4"}};
+  auto it = kFormats.find(encoder);
+  return it == kFormats.end() ? encoder : it->second;
+}
+
+
+/*! Сформировать время в секундах для аргументов ffmpeg
+\param value_mcs время в микросекундах
+\return строка вида S.UUUUUU */
+std::string TimeArgument(size_t value_mcs) {
+  std::stringstream s;
+  s << value_mcs / 1000000 << "." << std::setw(6) << std::setfill('0')
+    << value_mcs % 1000000;
+  return s.str();
+}
+
+/*! Разобрать время в формате ffmpeg: секунды или [ЧЧ:]ММ:СС, с дробной
+частью
+\param value строка времени
+\param value_mcs возвращает время в микросекундах
+\return признак успешного разбора */
+bool ParseTime(const std::string& value, size_t& value_mcs) {
+  double seconds = 0.0;
+  size_t begin = 0;
+  int parts = 0;
+  while (true) {
+    auto end = value.find(':', begin);
+    auto part = value.substr(begin, end == std::string::npos ? end : end - begin);
+    if (part.empty() || part.find_first_not_of("0123456789.") != std::string::npos ||
+        ++parts > 3) {
+      return false;
+    }
+    seconds = seconds * 60 + std::stod(part);
+    if (end == std::string::npos) {
+      break;
+    }
+    begin = end + 1;
+  }
+  value_mcs = static_cast<size_t>(seconds * 1000000 + 0.5);
+  return true;
+}
+
+
+/*! Разобрать диапазон времени вида НАЧАЛО-КОНЕЦ
+\param value строка диапазона
+\param range возвращает начало и конец, в микросекундах
+\return признак успешного разбора непустого диапазона */
+bool ParseRange(const std::string& value, std::pair<size_t, size_t>& range) {
+  auto pos = value.find('-');
+  if (pos == std::string::npos) {
+    return false;
+  }
+  return ParseTime(value.substr(0, pos), range.first) &&
+         ParseTime(value.substr(pos + 1), range.second) &&
+         range.first < range.second;
+}
+
 
 std::string Microseconds2SecondsString(long long value_ms) {
   std::stringstream s;
@@ -39,11 +367,30 @@ std::string Microseconds2SecondsString(long long value_ms) {
 
 Task::Task(): is_created_(false) {
   id_ = 0;
+  status_ = nullptr;
+  waiting_source_ = false;
+  follow_size_ = 0;
   output_file_complete_ = false;
   interim_video_file_complete_ = false;
   interim_data_file_complete_ = false;
   interim_data_file_empty_ = false;
+  interim_format_ = kInterimFormatNative;
+  follow_ = false;
+  follow_idle_ = 0;
+  follow_growth_ = 0;
+  follow_writer_ = false;
+  stream_concat_ = false;
+  appended_chunks_ = 0;
+  appended_offset_ = 0;
+  interim_released_ = false;
+  mode_ = kTaskModeChunked;
+  streams_ = StreamLayout{};
+  audio_chunked_ = false;
+  audio_preroll_ = 0;
   duration_ = 0;
+  priority_ = 0;
+  deadline_ = 0;
+  speed_ = 0.0;
 }
 
 Task::Task(const Task& arg) { Copy(*this, arg); }
@@ -69,73 +416,337 @@ Task& Task::operator=(Task&& arg) {
 
 Task::~Task() {}
 
-bool Task::CreateFromArguments(int argc, char** argv) {
+bool Task::CreateFromArguments(
+    int argc, char** argv, const TaskOptions& options) {
+  std::shared_ptr<FileLock> lock;
   try {
     Clear();
+    priority_ = options.Priority;
+    deadline_ = options.Deadline;
+    stream_concat_ = options.StreamConcat;
+    follow_ = options.Follow;
+    follow_idle_ = options.FollowIdle;
+    if (follow_idle_ < 0 || (follow_idle_ != 0 && !follow_)) {
+      std::cout << "Idle limit must be a non-negative number of seconds "
+                   "for a growing source"
+                << std::endl;
+      throw std::invalid_argument("wrong idle limit");
+    }
+    if (!options.InterimFormat.empty()) {
+      if (options.InterimFormat != kInterimFormatNative &&
+          options.InterimFormat != kInterimFormatTs &&
+          options.InterimFormat != kInterimFormatFmp4 &&
+          options.InterimFormat != kInterimFormatMkv) {
+        std::cout << "Unknown interim format '" << options.InterimFormat
+                  << "'" << std::endl;
+        return false;
+      }
+      interim_format_ = options.InterimFormat;
+    }
+    if (stream_concat_) {
+      // Дописывание байт в конец файла возможно только для MPEG-TS
+      if (interim_format_ != kInterimFormatTs &&
+          !options.InterimFormat.empty()) {
+        std::cout << "Stream concatenation requires interim format "
+                  << kInterimFormatTs << std::endl;
+        return false;
+      }
+      interim_format_ = kInterimFormatTs;
+    }
+    if (options.SmartRender) {
+      // Контейнеры native, fmp4 и mkv хранят наборы параметров кодека
+      // (SPS/PPS) в заголовке, и при объединении остаётся заголовок первого
+      // фрагмента: скопированные GOP декодировались бы с параметрами
+      // перекодированных. В MPEG-TS наборы параметров идут в потоке перед
+      // каждым ключевым кадром и переносятся в выходной файл вместе с ним
+      if (interim_format_ != kInterimFormatTs &&
+          !options.InterimFormat.empty()) {
+        std::cout << "Smart rendering requires interim format "
+                  << kInterimFormatTs << std::endl;
+        return false;
+      }
+      interim_format_ = kInterimFormatTs;
+    }
 
 
-    // Найдём входной и выходной файл. Остальное запомним
+    // Найдём входной и выходные файлы. Остальное запомним
     // Входной файл ищём по последовательности аргументов
     // -i filename (и это не последние аргументы)
-    // Выходной файл это последний аргумент
+    // Выходной файл это последний аргумент. Несколько выходных файлов
+    // разделяются kOutputSeparator: каждый - последний аргумент своей группы
     if (argc < 1) {
       throw std::invalid_argument("a few arguments for convertation");
     }
-    output_file_ = argv[argc - 1];
-    auto out_ext = output_file_.extension();
+    std::vector<Rendition> outputs;
+    std::vector<std::string> args;
     bool outarg = false;
-    for (int i = 0; i < argc - 1; ++i) {
+    for (int i = 0; i < argc; ++i) {
       std::string v = argv[i];
+      bool last = i == argc - 1 || argv[i + 1] == kOutputSeparator;
+
+      if (v == kOutputSeparator) {
+        if (outputs.empty() || i == argc - 1 ||
+            argv[i + 1] == kOutputSeparator) {
+          throw std::invalid_argument("misplaced " + kOutputSeparator);
+        }
+        continue;
+      }
 
-      if (v == "-i") {
+      if (v == "-i" && !last) {
         ++i;
-        if (i > (argc - 1)) {
+        if (i >= (argc - 1)) {
           throw std::invalid_argument("orphan argument -i");
         }
-        input_file_ = argv[i];
+        inputs_.push_back({argv[i], 0, 0});
         outarg = true;
         continue;
       }
 
-      if (outarg) {
-        output_arguments_.push_back(v);
-      } else {
+      if (!outarg && !last) {
         input_arguments_.push_back(v);
+      } else if (last) {
+        outputs.push_back({fs::absolute(v), args, false, {}});
+        args.clear();
+      } else {
+        args.push_back(v);
       }
     }
 
-    input_file_ = fs::absolute(input_file_);
-    output_file_ = fs::absolute(output_file_);
-    if (input_file_.empty() || output_file_.empty()) {
+    for (auto& input : inputs_) {
+      input.FileName = fs::absolute(input.FileName);
+    }
+    if (inputs_.empty() || outputs.empty()) {
       throw std::invalid_argument("input/output file isn't specified");
     }
+    // Диапазоны времени. Обрезка аргументами входного файла (-ss, -t, -to)
+    // тоже превращается в диапазон: иначе она применялась бы к каждому
+    // фрагменту вместе с его собственными -ss/-t
+    std::vector<std::pair<size_t, size_t>> ranges;
+    for (const auto& value : options.Ranges) {
+      std::pair<size_t, size_t> range;
+      if (!ParseRange(value, range)) {
+        std::cout << "Wrong time range '" << value << "'" << std::endl;
+        throw std::invalid_argument("wrong time range");
+      }
+      ranges.push_back(range);
+    }
+    std::optional<size_t> trim_start, trim_length, trim_end;
+    for (size_t i = 0; i < input_arguments_.size();) {
+      auto& opt = input_arguments_[i];
+      if ((opt != "-ss" && opt != "-t" && opt != "-to") ||
+          i + 1 >= input_arguments_.size()) {
+        ++i;
+        continue;
+      }
+      size_t value = 0;
+      if (!ParseTime(input_arguments_[i + 1], value)) {
+        std::cout << "Wrong time '" << input_arguments_[i + 1] << "'"
+                  << std::endl;
+        throw std::invalid_argument("wrong time");
+      }
+      if (opt == "-ss") {
+        trim_start = value;
+      } else if (opt == "-t") {
+        trim_length = value;
+      } else {
+        trim_end = value;
+      }
+      input_arguments_.erase(
+          input_arguments_.begin() + i, input_arguments_.begin() + i + 2);
+    }
+    if (trim_start || trim_length || trim_end) {
+      if (!ranges.empty()) {
+        std::cout << "Use either time ranges or -ss/-t/-to" << std::endl;
+        throw std::invalid_argument("both ranges and trimming");
+      }
+      size_t start = trim_start.value_or(0);
+      size_t end = std::numeric_limits<size_t>::max();
+      if (trim_length) {
+        end = start + trim_length.value();
+      } else if (trim_end) {
+        end = trim_end.value();
+      }
+      if (start >= end) {
+        throw std::invalid_argument("empty time range");
+      }
+      ranges.push_back({start, end});
+    }
+
+    if (follow_ && (inputs_.size() > 1 || !ranges.empty() ||
+                       options.SmartRender)) {
+      std::cout << "Growing source must be a single input file converted "
+                   "entirely, without smart rendering"
+                << std::endl;
+      throw std::invalid_argument("wrong growing source");
+    }
+
+    output_file_ = outputs[0].OutputFile;
+    output_arguments_ = outputs[0].OutputArguments;
+    auto out_ext = output_file_.extension();
+    renditions_.assign(outputs.begin() + 1, outputs.end());
+    for (size_t i = 0; i < outputs.size(); ++i) {
+      for (size_t j = i + 1; j < outputs.size(); ++j) {
+        if (outputs[i].OutputFile == outputs[j].OutputFile) {
+          std::cout << "Output file " << outputs[i].OutputFile.string()
+                    << " is specified twice" << std::endl;
+          throw std::invalid_argument("duplicated output file");
+        }
+      }
+      if (outputs.size() > 1 &&
+          outputs[i].OutputFile.extension() == kHlsExtension) {
+        std::cout << "HLS output can't be combined with other outputs"
+                  << std::endl;
+        throw std::invalid_argument("HLS output with other outputs");
+      }
+    }
 
     std::cout << "New task creation:" << std::endl;
-    // Создаём хранилище для задачи
+    // Создаём хранилище для задачи. Блокировка задачи удерживается до конца
+    // создания, чтобы обработчик задач не взял её в работу раньше времени
     fs::path task_path;
-    if (!CreateNewTaskStorage(id_, task_path)) {
-      throw std::runtime_error("can't create task storage");
+    if (!CreateNewTaskStorage(id_, task_path, lock)) {
+      std::cerr << "ERROR: Can't create task storage" << std::endl;
+      return false;
     }
     std::cout << "  Task: " << id_ << std::endl;
-    std::cout << "  Source: " << input_file_.string() << std::endl;
+    std::cout << "  Source: " << inputs_[0].FileName.string();
+    if (inputs_.size() > 1) {
+      std::cout << " (+" << inputs_.size() - 1 << " more)";
+    }
+    std::cout << std::endl;
 
     assert(task_path.is_absolute());
     task_cfg_path_ = task_path / kTaskCfgFile;
-    interim_video_file_ = task_path / kInterimVideoFile;
-    interim_video_file_.replace_extension(out_ext);
-    interim_data_file_ = task_path / kInterimDataFile;
+    auto work_path = task_path;
+    if (!CreateScratchDir(options)) {
+      throw std::runtime_error("can't create scratch directory");
+    }
+    if (!scratch_dir_.empty()) {
+      work_path = scratch_dir_;
+      std::cout << "  Scratch: " << scratch_dir_.string() << std::endl;
+    }
+    auto chunk_ext = out_ext;
+    if (interim_format_ == kInterimFormatTs) {
+      chunk_ext = kTsExtension;
+    } else if (interim_format_ == kInterimFormatFmp4) {
+      chunk_ext = kMp4Extension;
+    } else if (interim_format_ == kInterimFormatMkv) {
+      chunk_ext = kMkvExtension;
+    }
+    interim_video_file_ = work_path / kInterimVideoFile;
+    interim_video_file_.replace_extension(chunk_ext);
+    interim_data_file_ = work_path / kInterimDataFile;
     interim_data_file_.replace_extension(out_ext);
     list_file_ = task_path / kInterimListFile;
 
-    std::cout << "    parsing ... " << std::flush;
-    if (!GenerateChunks(task_path, out_ext)) {
-      std::cout << "failed" << std::endl;
-      throw std::invalid_argument("failed to parse input file");
-    }
-    std::cout << "ok" << std::endl;
+    // Явно заданные параметры фрагментов означают выполнение по фрагментам
+    if (IsVideoStreamCopy(output_arguments_) && !stream_concat_ &&
+        options.InterimFormat.empty() && renditions_.empty() &&
+        inputs_.size() == 1 && ranges.empty() && !follow_) {
+      mode_ = kTaskModeDirect;
+      std::cout << "    video stream copy: direct single-pass conversion"
+                << std::endl;
+    } else if (out_ext == kHlsExtension) {
+      // Фрагменты видео сразу пишутся сегментами рядом с плейлистом.
+      // Звук кодируется одним проходом в отдельную аудиоверсию со своим
+      // плейлистом (см. RunSplit): при кодировании сегментов по отдельности
+      // на стыках были бы щелчки. Объединение не нужно
+      if (stream_concat_ || !options.InterimFormat.empty()) {
+        std::cout << "Interim format can't be set for HLS output" << std::endl;
+        throw std::invalid_argument("interim format for HLS output");
+      }
+      if (options.SmartRender) {
+        std::cout << "Smart rendering isn't supported for HLS output"
+                  << std::endl;
+        throw std::invalid_argument("smart rendering for HLS output");
+      }
+      mode_ = kTaskModeHls;
+      interim_format_ = kInterimFormatTs;
+      if (!InspectStreams()) {
+        std::cout << "Can't get streams of input file" << std::endl;
+        throw std::invalid_argument("failed to inspect input file");
+      }
+      interim_data_file_ = output_file_.parent_path() /
+                           (output_file_.stem().string() + kHlsAudioSuffix +
+                               kHlsExtension);
+      interim_data_file_complete_ = streams_.Audio == 0;
+      interim_data_file_empty_ = streams_.Audio == 0;
+      std::cout << "    HLS output: chunks are published as segments"
+                << (streams_.Audio == 0 ? "" : ", audio as a separate rendition")
+                << std::endl;
+      std::cout << "    parsing ... " << std::flush;
+      if (!GenerateChunks(ranges, false)) {
+        std::cout << "failed" << std::endl;
+        throw std::invalid_argument("failed to parse input file");
+      }
+      std::cout << "ok" << std::endl;
+    } else {
+      bool inspected = InspectStreams();
+      if (options.SmartRender) {
+        // Скопированные и перекодированные участки объединяются без
+        // перекодирования: кодер должен давать формат исходного видео
+        auto format = GetEncoderFormat(GetVideoCodec(output_arguments_));
+        if (!inspected || !renditions_.empty() ||
+            HasVideoFilters(output_arguments_) ||
+            format != streams_.VideoCodec) {
+          std::cout << "Smart rendering requires a single output encoded to "
+                       "the source video codec ("
+                    << streams_.VideoCodec << ") without video filters"
+                    << std::endl;
+          throw std::invalid_argument("smart rendering isn't possible");
+        }
+        if (!streams_.PixelFormat.empty() &&
+            std::find(output_arguments_.begin(), output_arguments_.end(),
+                "-pix_fmt") == output_arguments_.end()) {
+          output_arguments_.push_back("-pix_fmt");
+          output_arguments_.push_back(streams_.PixelFormat);
+        }
+      }
+      std::cout << "    parsing ... " << std::flush;
+      if (!GenerateChunks(ranges, options.SmartRender)) {
+        std::cout << "failed" << std::endl;
+        throw std::invalid_argument("failed to parse input file");
+      }
+      std::cout << "ok" << std::endl;
+      if (follow_) {
+        std::cout << "    growing source: " << chunks_.size()
+                  << " chunks are ready, others are added as it grows"
+                  << std::endl;
+      }
+      if (options.SmartRender) {
+        auto copied = std::count_if(chunks_.begin(), chunks_.end(),
+            [](const Chunk& ch) { return ch.Copy; });
+        std::cout << "    smart rendering: " << copied << " of "
+                  << chunks_.size() << " chunks are copied" << std::endl;
+      }
+      if (!renditions_.empty()) {
+        std::cout << "    outputs: " << renditions_.size() + 1
+                  << ", each chunk is decoded once for all of them"
+                  << std::endl;
+        GenerateRenditionChunks(
+            interim_format_ == kInterimFormatNative ? fs::path() : chunk_ext,
+            task_path);
+      }
+
+      if (inspected && streams_.Audio == 0 && streams_.Subtitle == 0 &&
+          streams_.Data == 0) {
+        // Только видео: фрагменты объединяются сразу в выходной файл
+        std::cout << "    video-only source, no stream extraction"
+                  << std::endl;
+        interim_data_file_complete_ = true;
+        interim_data_file_empty_ = true;
+      } else if (!follow_ && GenerateAudioChunks(work_path)) {
+        std::cout << "    audio is decoded in " << audio_chunks_.size()
+                  << " chunks along with video" << std::endl;
+        audio_list_file_ = task_path / kInterimAudioListFile;
+        if (!GenerateAudioListFile()) {
+          throw std::invalid_argument("failed to save audio list file");
+        }
+      }
 
-    if (!GenerateListFile()) {
-      throw std::invalid_argument("failed to save list file");
+      if (!GenerateListFile()) {
+        throw std::invalid_argument("failed to save list file");
+      }
     }
 
     if (!Save()) {
@@ -146,8 +757,14 @@ bool Task::CreateFromArguments(int argc, char** argv) {
     is_created_ = true;
     return true;
   } catch (std::invalid_argument&) {
+  } catch (std::runtime_error& err) {
+    std::cerr << "ERROR: " << err.what() << std::endl;
   } catch (std::bad_alloc&) {
   }
+  if (!scratch_dir_.empty()) {
+    std::error_code err;
+    fs::remove_all(scratch_dir_, err);
+  }
   Clear();
   if (!DeleteTask(id_)) {
     std::cerr << "Can't delete broken task. The task will be deleted later"
@@ -156,7 +773,7 @@ bool Task::CreateFromArguments(int argc, char** argv) {
   return false;
 }
 
-bool Task::CreateFromID(size_t id) {
+bool Task::CreateFromID(size_t id, bool probe_chunks) {
   Clear();
   try {
     fs::path hd = fs::absolute(HomeDirLibrary::GetHomeDir());
@@ -173,7 +790,7 @@ bool Task::CreateFromID(size_t id) {
       return false;
     }
 
-    if (!Validate()) {
+    if (!Validate(probe_chunks)) {
       std::cerr << "Task " << id
                 << " contains wrong and unrestorable parameters" << std::endl;
       return false;
@@ -199,7 +816,27 @@ bool Task::DeleteTask(size_t id) {
     }
 
     auto task_path = hd / kTaskFolder / std::to_string(id);
+    // Временные файлы задачи могут храниться вне папки задачи
+    fs::path scratch;
+    try {
+      std::ifstream f(task_path / kTaskCfgFile);
+      if (f) {
+        auto data = json::parse(f);
+        std::string strv = data["interim"].value("scratch", "");
+        scratch = strv;
+      }
+    } catch (std::exception&) {
+    }
+    if (!scratch.empty() &&
+        scratch.filename() == kScratchPrefix + std::to_string(id)) {
+      fs::remove_all(scratch);
+    }
     fs::remove_all(task_path);
+    SourceStore::ReleaseTask(hd / kTaskFolder, id);
+    // Номера задач не используются повторно: файл блокировки удалённой задачи
+    // больше никому не нужен
+    std::error_code err;
+    fs::remove(hd / kTaskFolder / (std::to_string(id) + kTaskLockExt), err);
     return true;
   } catch (std::exception& err) {
     std::cerr << "ERROR: Can't delete task: " << err.what() << std::endl;
@@ -208,7 +845,34 @@ bool Task::DeleteTask(size_t id) {
 }
 
 
-bool Task::Run() {
+std::shared_ptr<FileLock> Task::LockTask(size_t id) {
+  try {
+    fs::path hd = fs::absolute(HomeDirLibrary::GetHomeDir());
+    if (hd.empty()) {
+      return nullptr;
+    }
+    auto lock_path = hd / kTaskFolder / (std::to_string(id) + kTaskLockExt);
+    return std::make_shared<FileLock>(lock_path);
+  } catch (std::exception&) {
+  }
+  return nullptr;
+}
+
+
+bool Task::TaskExists(size_t id) {
+  try {
+    fs::path hd = fs::absolute(HomeDirLibrary::GetHomeDir());
+    if (hd.empty()) {
+      return false;
+    }
+    return fs::is_directory(hd / kTaskFolder / std::to_string(id));
+  } catch (std::exception&) {
+  }
+  return false;
+}
+
+
+bool Task::Run(LiveStatus* status, std::function<bool()> interrupted) {
   assert(is_created_);
   if (!is_created_) {
     std::cerr << "ERROR: usage of not-created task" << std::endl;
@@ -216,18 +880,135 @@ bool Task::Run() {
   }
 
   std::cout << "== Task " << id_ << " ==" << std::endl;
+  cache_.Open(GetAppDir() / kChunkCacheFolder);
+  status_ = status;
+  interrupted_ = interrupted;
+  waiting_source_ = false;
+  if (status_) {
+    size_t completed = std::count_if(chunks_.begin(), chunks_.end(),
+        [](const Chunk& ch) { return ch.Completed; });
+    status_->BeginTask(id_, chunks_.size(), completed);
+  }
+  bool result = RunPhases();
+  if (status_) {
+    status_->EndTask();
+  }
+  status_ = nullptr;
+  interrupted_ = nullptr;
+  return result;
+}
 
-  bool split_result = RunSplit();
 
-  std::cout << "Phase 2/4: Video convertation" << std::endl;
-  FFmpeg conv;
-  bool result = true;
+bool Task::CheckInterrupted() {
+  if (!interrupted_ || !interrupted_()) {
+    return false;
+  }
+  std::cout << "Task " << id_ << " is interrupted" << std::endl;
+  return true;
+}
+
+
+bool Task::RunPhases() {
+  if (interim_released_) {
+    std::cout << "Output file is ready" << std::endl;
+    return true;
+  }
+  if (CheckInterrupted()) {
+    return false;
+  }
+  if (mode_ == kTaskModeDirect) {
+    return RunDirect();
+  }
+
+  // Звуковые фрагменты конвертируются в отдельном потоке. При выходе из
+  // функции поток останавливается на границе фрагмента
+  std::atomic<bool> audio_stop(false);
+  std::thread audio;
+  struct AudioGuard {
+    std::atomic<bool>& Stop;
+    std::thread& Thread;
+    ~AudioGuard() {
+      Stop = true;
+      if (Thread.joinable()) {
+        Thread.join();
+      }
+    }
+  } audio_guard{audio_stop, audio};
+  bool split_result = true;
+  // Не-видео потоки растущего файла выделяются после окончания его записи
+  bool split_postponed = false;
+  if (audio_chunked_ && !interim_data_file_complete_) {
+    std::cout << "Phase 1/3: Extract non-video streams -- audio chunks run "
+                 "along with video"
+              << std::endl;
+    audio = std::thread([this, &audio_stop]() { RunAudioChunks(audio_stop); });
+  } else if (follow_ && !interim_data_file_complete_) {
+    std::cout << "Phase 1/3: Extract non-video streams -- after the source "
+                 "is complete"
+              << std::endl;
+    split_postponed = true;
+  } else {
+    split_result = RunSplit();
+  }
+
+  std::cout << "Phase 2/3: Video convertation" << std::endl;
+  if (status_) {
+    status_->SetPhase(LiveStatus::kPhaseConvert);
+    PublishProgress(0, 0);
+  }
+  size_t converted = 0;  // Длительность сконвертированного в этом запуске
+  size_t elapsed = 0;  // Время конвертации в этом запуске
   auto inarg = input_arguments_;
   inarg.push_back("-an");
   inarg.push_back("-sn");
   inarg.push_back("-dn");
+  if (stream_concat_ && !AppendCompletedChunks()) {
+    std::cout << "Can't append converted chunks to interim video file"
+              << std::endl;
+  }
   int chunk_counter = 1;
-  for (auto it = chunks_.begin(); it != chunks_.end(); ++it, ++chunk_counter) {
+  // Фрагменты, уже конвертированные с опережением. Неудачная конвертация не
+  // повторяется в этом запуске
+  std::set<size_t> ahead;
+  // Для растущего исходного файла список фрагментов дополняется после
+  // конвертации уже выделенных
+  // Копирование может быть отключено после проверки перекодированного
+  // фрагмента (см. MatchSourceVideo): тогда фрагменты проходятся заново
+  auto copying = [this]() {
+    return std::any_of(chunks_.begin(), chunks_.end(),
+        [](const Chunk& ch) { return ch.Copy; });
+  };
+  bool copied = copying();
+  for (auto it = chunks_.begin();; ++it, ++chunk_counter) {
+    if (it == chunks_.end() && copied && !copying()) {
+      copied = false;
+      if (std::any_of(chunks_.begin(), chunks_.end(),
+              [](const Chunk& ch) { return !ch.Completed; })) {
+        ahead.clear();
+        it = chunks_.begin();
+        chunk_counter = 1;
+      }
+    }
+    if (it == chunks_.end()) {
+      if (!follow_) {
+        break;
+      }
+      bool waiting = false;
+      if (!FollowSource(waiting)) {
+        return false;
+      }
+      if (waiting) {
+        // Задача возвращается в очередь: планировщик выполнит другие задачи
+        // и повторит эту через kFollowPollInterval
+        std::cout << "Waiting for the source to grow" << std::endl;
+        waiting_source_ = true;
+        return false;
+      }
+      it = chunks_.begin() + (chunk_counter - 1);
+      if (it == chunks_.end()) {
+        break;
+      }
+    }
     int percent = static_cast<int>(chunk_counter * 100 / chunks_.size());
     std::cout << "Chunk " << chunk_counter << "/" << chunks_.size() << " ("
               << percent << "%)" << std::flush;
@@ -235,63 +1016,401 @@ bool Task::Run() {
       std::cout << " - passed" << std::endl;
       continue;
     }
-    auto start = chr::steady_clock::now();
-    bool res = conv.DoConvertation(input_file_, it->FileName, it->StartTime,
-        it->Interval, inarg, output_arguments_);  // TODO PROCESS !!!
-    auto finish = chr::steady_clock::now();
-    auto interval =
-        chr::duration_cast<chr::milliseconds>(finish - start).count();
-    auto is = Microseconds2SecondsString(interval);
-    std::cout << " - complete (" << is << " s)";
-    if (!res) {
-      std::cout << " with error";
-    } else {
-      it->Completed = true;
-      if (!Save()) {
-        std::cout << " success, but saving error";
-      } else {
-        std::cout << " success";
+    if (ahead.count(static_cast<size_t>(chunk_counter - 1)) != 0) {
+      std::cout << " - failed ahead" << std::endl;
+      continue;
+    }
+    if (interrupted_ && interrupted_()) {
+      std::cout << " - interrupted" << std::endl;
+      return false;
+    }
+    // Пока устройства фрагмента заняты другой операцией (например, звук
+    // читает тот же источник), конвертируются следующие фрагменты со
+    // свободными устройствами. Чтение с одного устройства остаётся
+    // последовательным
+    size_t index = static_cast<size_t>(chunk_counter - 1);
+    auto access = GetChunkAccess(index);
+    DeviceLease lease;
+    while (!lease.TryAcquire(access)) {
+      DeviceLease other_lease;
+      size_t other = index + 1;
+      while (other < chunks_.size() &&
+             (chunks_[other].Completed || ahead.count(other) != 0 ||
+                 !other_lease.TryAcquire(GetChunkAccess(other)))) {
+        ++other;
+      }
+      if (other == chunks_.size()) {
+        // Конвертировать с опережением нечего: ждём освобождения устройств
+        lease.Acquire(access);
+        break;
       }
+      ahead.insert(other);
+      std::cout << " - device is busy" << std::endl;
+      std::cout << "Chunk " << other + 1 << "/" << chunks_.size()
+                << " (ahead)" << std::flush;
+      ConvertChunk(other, inarg, !audio.joinable(), converted, elapsed);
+      other_lease.Release();
+      if (CheckInterrupted()) {
+        return false;
+      }
+      std::cout << "Chunk " << chunk_counter << "/" << chunks_.size() << " ("
+                << percent << "%)" << std::flush;
     }
-    std::cout << std::endl;
+    ConvertChunk(index, inarg, !audio.joinable(), converted, elapsed);
   }
 
+  for (auto it = chunks_.begin(); it != chunks_.end(); ++it) {
+    if (!it->Completed) {
+      std::cout << "Some chunks aren't converted. Run the task again"
+                << std::endl;
+      return false;
+    }
+  }
 
-  RunConcatenation();  // TODO echo
-
-  if (!RunMerge()) {
+  if (audio.joinable()) {
+    if (status_) {
+      status_->SetPhase(LiveStatus::kPhaseSplit);
+    }
+    audio.join();
+    split_result = RunAudioConcatenation();
+  }
+  if (split_postponed) {
+    split_result = RunSplit();
+  }
+  if (!split_result) {
+    std::cout << "Non-video streams aren't extracted. Run the task again"
+              << std::endl;
     return false;
-  }  // TODO echo, check returns, etc
+  }
+
+  if (mode_ == kTaskModeHls) {
+    // Все сегменты готовы: плейлист дописывается признаком окончания
+    if (!WritePlaylist()) {
+      std::cout << "Can't write playlist " << output_file_.string()
+                << std::endl;
+      return false;
+    }
+    output_file_complete_ = true;
+    interim_released_ = true;
+    if (!Save()) {
+      return false;
+    }
+    std::cout << "Playlist is complete" << std::endl;
+    return true;
+  }
 
-  return true;  // TODO check return value
+  if (CheckInterrupted()) {
+    return false;
+  }
+  if (!interim_video_file_complete_ && !output_file_complete_ &&
+      interim_format_ == kInterimFormatTs) {
+    // Фрагменты MPEG-TS объединяются без демультиплексирования
+    if (!RunJoin()) {
+      return false;
+    }
+  }
+  // Если видеофрагменты уже объединены в промежуточный файл (дописыванием
+  // фрагментов MPEG-TS или в предыдущей версии), осталось добавить остальные
+  // потоки
+  bool res = interim_video_file_complete_ ? RunMerge()
+                                          : RunConcatenationAndMerge();
+  if (res) {
+    res = RunRenditions();
+  }
+  if (res) {
+    ReleaseInterimFiles();
+  }
+  return res;
 }
 
 
-void Task::Clear() {
-  is_created_ = false;
-  input_arguments_.clear();
-  output_arguments_.clear();
-  input_file_.clear();
-  output_file_.clear();
-  list_file_.clear();
-}
+bool Task::ConvertChunk(size_t index, const std::vector<std::string>& inarg,
+    bool drop_cache, size_t& converted, size_t& elapsed) {
+  FFmpeg conv;
+  auto it = chunks_.begin() + index;
+  if (status_) {
+    status_->SetWorkerChunk(0, index);
+  }
+  // Дополнительные выходные файлы получаются тем же процессом. Готовые
+  // ранее не конвертируются повторно
+  std::vector<FFmpeg::Output> extra;
+  std::vector<size_t> extra_index;
+  for (size_t r = 0; r < it->Renditions.size(); ++r) {
+    if (!it->Renditions[r].Completed) {
+      extra.push_back({it->Renditions[r].FileName,
+          ChunkOutputArguments(*it, renditions_[r].OutputArguments)});
+      extra_index.push_back(r);
+    }
+  }
+  auto outarg = ChunkOutputArguments(*it, output_arguments_);
+  size_t chunk_start = it->StartTime;
+  size_t chunk_interval = it->Interval;
+  if (it->Copy) {
+    // Поиск при копировании приходится на ключевой кадр не позже заданного
+    // времени. Небольшой сдвиг вперёд защищает от округления времени кадра
+    // до предыдущего ключевого кадра
+    outarg.push_back("-c:v");
+    outarg.push_back("copy");
+    chunk_start += kCopySeekMargin;
+    chunk_interval -= kCopySeekMargin;
+  }
 
-std::vector<size_t> Task::GetTasks() {
-  try {
-    std::vector<size_t> result;
-    fs::path hd = fs::absolute(HomeDirLibrary::GetHomeDir());
-    if (hd.empty()) {
-      return result;
+  // Ключи кэша для файлов фрагмента: основного и дополнительных
+  std::vector<fs::path> files = {it->FileName};
+  for (const auto& out : extra) {
+    files.push_back(out.File);
+  }
+  std::vector<std::string> keys;
+  std::string identity;
+  if (cache_.IsOpen()) {
+    identity = ChunkCache::FileIdentity(inputs_[it->Input].FileName);
+  }
+  if (!identity.empty()) {
+    // Аргументы приводятся к единому виду: перестановка опций или другое
+    // написание (-vcodec и -c:v) не меняют результат конвертации
+    auto input_args = NormalizeArguments(inarg);
+    auto make_key = [&](const fs::path& file,
+                        const std::vector<std::string>& args) {
+      std::vector<std::string> parts = {identity, std::to_string(chunk_start),
+          std::to_string(chunk_interval), file.extension().string(),
+          std::to_string(input_args.size())};
+      parts.insert(parts.end(), input_args.begin(), input_args.end());
+      auto output_args = NormalizeArguments(args);
+      parts.insert(parts.end(), output_args.begin(), output_args.end());
+      return cache_.MakeKey(parts);
+    };
+    keys.push_back(make_key(it->FileName, outarg));
+    for (const auto& out : extra) {
+      keys.push_back(make_key(out.File, out.Arguments));
     }
+  }
 
-    auto task_path = hd / kTaskFolder;
-    // переберём все задачи
-    for (const auto& item : fs::directory_iterator(task_path)) {
-      if (!item.is_directory()) {
-        continue;
-      }
-      auto name = item.path().filename().string();
-      long long num = 0;
+  auto start = chr::steady_clock::now();
+  // Результат той же конвертации берётся из кэша, если там есть все файлы
+  bool cached = !keys.empty();
+  for (size_t i = 0; cached && i < files.size(); ++i) {
+    uint64_t size;
+    cached = cache_.Restore(keys[i], files[i], size);
+  }
+  bool res = cached;
+  if (!cached) {
+    // Файл может быть жёсткой ссылкой на запись кэша: ffmpeg должен создать
+    // новый файл, а не перезаписать её
+    std::error_code err;
+    for (const auto& file : files) {
+      fs::remove(file, err);
+    }
+    // Пока фрагмент конвертируется, ядро читает в кэш участки следующих
+    std::thread prefetch([this, index]() { PrefetchChunks(index + 1); });
+    // Пустой результат для видеофрагмента тоже ошибка: такой фрагмент нельзя
+    // объединять с остальными
+    res = conv.DoConvertation(inputs_[it->Input].FileName, it->FileName,
+              chunk_start, chunk_interval, inarg, outarg, extra) ==
+          FFmpeg::kProcessSuccess;  // TODO PROCESS !!!
+    prefetch.join();
+  }
+  std::error_code err;
+  auto fsize = fs::file_size(it->FileName, err);
+  if (err || fsize == 0) {
+    res = false;
+  }
+  std::vector<size_t> extra_size;
+  for (const auto& out : extra) {
+    auto size = fs::file_size(out.File, err);
+    if (err || size == 0) {
+      res = false;
+    }
+    extra_size.push_back(err ? 0 : static_cast<size_t>(size));
+  }
+  auto finish = chr::steady_clock::now();
+  auto interval =
+      chr::duration_cast<chr::milliseconds>(finish - start).count();
+  auto is = Microseconds2SecondsString(interval);
+  std::cout << (cached ? " - cached (" : " - complete (") << is << " s)";
+  if (status_) {
+    status_->SetWorkerChunk(0, LiveStatus::kNoChunk);
+  }
+  if (!res) {
+    std::cout << " with error";
+  } else {
+    uint64_t offset;
+    uint64_t length;
+    if (!cached && drop_cache && GetChunkSourceRange(index, offset, length)) {
+      // Прочитанный участок больше не нужен: не вытесняем им из кэша
+      // остальные данные
+      AdviseFileRange(inputs_[it->Input].FileName, offset, length,
+          kAdviceDontNeed);
+    }
+    for (size_t i = 0; !cached && i < keys.size(); ++i) {
+      cache_.Store(keys[i], files[i]);
+    }
+    std::lock_guard<std::recursive_mutex> lk(lock_);
+    std::string mismatch;
+    if (!it->Copy &&
+        std::any_of(chunks_.begin(), chunks_.end(),
+            [](const Chunk& ch) { return ch.Copy; }) &&
+        !MatchSourceVideo(it->FileName, mismatch)) {
+      // Скопированные участки нельзя объединить с перекодированными:
+      // перекодируется всё видео, включая уже скопированные фрагменты
+      std::cout << ", video doesn't match the source (" << mismatch
+                << "), smart rendering is turned off";
+      for (auto& ch : chunks_) {
+        if (ch.Copy) {
+          ch.Copy = false;
+          ch.Completed = false;
+        }
+      }
+      if (appended_chunks_ > 0) {
+        // Дописанные фрагменты удалены: промежуточный файл собирается заново
+        for (auto& ch : chunks_) {
+          ch.Completed = false;
+        }
+        appended_chunks_ = 0;
+        appended_offset_ = 0;
+        std::error_code err;
+        fs::remove(interim_video_file_, err);
+      }
+    }
+    it->Completed = true;
+    it->FileSize = static_cast<size_t>(fsize);
+    for (size_t e = 0; e < extra_index.size(); ++e) {
+      auto& rend = it->Renditions[extra_index[e]];
+      rend.Completed = true;
+      rend.FileSize = extra_size[e];
+    }
+    if (!cached) {
+      // Скорость конвертации оценивается только по перекодированию
+      converted += it->Interval;
+      elapsed += static_cast<size_t>(interval) * 1000;
+      if (elapsed > 0) {
+        speed_ = static_cast<double>(converted) / elapsed;
+      }
+    }
+    PublishProgress(converted, elapsed);
+    if (!Save()) {
+      std::cout << " success, but saving error";
+    } else {
+      std::cout << " success";
+    }
+    if (stream_concat_ && !AppendCompletedChunks()) {
+      std::cout << ", append error";
+    }
+    if (mode_ == kTaskModeHls && !WritePlaylist()) {
+      std::cout << ", playlist error";
+    }
+  }
+  std::cout << std::endl;
+  return res;
+}
+
+
+std::vector<IoAccess> Task::GetChunkAccess(size_t index) const {
+  const auto& ch = chunks_[index];
+  std::vector<IoAccess> access = {
+      {inputs_[ch.Input].FileName, false}, {ch.FileName, true}};
+  for (const auto& rend : ch.Renditions) {
+    access.push_back({rend.FileName, true});
+  }
+  return access;
+}
+
+
+std::vector<IoAccess> Task::GetAssemblyAccess(
+    const fs::path& video, const fs::path& output) const {
+  std::vector<IoAccess> access = {{output, true}};
+  if (!video.empty()) {
+    access.push_back({video, false});
+  }
+  if (!interim_data_file_empty_) {
+    access.push_back({interim_data_file_, false});
+  }
+  return access;
+}
+
+
+void Task::PublishProgress(size_t converted, size_t elapsed) {
+  if (!status_) {
+    return;
+  }
+  size_t completed = 0;
+  size_t remain = 0;
+  uint64_t bytes = 0;
+  for (auto it = chunks_.begin(); it != chunks_.end(); ++it) {
+    if (it->Completed) {
+      ++completed;
+      bytes += it->FileSize;
+      for (const auto& rend : it->Renditions) {
+        bytes += rend.FileSize;
+      }
+    } else {
+      remain += it->Interval;
+    }
+  }
+  if (interim_data_file_complete_ && !interim_data_file_empty_) {
+    std::error_code err;
+    auto size = fs::file_size(interim_data_file_, err);
+    if (!err) {
+      bytes += size;
+    }
+  }
+
+  double speed = 0.0;
+  uint64_t eta = 0;
+  if (converted > 0 && elapsed > 0) {
+    speed = static_cast<double>(converted) / elapsed;
+    eta = static_cast<uint64_t>(remain / speed);
+  }
+  status_->SetProgress(completed, speed, eta, bytes);
+}
+
+
+size_t Task::EstimateRemaining() const {
+  size_t remain = 0;
+  for (auto it = chunks_.begin(); it != chunks_.end(); ++it) {
+    if (!it->Completed) {
+      remain += it->Interval;
+    }
+  }
+  // Без измерений считаем конвертацию идущей в реальном времени
+  double speed = speed_ > 0.0 ? speed_ : 1.0;
+  return static_cast<size_t>(remain / speed);
+}
+
+
+void Task::Clear() {
+  is_created_ = false;
+  priority_ = 0;
+  deadline_ = 0;
+  speed_ = 0.0;
+  input_arguments_.clear();
+  output_arguments_.clear();
+  inputs_.clear();
+  output_file_.clear();
+  list_file_.clear();
+  scratch_dir_.clear();
+  renditions_.clear();
+  follow_idle_ = 0;
+  follow_growth_ = 0;
+  follow_writer_ = false;
+  follow_size_ = 0;
+}
+
+std::vector<size_t> Task::GetTasks() {
+  try {
+    std::vector<size_t> result;
+    fs::path hd = fs::absolute(HomeDirLibrary::GetHomeDir());
+    if (hd.empty()) {
+      return result;
+    }
+
+    auto task_path = hd / kTaskFolder;
+    // переберём все задачи
+    for (const auto& item : fs::directory_iterator(task_path)) {
+      if (!item.is_directory()) {
+        continue;
+      }
+      auto name = item.path().filename().string();
+      long long num = 0;
       try {
         num = std::stoll(name);
         if (num < 0) {
@@ -312,132 +1431,1262 @@ std::vector<size_t> Task::GetTasks() {
   return {};
 }
 
-bool Task::TaskCompleted() { return is_created_ && output_file_complete_; }
+std::vector<Task::ScheduleInfo> Task::GetSchedule() {
+  std::vector<ScheduleInfo> result;
+  try {
+    fs::path hd = fs::absolute(HomeDirLibrary::GetHomeDir());
+    if (hd.empty()) {
+      return result;
+    }
+
+    auto tasks = GetTasks();
+    for (auto it = tasks.begin(); it != tasks.end(); ++it) {
+      ScheduleInfo si = {*it, 0, 0, 0};
+      // Задача может ещё создаваться: тогда планируется с параметрами по
+      // умолчанию
+      auto cfg = hd / kTaskFolder / std::to_string(*it) / kTaskCfgFile;
+      Task t;
+      if (fs::exists(cfg) && t.Load(cfg)) {
+        si.Priority = t.priority_;
+        si.Deadline = t.deadline_;
+        si.Eta = t.EstimateRemaining();
+      }
+      result.push_back(si);
+    }
+  } catch (std::exception&) {
+  }
+
+  std::stable_sort(result.begin(), result.end(),
+      [](const ScheduleInfo& a, const ScheduleInfo& b) {
+        if (a.Priority != b.Priority) {
+          return a.Priority > b.Priority;
+        }
+        bool ad = a.Deadline != 0;
+        bool bd = b.Deadline != 0;
+        if (ad != bd) {
+          return ad;
+        }
+        if (ad) {
+          // Запас времени: срок минус оставшееся время. Текущий момент для
+          // всех задач общий, поэтому в сравнении не участвует
+          long long as = a.Deadline * 1000000LL - (long long)a.Eta;
+          long long bs = b.Deadline * 1000000LL - (long long)b.Eta;
+          if (as != bs) {
+            return as < bs;
+          }
+        }
+        return a.Id < b.Id;
+      });
+  return result;
+}
+
+
+bool Task::HasPreemptingTask(size_t id, int priority,
+    const std::function<bool(size_t)>& eligible) {
+  auto schedule = GetSchedule();
+  for (auto it = schedule.begin(); it != schedule.end(); ++it) {
+    if (it->Priority <= priority) {
+      break;
+    }
+    if (it->Id != id && eligible(it->Id)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+
+bool Task::TaskCompleted() { return is_created_ && OutputsComplete(); }
+
+
+bool Task::OutputsComplete() const {
+  if (!output_file_complete_) {
+    return false;
+  }
+  for (const auto& rend : renditions_) {
+    if (!rend.Complete) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+void Task::Swap(Task& arg1, Task& arg2) noexcept {
+  std::swap(arg1.is_created_, arg2.is_created_);
+  std::swap(arg1.task_cfg_path_, arg2.task_cfg_path_);
+  std::swap(arg1.id_, arg2.id_);
+  std::swap(arg1.status_, arg2.status_);
+  std::swap(arg1.interrupted_, arg2.interrupted_);
+  std::swap(arg1.cache_, arg2.cache_);
+  std::swap(arg1.waiting_source_, arg2.waiting_source_);
+  std::swap(arg1.follow_size_, arg2.follow_size_);
+  std::swap(arg1.input_arguments_, arg2.input_arguments_);
+  std::swap(arg1.output_arguments_, arg2.output_arguments_);
+  std::swap(arg1.inputs_, arg2.inputs_);
+  std::swap(arg1.follow_, arg2.follow_);
+  std::swap(arg1.follow_idle_, arg2.follow_idle_);
+  std::swap(arg1.follow_growth_, arg2.follow_growth_);
+  std::swap(arg1.follow_writer_, arg2.follow_writer_);
+  std::swap(arg1.output_file_, arg2.output_file_);
+  std::swap(arg1.output_file_complete_, arg2.output_file_complete_);
+  std::swap(arg1.list_file_, arg2.list_file_);
+  std::swap(arg1.scratch_dir_, arg2.scratch_dir_);
+  std::swap(arg1.duration_, arg2.duration_);
+  std::swap(arg1.priority_, arg2.priority_);
+  std::swap(arg1.deadline_, arg2.deadline_);
+  std::swap(arg1.speed_, arg2.speed_);
+  std::swap(arg1.chunks_, arg2.chunks_);
+  std::swap(arg1.renditions_, arg2.renditions_);
+  std::swap(arg1.audio_chunked_, arg2.audio_chunked_);
+  std::swap(arg1.audio_preroll_, arg2.audio_preroll_);
+  std::swap(arg1.audio_list_file_, arg2.audio_list_file_);
+  std::swap(arg1.audio_chunks_, arg2.audio_chunks_);
+  std::swap(arg1.interim_video_file_, arg2.interim_video_file_);
+  std::swap(
+      arg1.interim_video_file_complete_, arg2.interim_video_file_complete_);
+  std::swap(arg1.interim_format_, arg2.interim_format_);
+  std::swap(arg1.stream_concat_, arg2.stream_concat_);
+  std::swap(arg1.appended_chunks_, arg2.appended_chunks_);
+  std::swap(arg1.appended_offset_, arg2.appended_offset_);
+  std::swap(arg1.interim_released_, arg2.interim_released_);
+  std::swap(arg1.mode_, arg2.mode_);
+  std::swap(arg1.streams_, arg2.streams_);
+  std::swap(arg1.interim_data_file_, arg2.interim_data_file_);
+  std::swap(arg1.interim_data_file_complete_, arg2.interim_data_file_complete_);
+  std::swap(arg1.interim_data_file_empty_, arg2.interim_data_file_empty_);
+}
+
+
+void Task::Copy(Task& arg_to, const Task& arg_from) {
+  arg_to.is_created_ = arg_from.is_created_;
+  arg_to.task_cfg_path_ = arg_from.task_cfg_path_;
+  arg_to.id_ = arg_from.id_;
+  arg_to.status_ = arg_from.status_;
+  arg_to.interrupted_ = arg_from.interrupted_;
+  arg_to.cache_ = arg_from.cache_;
+  arg_to.waiting_source_ = arg_from.waiting_source_;
+  arg_to.follow_size_ = arg_from.follow_size_;
+  arg_to.input_arguments_ = arg_from.input_arguments_;
+  arg_to.output_arguments_ = arg_from.output_arguments_;
+  arg_to.inputs_ = arg_from.inputs_;
+  arg_to.follow_ = arg_from.follow_;
+  arg_to.follow_idle_ = arg_from.follow_idle_;
+  arg_to.follow_growth_ = arg_from.follow_growth_;
+  arg_to.follow_writer_ = arg_from.follow_writer_;
+  arg_to.output_file_ = arg_from.output_file_;
+  arg_to.output_file_complete_ = arg_from.output_file_complete_;
+  arg_to.list_file_ = arg_from.list_file_;
+  arg_to.scratch_dir_ = arg_from.scratch_dir_;
+  arg_to.duration_ = arg_from.duration_;
+  arg_to.priority_ = arg_from.priority_;
+  arg_to.deadline_ = arg_from.deadline_;
+  arg_to.speed_ = arg_from.speed_;
+  arg_to.chunks_ = arg_from.chunks_;
+  arg_to.renditions_ = arg_from.renditions_;
+  arg_to.audio_chunked_ = arg_from.audio_chunked_;
+  arg_to.audio_preroll_ = arg_from.audio_preroll_;
+  arg_to.audio_list_file_ = arg_from.audio_list_file_;
+  arg_to.audio_chunks_ = arg_from.audio_chunks_;
+  arg_to.interim_video_file_ = arg_from.interim_video_file_;
+  arg_to.interim_video_file_complete_ = arg_from.interim_video_file_complete_;
+  arg_to.interim_format_ = arg_from.interim_format_;
+  arg_to.stream_concat_ = arg_from.stream_concat_;
+  arg_to.appended_chunks_ = arg_from.appended_chunks_;
+  arg_to.appended_offset_ = arg_from.appended_offset_;
+  arg_to.interim_released_ = arg_from.interim_released_;
+  arg_to.mode_ = arg_from.mode_;
+  arg_to.streams_ = arg_from.streams_;
+  arg_to.interim_data_file_ = arg_from.interim_data_file_;
+  arg_to.interim_data_file_complete_ = arg_from.interim_data_file_complete_;
+  arg_to.interim_data_file_empty_ = arg_from.interim_data_file_empty_;
+}
+
+
+bool Task::GenerateChunks(
+    const std::vector<std::pair<size_t, size_t>>& ranges, bool smart) {
+  duration_ = 0;
+  for (auto& in : inputs_) {
+    // Сведения о растущем файле меняются, их не с кем разделить
+    SourceStore store;
+    if (!follow_) {
+      store.Open(GetAppDir(), in.FileName, id_);
+    }
+    if (!store.RequestDuration(in.Duration)) {
+      return false;
+    }
+    in.Offset = duration_;
+    duration_ += in.Duration;
+  }
+
+  chunks_.clear();
+  if (follow_) {
+    // Конец растущего файла ещё не записан: остальные фрагменты добавит
+    // FollowSource. Пустой список допустим
+    if (duration_ > kFollowMargin) {
+      PlanChunks(0, 0, duration_ - kFollowMargin, false, true);
+    }
+    return true;
+  }
+
+  // Диапазоны общей шкалы времени делятся по границам исходных файлов
+  auto segments = ranges;
+  if (segments.empty()) {
+    segments.push_back({0, duration_});
+  }
+  for (const auto& seg : segments) {
+    for (size_t input = 0; input < inputs_.size(); ++input) {
+      const auto& in = inputs_[input];
+      size_t start = std::max(seg.first, in.Offset);
+      size_t end = std::min(seg.second, in.Offset + in.Duration);
+      if (start < end) {
+        PlanChunks(input, start - in.Offset, end - in.Offset, smart, false);
+      }
+    }
+  }
+
+  return !chunks_.empty();
+}
+
+
+void Task::PlanChunks(
+    size_t input, size_t start, size_t end, bool smart, bool open_end) {
+  size_t chunk_size = kDefaultChunkSize;
+  size_t minimal_size = kMinimalChunkSize;
+  if (mode_ == kTaskModeHls) {
+    chunk_size = kHlsSegmentSize;
+    minimal_size = kHlsMinimalSegmentSize;
+  }
+  const auto& in = inputs_[input];
+  SourceStore store;
+  if (!follow_) {
+    store.Open(GetAppDir(), in.FileName, id_);
+  }
+
+  auto add_chunk = [&](size_t start, size_t end, bool copy,
+                       size_t position = FFmpeg::kUnknownPosition) {
+    Chunk ch;
+    ch.FileName = ChunkFileName(chunks_.size());
+    ch.StartTime = start;
+    ch.Interval = end - start;
+    ch.Input = input;
+    ch.Copy = copy;
+    ch.Completed = false;
+    ch.FileSize = 0;
+    ch.SourcePosition = start == 0 ? 0 : position;
+    chunks_.push_back(ch);
+  };
+
+  std::vector<size_t> keys;
+  if (smart && store.RequestKeyFrames(
+                   start, end - start + kSearchInterval, keys)) {
+    // Целые группы кадров между первым и последним ключевым кадром
+    // участка копируются фрагментами порядка chunk_size. Неполные группы
+    // в начале и в конце участка перекодируются
+    keys.erase(std::remove_if(keys.begin(), keys.end(),
+                   [start, end](size_t key) {
+                     return key < start || key > end;
+                   }),
+        keys.end());
+    if (keys.size() >= 2) {
+      if (start < keys.front()) {
+        add_chunk(start, keys.front(), false);
+      }
+      size_t from = keys.front();
+      for (size_t i = 1; i < keys.size(); ++i) {
+        if (keys[i] - from >= chunk_size || i + 1 == keys.size()) {
+          add_chunk(from, keys[i], true);
+          from = keys[i];
+        }
+      }
+      if (from < end) {
+        add_chunk(from, end, false);
+      }
+      return;
+    }
+  }
+
+  // Найдём предпочтительные границы фрагментов. Для границ по ключевым кадрам
+  // запоминается их смещение в файле
+  std::vector<size_t> time_marks;
+  std::vector<size_t> positions;
+  time_marks.push_back(start);
+  positions.push_back(FFmpeg::kUnknownPosition);
+  size_t pos = start + chunk_size;
+  while (pos < end) {
+    size_t ord_frame;
+    size_t key_frame;
+    size_t key_position = FFmpeg::kUnknownPosition;
+    size_t mark = pos;
+    if (store.RequestFrames(
+            pos, kSearchInterval, ord_frame, key_frame, key_position)) {
+      if (key_frame != 0) {
+        mark = key_frame;
+      } else {
+        key_position = FFmpeg::kUnknownPosition;
+        if (ord_frame != 0) {
+          mark = ord_frame;
+        }
+      }
+    }  // else граница остаётся невыровненной
+    if (mark <= time_marks.back() || mark >= end) {
+      // Найденный кадр вне участка
+      mark = pos;
+      key_position = FFmpeg::kUnknownPosition;
+    }
+
+    time_marks.push_back(mark);
+    positions.push_back(key_position);
+    pos = mark + chunk_size;
+  }
+  if (!open_end) {
+    time_marks.push_back(end);
+    positions.push_back(FFmpeg::kUnknownPosition);
+  } else if (time_marks.size() < 2) {
+    // Данных пока меньше, чем на один фрагмент
+    return;
+  }
+
+  // Проредим фрагменты, чтобы убрать совсем короткие
+  assert(time_marks.size() >= 2);
+  for (int i = static_cast<int>(time_marks.size()) - 2; i > 0; --i) {
+    assert(i >= 0);
+    assert((i + 1) < time_marks.size());
+    if ((time_marks[i + 1] - time_marks[i]) < minimal_size) {
+      time_marks.erase(time_marks.begin() + i);
+      positions.erase(positions.begin() + i);
+      continue;
+    }
+  }
+  if ((time_marks.size() >= 3) &&
+      ((time_marks[1] - time_marks[0]) < minimal_size)) {
+    time_marks.erase(time_marks.begin() + 1);
+    positions.erase(positions.begin() + 1);
+  }
+  assert(time_marks.size() >= 2);
+  assert(time_marks[0] == start);
+  assert(open_end || time_marks.back() == end);
+
+  for (size_t i = 0; i + 1 < time_marks.size(); ++i) {
+    add_chunk(time_marks[i], time_marks[i + 1], false, positions[i]);
+  }
+}
+
+
+bool Task::GetChunkSourceRange(
+    size_t index, uint64_t& offset, uint64_t& length) const {
+  const auto& ch = chunks_[index];
+  const auto& in = inputs_[ch.Input];
+  std::error_code err;
+  auto size = fs::file_size(in.FileName, err);
+  if (err || size == 0 || in.Duration == 0) {
+    return false;
+  }
+  auto position = [&](size_t time, size_t known) -> uint64_t {
+    if (known != FFmpeg::kUnknownPosition) {
+      return known;
+    }
+    return static_cast<uint64_t>(static_cast<double>(size) * time / in.Duration);
+  };
+  size_t end_time = ch.StartTime + ch.Interval;
+  size_t end_known = end_time >= in.Duration ? size : FFmpeg::kUnknownPosition;
+  if (index + 1 < chunks_.size()) {
+    const auto& next = chunks_[index + 1];
+    if (next.Input == ch.Input && next.StartTime == end_time) {
+      end_known = next.SourcePosition;
+    }
+  }
+  offset = std::min<uint64_t>(position(ch.StartTime, ch.SourcePosition), size);
+  auto end = std::min<uint64_t>(position(end_time, end_known), size);
+  if (end <= offset) {
+    return false;
+  }
+  length = end - offset;
+  return true;
+}
+
+
+void Task::PrefetchChunks(size_t first) const {
+  uint64_t budget = kPrefetchBudget;
+  for (size_t i = first; i < chunks_.size() && budget > 0; ++i) {
+    uint64_t offset;
+    uint64_t length;
+    if (chunks_[i].Completed || !GetChunkSourceRange(i, offset, length)) {
+      continue;
+    }
+    length = std::min(length, budget);
+    AdviseFileRange(
+        inputs_[chunks_[i].Input].FileName, offset, length, kAdviceWillNeed);
+    budget -= length;
+  }
+}
+
+
+fs::path Task::ChunkFileName(size_t index) const {
+  std::stringstream number;
+  number << std::setw(6) << std::setfill('0') << index;
+  if (mode_ == kTaskModeHls) {
+    // Сегменты HLS лежат рядом с плейлистом
+    return output_file_.parent_path() /
+           (output_file_.stem().string() + "_" + number.str() + kTsExtension);
+  }
+  return interim_video_file_.parent_path() /
+         (kChunkPrefix + number.str() +
+             interim_video_file_.extension().string());
+}
+
+
+bool Task::FollowSource(bool& waiting) {
+  assert(follow_ && inputs_.size() == 1);
+  waiting = false;
+  auto& in = inputs_[0];
+  auto end_marker = in.FileName;
+  end_marker += kFollowEndExtension;
+  std::error_code err;
+  auto size = fs::file_size(in.FileName, err);
+  bool grown = !err && size != follow_size_;
+  bool ended = fs::exists(end_marker, err);
+  auto now = chr::duration_cast<chr::seconds>(
+      chr::system_clock::now().time_since_epoch()).count();
+  // Время роста и замеченный процесс записи сохраняются: проверка
+  // продолжается после перезапуска
+  bool changed = false;
+  if (grown || follow_growth_ == 0) {
+    follow_growth_ = now;
+    changed = true;
+  }
+  auto writer = GetFileWriteState(in.FileName);
+  if (writer == kWriteOpen && !follow_writer_) {
+    follow_writer_ = true;
+    changed = true;
+  }
+  if (!grown && !ended) {
+    // Закрытие файла учитывается, только если записывающий процесс был
+    // замечен: процессы других пользователей не видны
+    if (follow_writer_ && writer == kWriteClosed) {
+      std::cout << "Source file is closed by the writer" << std::endl;
+      ended = true;
+    } else if (follow_idle_ > 0 && now - follow_growth_ >= follow_idle_) {
+      std::cout << "Source file hasn't grown for " << now - follow_growth_
+                << " s" << std::endl;
+      ended = true;
+    } else {
+      waiting = true;
+      return !changed || Save();
+    }
+  }
+  if (grown) {
+    follow_size_ = size;
+  }
+
+  FFmpeg fm;
+  size_t duration = 0;
+  if (fm.RequestDuration(in.FileName, duration) && duration > in.Duration) {
+    in.Duration = duration;
+    duration_ = duration;
+  }
+  size_t covered = 0;
+  if (!chunks_.empty()) {
+    covered = chunks_.back().StartTime + chunks_.back().Interval;
+  }
+  auto before = chunks_.size();
+  std::lock_guard<std::recursive_mutex> lk(lock_);
+  if (ended) {
+    if (covered < in.Duration) {
+      PlanChunks(0, covered, in.Duration, false, false);
+    }
+    follow_ = false;
+    std::cout << "Source is complete: "
+              << Microseconds2SecondsString(in.Duration / 1000) << " s"
+              << std::endl;
+  } else if (in.Duration > covered + kFollowMargin) {
+    PlanChunks(0, covered, in.Duration - kFollowMargin, false, true);
+  }
+  if (chunks_.size() == before && follow_) {
+    // Данных пока меньше, чем на один фрагмент
+    waiting = true;
+    return !changed || Save();
+  }
+  GenerateRenditionChunks(interim_format_ == kInterimFormatNative
+                              ? fs::path()
+                              : interim_video_file_.extension(),
+      task_cfg_path_.parent_path());
+  if (mode_ != kTaskModeHls && !GenerateListFile()) {
+    std::cout << "Can't write list of chunks" << std::endl;
+    return false;
+  }
+  if (!Save()) {
+    return false;
+  }
+  if (status_) {
+    status_->SetChunksTotal(chunks_.size());
+  }
+  return true;
+}
+
+
+std::vector<std::tuple<size_t, size_t, size_t>> Task::GetSourceSegments()
+    const {
+  std::vector<std::tuple<size_t, size_t, size_t>> segments;
+  for (const auto& ch : chunks_) {
+    if (!segments.empty() && std::get<0>(segments.back()) == ch.Input &&
+        std::get<2>(segments.back()) == ch.StartTime) {
+      std::get<2>(segments.back()) += ch.Interval;
+      continue;
+    }
+    segments.emplace_back(ch.Input, ch.StartTime, ch.StartTime + ch.Interval);
+  }
+  return segments;
+}
+
+
+size_t Task::GetOutputPosition(const Chunk& chunk) const {
+  size_t position = 0;
+  for (const auto& ch : chunks_) {
+    if (&ch == &chunk) {
+      break;
+    }
+    position += ch.Interval;
+  }
+  return position;
+}
+
+bool Task::InspectStreams() {
+  // Исходные файлы объединяются в одну шкалу: учитываются потоки всех файлов
+  StreamLayout total{};
+  for (size_t i = 0; i < inputs_.size(); ++i) {
+    StreamLayout layout{};
+    if (!InspectInputStreams(inputs_[i].FileName, layout)) {
+      return false;
+    }
+    if (i == 0) {
+      total = layout;
+      continue;
+    }
+    total.Video = std::max(total.Video, layout.Video);
+    total.Audio = std::max(total.Audio, layout.Audio);
+    total.Subtitle = std::max(total.Subtitle, layout.Subtitle);
+    total.Data = std::max(total.Data, layout.Data);
+    if (layout.AudioSampleRate != total.AudioSampleRate) {
+      total.AudioSampleRate = 0;
+    }
+    // Разное видео нельзя объединить копированием (см. SmartRender)
+    if (layout.VideoCodec != total.VideoCodec ||
+        layout.PixelFormat != total.PixelFormat ||
+        layout.VideoProfile != total.VideoProfile ||
+        layout.VideoLevel != total.VideoLevel ||
+        layout.VideoRefs != total.VideoRefs ||
+        layout.SampleAspectRatio != total.SampleAspectRatio) {
+      total.VideoCodec.clear();
+      total.PixelFormat.clear();
+    }
+  }
+  streams_ = total;
+  return true;
+}
+
+
+bool Task::InspectInputStreams(
+    const fs::path& input, StreamLayout& layout) {
+  SourceStore store;
+  if (!follow_) {
+    store.Open(GetAppDir(), input, id_);
+  }
+  auto info = store.RequestStreamInfo();
+  if (info.empty()) {
+    return false;
+  }
+  return ParseStreamInfo(info, layout);
+}
+
+
+bool Task::ParseStreamInfo(const std::string& info, StreamLayout& layout) {
+  try {
+    auto data = json::parse(info);
+    layout = StreamLayout{true, 0, 0, 0, 0, 0, {}, {}, {}, 0, 0, {}};
+    bool same_rate = true;
+    for (auto& st : data["streams"]) {
+      std::string type = st.value("codec_type", "");
+      if (type == "video") {
+        if (++layout.Video == 1) {
+          layout.VideoCodec = st.value("codec_name", "");
+          layout.PixelFormat = st.value("pix_fmt", "");
+          layout.VideoProfile = st.value("profile", "");
+          layout.VideoLevel = st.value("level", 0);
+          layout.VideoRefs = st.value("refs", 0);
+          // Неизвестная форма пикселя означает квадратный пиксель
+          layout.SampleAspectRatio = st.value("sample_aspect_ratio", "");
+          if (layout.SampleAspectRatio.empty() ||
+              layout.SampleAspectRatio == "0:1") {
+            layout.SampleAspectRatio = "1:1";
+          }
+        }
+      } else if (type == "audio") {
+        ++layout.Audio;
+        size_t rate = std::stoull(st.value("sample_rate", "0"));
+        if (layout.Audio > 1 && rate != layout.AudioSampleRate) {
+          same_rate = false;
+        }
+        layout.AudioSampleRate = rate;
+      } else if (type == "subtitle") {
+        ++layout.Subtitle;
+      } else {
+        ++layout.Data;
+      }
+    }
+    if (!same_rate) {
+      layout.AudioSampleRate = 0;
+    }
+    return true;
+  } catch (std::exception&) {
+  }
+  return false;
+}
+
+
+bool Task::MatchSourceVideo(const fs::path& file, std::string& mismatch) const {
+  FFmpeg fm;
+  StreamLayout layout{};
+  if (!ParseStreamInfo(fm.RequestStreamInfo(file), layout) ||
+      layout.Video == 0) {
+    mismatch = "no video stream";
+    return false;
+  }
+  std::stringstream os;
+  auto check = [&os](const std::string& name, const auto& chunk,
+                   const auto& source) {
+    if (chunk != source) {
+      os << (os.tellp() > 0 ? ", " : "") << name << " " << chunk
+         << " instead of " << source;
+    }
+  };
+  check("codec", layout.VideoCodec, streams_.VideoCodec);
+  check("pixel format", layout.PixelFormat, streams_.PixelFormat);
+  check("profile", layout.VideoProfile, streams_.VideoProfile);
+  check("level", layout.VideoLevel, streams_.VideoLevel);
+  check("refs", layout.VideoRefs, streams_.VideoRefs);
+  check("SAR", layout.SampleAspectRatio, streams_.SampleAspectRatio);
+  mismatch = os.str();
+  return mismatch.empty();
+}
+
+
+bool Task::GenerateAudioChunks(const fs::path& task_path) {
+  // Звуковые фрагменты режутся по общей шкале одного исходного файла
+  if (inputs_.size() != 1) {
+    return false;
+  }
+  if (!streams_.Known || streams_.Audio == 0 || streams_.Subtitle != 0 ||
+      streams_.Data != 0 || streams_.AudioSampleRate == 0) {
+    return false;
+  }
+  // Граф фильтров ссылается на потоки исходного файла, а копируемый звук
+  // не перекодируется: в этих случаях звук выделяется одним проходом
+  for (size_t i = 0; i < output_arguments_.size(); ++i) {
+    const auto& opt = output_arguments_[i];
+    if (opt == "-filter_complex" || opt == "-lavfi") {
+      return false;
+    }
+    bool codec = opt == "-c" || opt == "-codec" || opt == "-acodec" ||
+                 opt.rfind("-c:a", 0) == 0 || opt.rfind("-codec:a", 0) == 0;
+    if (codec && i + 1 < output_arguments_.size() &&
+        output_arguments_[i + 1] == "copy") {
+      return false;
+    }
+  }
+
+  // Границы - целые отсчёты, точно выражаемые в микросекундах: соседние
+  // фрагменты делят отсчёты исходного звука без пропусков и повторов
+  uint64_t rate = streams_.AudioSampleRate;
+  uint64_t step = rate / std::gcd(rate, static_cast<uint64_t>(1000000));
+  size_t step_time = static_cast<size_t>(step * 1000000 / rate);
+  auto align = [rate, step](size_t time) {
+    uint64_t samples = static_cast<uint64_t>(time) * rate / 1000000;
+    return static_cast<size_t>(samples / step * step * 1000000 / rate);
+  };
+
+  audio_chunks_.clear();
+  for (size_t i = 0; i < chunks_.size(); ++i) {
+    std::stringstream suffix;
+    suffix << "audio_" << std::setw(6) << std::setfill('0') << i
+           << kAudioChunkExtension;
+    Chunk ch;
+    ch.FileName = task_path / suffix.str();
+    ch.StartTime = align(chunks_[i].StartTime);
+    ch.Input = 0;
+    ch.Copy = false;
+    ch.Completed = false;
+    ch.FileSize = 0;
+    ch.SourcePosition = FFmpeg::kUnknownPosition;
+    audio_chunks_.push_back(ch);
+  }
+  for (size_t i = 0; i < audio_chunks_.size(); ++i) {
+    // Фрагмент продолжается до следующего, если тот идёт подряд (в пределах
+    // диапазона времени), иначе до конца видеофрагмента
+    size_t end = chunks_[i].StartTime + chunks_[i].Interval;
+    size_t next = align(end);
+    if (i + 1 < audio_chunks_.size() && chunks_[i + 1].StartTime == end) {
+      next = audio_chunks_[i + 1].StartTime;
+    } else if (i + 1 == audio_chunks_.size() && end == inputs_[0].Duration) {
+      next = end;
+    }
+    audio_chunks_[i].Interval = next - audio_chunks_[i].StartTime;
+  }
+  audio_preroll_ = std::max(align(kAudioPreroll), step_time);
+  audio_chunked_ = true;
+  return true;
+}
+
+
+bool Task::GenerateAudioListFile() {
+  std::ofstream f(
+      audio_list_file_.string(), std::ios_base::out | std::ios_base::trunc);
+  for (auto it = audio_chunks_.begin(); it != audio_chunks_.end(); ++it) {
+    f << "file '" << it->FileName.string() << "'" << std::endl;
+  }
+  if (!f) {
+    return false;
+  }
+  return true;
+}
+
+
+void Task::ValidateAudioChunks() {
+  for (auto it = audio_chunks_.begin(); it != audio_chunks_.end(); ++it) {
+    if (!it->Completed) {
+      continue;
+    }
+    std::error_code err;
+    auto size = fs::file_size(it->FileName, err);
+    if (err || size == 0 || size != it->FileSize) {
+      it->Completed = false;
+    }
+  }
+}
+
+
+void Task::RunAudioChunks(const std::atomic<bool>& stop) {
+  FFmpeg conv;
+  auto inarg = input_arguments_;
+  inarg.push_back("-vn");
+  inarg.push_back("-sn");
+  inarg.push_back("-dn");
+  // Выбор потоков тот же, что и у выходного файла. Выбор отключённых
+  // видеопотоков (-map 0:v) необязателен, иначе ffmpeg завершится с ошибкой
+  std::vector<std::string> maps;
+  for (size_t i = 0; i + 1 < output_arguments_.size(); ++i) {
+    if (output_arguments_[i] == "-map") {
+      auto spec = output_arguments_[++i];
+      if (spec.back() != '?') {
+        spec.push_back('?');
+      }
+      maps.push_back("-map");
+      maps.push_back(spec);
+    }
+  }
+  uint64_t rate = streams_.AudioSampleRate;
+  for (size_t i = 0; i < audio_chunks_.size() && !stop; ++i) {
+    Chunk ch;
+    {
+      std::lock_guard<std::recursive_mutex> lk(lock_);
+      ch = audio_chunks_[i];
+    }
+    if (ch.Completed) {
+      continue;
+    }
+    if (status_) {
+      status_->SetWorkerChunk(1, static_cast<int64_t>(i));
+    }
+    // Фрагмент декодируется с запасом с обеих сторон, запас отрезается по
+    // отсчётам. Последний фрагмент идёт до конца звука
+    size_t preroll = std::min(audio_preroll_, ch.StartTime);
+    bool last = i + 1 == audio_chunks_.size() &&
+                ch.StartTime + ch.Interval == inputs_[0].Duration;
+    std::stringstream trim;
+    trim << "atrim=start_sample=" << preroll * rate / 1000000;
+    if (!last) {
+      trim << ":end_sample=" << (preroll + ch.Interval) * rate / 1000000;
+    }
+    trim << ",asetpts=PTS-STARTPTS";
+    auto outarg = maps;
+    outarg.insert(outarg.end(), {"-af", trim.str(), "-c:a", kAudioChunkCodec});
+    DeviceLease lease;
+    lease.Acquire({{inputs_[0].FileName, false}, {ch.FileName, true}});
+    bool res = conv.DoConvertation(inputs_[0].FileName, ch.FileName,
+                   ch.StartTime - preroll, preroll + ch.Interval + audio_preroll_,
+                   inarg, outarg) == FFmpeg::kProcessSuccess;
+    lease.Release();
+    std::error_code err;
+    auto fsize = fs::file_size(ch.FileName, err);
+    if (status_) {
+      status_->SetWorkerChunk(1, LiveStatus::kNoChunk);
+    }
+    if (!res || err || fsize == 0) {
+      std::cout << "Audio chunk " << i + 1 << " isn't decoded" << std::endl;
+      continue;
+    }
+    std::lock_guard<std::recursive_mutex> lk(lock_);
+    audio_chunks_[i].Completed = true;
+    audio_chunks_[i].FileSize = static_cast<size_t>(fsize);
+    Save();
+  }
+}
+
+
+bool Task::RunAudioConcatenation() {
+  size_t completed = std::count_if(audio_chunks_.begin(), audio_chunks_.end(),
+      [](const Chunk& ch) { return ch.Completed; });
+  std::cout << "Phase 1/3: Encode audio chunks (" << completed << "/"
+            << audio_chunks_.size() << " decoded) " << std::flush;
+  if (completed != audio_chunks_.size()) {
+    std::cout << "-- skip" << std::endl;
+    return false;
+  }
+  // Потоки уже выбраны при декодировании фрагментов: остальные аргументы
+  // выходного файла применяются к объединённому звуку за один проход
+  std::vector<std::string> outarg = {"-map", "0"};
+  for (size_t i = 0; i < output_arguments_.size(); ++i) {
+    if (output_arguments_[i] == "-map" && i + 1 < output_arguments_.size()) {
+      ++i;
+      continue;
+    }
+    outarg.push_back(output_arguments_[i]);
+  }
+  // Звуковые фрагменты лежат в одной папке
+  std::vector<IoAccess> access = {{interim_data_file_, true}};
+  if (!audio_chunks_.empty()) {
+    access.push_back({audio_chunks_.front().FileName, false});
+  }
+  DeviceLease lease;
+  lease.Acquire(access);
+  FFmpeg conv;
+  auto start = chr::steady_clock::now();
+  auto res = conv.DoConvertation(audio_list_file_, interim_data_file_, {}, {},
+      {"-f", "concat", "-safe", "0"}, outarg);
+  lease.Release();
+  auto finish = chr::steady_clock::now();
+  auto interval = chr::duration_cast<chr::milliseconds>(finish - start).count();
+  auto is = Microseconds2SecondsString(interval);
+  if (res == FFmpeg::kProcessError) {
+    std::cout << "-- complete with error (" << is << " s)" << std::endl;
+    return false;
+  }
+  interim_data_file_complete_ = true;
+  interim_data_file_empty_ = res == FFmpeg::kProcessEmpty;
+  if (!Save()) {
+    std::cout << "-- complete, but saving error (" << is << " s)" << std::endl;
+    return false;
+  }
+  std::cout << "-- complete (" << is << " s)" << std::endl;
+  // Звуковые фрагменты учтены в промежуточном файле и больше не нужны
+  std::error_code err;
+  for (auto it = audio_chunks_.begin(); it != audio_chunks_.end(); ++it) {
+    fs::remove(it->FileName, err);
+  }
+  return true;
+}
+
+
+void Task::GenerateRenditionChunks(
+    const fs::path& chunk_ext, const fs::path& task_path) {
+  for (size_t r = 0; r < renditions_.size(); ++r) {
+    auto number = std::to_string(r + 1);
+    renditions_[r].ListFile =
+        task_path / (kRenditionListPrefix + number + kListExtension);
+    auto ext = chunk_ext.empty() ? renditions_[r].OutputFile.extension()
+                                 : chunk_ext;
+    for (auto& ch : chunks_) {
+      if (ch.Renditions.size() > r) {
+        continue;
+      }
+      auto name = ch.FileName;
+      name.replace_filename(ch.FileName.stem().string() + "_" + number);
+      name.replace_extension(ext);
+      ch.Renditions.push_back({name, false, 0});
+    }
+  }
+}
+
+
+bool Task::GenerateListFile() {
+  assert(!list_file_.empty());
+  if (list_file_.empty()) {
+    return false;
+  }
+  std::ofstream f(
+      list_file_.string(), std::ios_base::out | std::ios_base::trunc);
+  for (auto it = chunks_.begin(); it != chunks_.end(); ++it) {
+    f << "file '" << it->FileName.string() << "'" << std::endl;
+  }
+  if (!f) {
+    return false;
+  }
+  for (size_t r = 0; r < renditions_.size(); ++r) {
+    std::ofstream rf(renditions_[r].ListFile.string(),
+        std::ios_base::out | std::ios_base::trunc);
+    for (auto it = chunks_.begin(); it != chunks_.end(); ++it) {
+      rf << "file '" << it->Renditions[r].FileName.string() << "'"
+         << std::endl;
+    }
+    if (!rf) {
+      return false;
+    }
+  }
+  return true;
+}
+
+
+std::vector<std::string> Task::ChunkOutputArguments(
+    const Chunk& chunk, const std::vector<std::string>& arguments) const {
+  auto args = arguments;
+  if (interim_format_ == kInterimFormatTs) {
+    // Метки времени фрагмента продолжают метки предыдущего: так фрагменты
+    // можно объединять простым дописыванием байт
+    args.push_back("-f");
+    args.push_back("mpegts");
+    args.push_back("-output_ts_offset");
+    args.push_back(TimeArgument(GetOutputPosition(chunk)));
+  } else if (interim_format_ == kInterimFormatFmp4) {
+    // Индекс пишется в начало, данные - фрагментами: при объединении не нужно
+    // разбирать и переписывать таблицы moov
+    args.push_back("-f");
+    args.push_back("mp4");
+    args.push_back("-movflags");
+    args.push_back("+frag_keyframe+empty_moov+default_base_moof");
+  } else if (interim_format_ == kInterimFormatMkv) {
+    // Без индекса (cues): файл читается последовательно
+    args.push_back("-f");
+    args.push_back("matroska");
+    args.push_back("-live");
+    args.push_back("1");
+  }
+  return args;
+}
+
+
+bool Task::AppendCompletedChunks() {
+  std::lock_guard<std::recursive_mutex> lk(lock_);
+  if (interim_format_ != kInterimFormatTs || interim_video_file_complete_) {
+    return true;
+  }
+  while (appended_chunks_ < chunks_.size() &&
+         chunks_[appended_chunks_].Completed) {
+    uint64_t size = 0;
+    if (!AppendFile(chunks_[appended_chunks_].FileName, interim_video_file_,
+            appended_offset_, size)) {
+      return false;
+    }
+    if (appended_chunks_ > 0 &&
+        !MarkTsDiscontinuity(interim_video_file_, appended_offset_)) {
+      return false;
+    }
+    appended_offset_ += static_cast<size_t>(size);
+    ++appended_chunks_;
+    if (appended_chunks_ == chunks_.size() && !follow_) {
+      interim_video_file_complete_ = true;
+    }
+    if (!Save()) {
+      return false;
+    }
+    // Фрагмент учтён в промежуточном файле и больше не нужен
+    std::error_code err;
+    fs::remove(chunks_[appended_chunks_ - 1].FileName, err);
+  }
+  if (appended_chunks_ == chunks_.size() && !follow_ &&
+      !interim_video_file_complete_) {
+    // Запись растущего источника закончилась без новых фрагментов
+    interim_video_file_complete_ = true;
+    return Save();
+  }
+  return true;
+}
+
+
+bool Task::WritePlaylist() {
+  std::lock_guard<std::recursive_mutex> lk(lock_);
+  // Длительность не должна меняться между перечитываниями плейлиста: она
+  // считается по всем запланированным сегментам, а для растущего файла - и по
+  // наибольшему сегменту, который ещё может быть добавлен (см. PlanChunks)
+  size_t longest = 0;
+  if (follow_) {
+    longest = kHlsSegmentSize + kSearchInterval + kHlsMinimalSegmentSize;
+  }
+  for (const auto& ch : chunks_) {
+    longest = std::max(longest, ch.Interval);
+  }
+  size_t target = std::max<size_t>(1, (longest + 999999) / 1000000);
+  bool complete = !follow_;
+  std::stringstream segments;
+  for (auto it = chunks_.begin(); it != chunks_.end(); ++it) {
+    if (!it->Completed) {
+      complete = false;
+      break;
+    }
+    segments << "#EXTINF:" << TimeArgument(it->Interval) << ","
+             << std::endl;
+    segments << it->FileName.filename().string() << std::endl;
+  }
+
+  // Проигрыватель не должен увидеть недописанный плейлист
+  auto publish = [](const fs::path& file, const std::string& content) {
+    auto temp_file = file;
+    temp_file += ".tmp";
+    try {
+      std::ofstream f(temp_file, std::ios_base::trunc);
+      f << content;
+      f.close();
+      if (!f) {
+        return false;
+      }
+    } catch (std::exception&) {
+      return false;
+    }
+    std::error_code err;
+    fs::rename(temp_file, file, err);
+    return !err;
+  };
+
+  std::stringstream video;
+  video << "#EXTM3U" << std::endl;
+  video << "#EXT-X-VERSION:3" << std::endl;
+  video << "#EXT-X-PLAYLIST-TYPE:" << (complete ? "VOD" : "EVENT")
+        << std::endl;
+  video << "#EXT-X-TARGETDURATION:" << target << std::endl;
+  video << "#EXT-X-MEDIA-SEQUENCE:0" << std::endl;
+  video << segments.str();
+  if (complete) {
+    video << "#EXT-X-ENDLIST" << std::endl;
+  }
+  if (interim_data_file_empty_) {
+    // Звука нет: плейлист сегментов видео и есть основной
+    return publish(output_file_, video.str());
+  }
+
+  // Основной плейлист ссылается на плейлисты видео и звука. Аудиоверсия
+  // растущего файла кодируется после окончания записи: до этого основной
+  // плейлист содержит только видео
+  auto video_file = output_file_.parent_path() /
+                    (output_file_.stem().string() + kHlsVideoSuffix +
+                        kHlsExtension);
+  if (!publish(video_file, video.str())) {
+    return false;
+  }
+  std::stringstream master;
+  master << "#EXTM3U" << std::endl;
+  master << "#EXT-X-VERSION:3" << std::endl;
+  if (interim_data_file_complete_) {
+    master << "#EXT-X-MEDIA:TYPE=AUDIO,GROUP-ID=\"audio\",NAME=\"audio\","
+              "DEFAULT=YES,AUTOSELECT=YES,URI=\""
+           << interim_data_file_.filename().string() << "\"" << std::endl;
+  }
+  master << "#EXT-X-STREAM-INF:BANDWIDTH=" << GetHlsBandwidth()
+         << (interim_data_file_complete_ ? ",AUDIO=\"audio\"" : "")
+         << std::endl;
+  master << video_file.filename().string() << std::endl;
+  return publish(output_file_, master.str());
+}
+
+
+uint64_t Task::GetHlsBandwidth() const {
+  // Пиковая скорость видео по готовым сегментам, без них - средняя скорость
+  // исходного файла. К ней добавляется средняя скорость сегментов звука
+  uint64_t bandwidth = 0;
+  for (const auto& ch : chunks_) {
+    if (ch.Completed && ch.Interval > 0) {
+      bandwidth = std::max<uint64_t>(bandwidth,
+          static_cast<uint64_t>(ch.FileSize) * 8 * 1000000 / ch.Interval);
+    }
+  }
+  if (bandwidth == 0 && duration_ > 0) {
+    bandwidth = GetInputSize() * 8 * 1000000 / duration_;
+  }
+  if (interim_data_file_complete_ && duration_ > 0) {
+    uint64_t audio_bytes = 0;
+    auto prefix = interim_data_file_.stem().string() + "_";
+    std::error_code err;
+    for (const auto& item :
+        fs::directory_iterator(interim_data_file_.parent_path(), err)) {
+      auto name = item.path().filename().string();
+      if (name.rfind(prefix, 0) == 0 && item.path().extension() == kTsExtension) {
+        audio_bytes += item.file_size(err);
+      }
+    }
+    bandwidth += audio_bytes * 8 * 1000000 / duration_;
+  }
+  return std::max<uint64_t>(bandwidth, 1);
+}
+
 
-
-void Task::Swap(Task& arg1, Task& arg2) noexcept {
-  std::swap(arg1.is_created_, arg2.is_created_);
-  std::swap(arg1.task_cfg_path_, arg2.task_cfg_path_);
-  std::swap(arg1.id_, arg2.id_);
-  std::swap(arg1.input_arguments_, arg2.input_arguments_);
-  std::swap(arg1.output_arguments_, arg2.output_arguments_);
-  std::swap(arg1.input_file_, arg2.input_file_);
-  std::swap(arg1.output_file_, arg2.output_file_);
-  std::swap(arg1.output_file_complete_, arg2.output_file_complete_);
-  std::swap(arg1.list_file_, arg2.list_file_);
-  std::swap(arg1.duration_, arg2.duration_);
-  std::swap(arg1.chunks_, arg2.chunks_);
-  std::swap(arg1.interim_video_file_, arg2.interim_video_file_);
-  std::swap(
-      arg1.interim_video_file_complete_, arg2.interim_video_file_complete_);
-  std::swap(arg1.interim_data_file_, arg2.interim_data_file_);
-  std::swap(arg1.interim_data_file_complete_, arg2.interim_data_file_complete_);
-  std::swap(arg1.interim_data_file_empty_, arg2.interim_data_file_empty_);
+void Task::ReleaseInterimFiles() {
+  if (interim_released_ || !OutputsComplete()) {
+    return;
+  }
+  interim_released_ = true;
+  if (!Save()) {
+    interim_released_ = false;
+    return;
+  }
+  std::error_code err;
+  for (auto it = chunks_.begin(); it != chunks_.end(); ++it) {
+    fs::remove(it->FileName, err);
+    for (const auto& rend : it->Renditions) {
+      fs::remove(rend.FileName, err);
+    }
+  }
+  for (auto it = audio_chunks_.begin(); it != audio_chunks_.end(); ++it) {
+    fs::remove(it->FileName, err);
+  }
+  fs::remove(interim_video_file_, err);
+  fs::remove(interim_data_file_, err);
 }
 
 
-void Task::Copy(Task& arg_to, const Task& arg_from) {
-  arg_to.is_created_ = arg_from.is_created_;
-  arg_to.task_cfg_path_ = arg_from.task_cfg_path_;
-  arg_to.id_ = arg_from.id_;
-  arg_to.input_arguments_ = arg_from.input_arguments_;
-  arg_to.output_arguments_ = arg_from.output_arguments_;
-  arg_to.input_file_ = arg_from.input_file_;
-  arg_to.output_file_ = arg_from.output_file_;
-  arg_to.output_file_complete_ = arg_from.output_file_complete_;
-  arg_to.list_file_ = arg_from.list_file_;
-  arg_to.duration_ = arg_from.duration_;
-  arg_to.chunks_ = arg_from.chunks_;
-  arg_to.interim_video_file_ = arg_from.interim_video_file_;
-  arg_to.interim_video_file_complete_ = arg_from.interim_video_file_complete_;
-  arg_to.interim_data_file_ = arg_from.interim_data_file_;
-  arg_to.interim_data_file_complete_ = arg_from.interim_data_file_complete_;
-  arg_to.interim_data_file_empty_ = arg_from.interim_data_file_empty_;
+fs::path Task::GetAppDir() const {
+  return task_cfg_path_.parent_path().parent_path();
 }
 
 
-bool Task::GenerateChunks(const std::filesystem::path& task_path,
-    const std::filesystem::path& chunk_ext) {
-  FFmpeg fm;
-
-  if (!fm.RequestDuration(input_file_, duration_)) {
-    return false;
+uint64_t Task::GetInputSize() const {
+  uint64_t total = 0;
+  for (const auto& input : inputs_) {
+    std::error_code err;
+    auto size = fs::file_size(input.FileName, err);
+    if (!err) {
+      total += size;
+    }
   }
+  return total;
+}
 
-  // Найдём предпочтительные границы фрагментов
-  std::vector<size_t> time_marks;
-  time_marks.push_back(0);
-  size_t pos = kDefaultChunkSize;
-  while (pos < duration_) {
-    size_t ord_frame;
-    size_t key_frame;
-    if (fm.RequestFrames(
-            input_file_, pos, kSearchInterval, ord_frame, key_frame)) {
-      if (key_frame != 0) {
-        pos = key_frame;
-      } else if (ord_frame != 0) {
-        pos = ord_frame;
-      }
-    }  // else pos остаётся невыровненной
 
-    time_marks.push_back(pos);
-    pos += kDefaultChunkSize;
+bool Task::CheckDiskSpace() const {
+  if (interim_released_ || output_file_complete_) {
+    return true;
   }
-  time_marks.push_back(duration_);
-
-  // Проредим фрагменты, чтобы убрать совсем короткие
-  assert(time_marks.size() >= 2);
-  for (int i = static_cast<int>(time_marks.size()) - 2; i > 0; --i) {
-    assert(i >= 0);
-    assert((i + 1) < time_marks.size());
-    if ((time_marks[i + 1] - time_marks[i]) < kMinimalChunkSize) {
-      time_marks.erase(time_marks.begin() + i);
-      continue;
+  // Объём на единицу времени оценим по готовым фрагментам, иначе по исходному
+  // файлу
+  uint64_t completed_bytes = 0;
+  size_t completed_time = 0;
+  size_t total_time = 0;
+  for (auto it = chunks_.begin(); it != chunks_.end(); ++it) {
+    total_time += it->Interval;
+    if (it->Completed && it->FileSize > 0) {
+      completed_bytes += it->FileSize;
+      completed_time += it->Interval;
     }
   }
-  if ((time_marks.size() >= 3) &&
-      ((time_marks[1] - time_marks[0]) < kMinimalChunkSize)) {
-    time_marks.erase(time_marks.begin() + 1);
+  std::error_code err;
+  double rate = 0.0;
+  if (completed_time > 0) {
+    rate = static_cast<double>(completed_bytes) / completed_time;
+  } else {
+    // Объём на единицу времени исходных файлов: при конвертации диапазонов
+    // фрагменты покрывают лишь часть исходных файлов
+    size_t input_time = 0;
+    for (const auto& input : inputs_) {
+      input_time += input.Duration;
+    }
+    if (input_time == 0) {
+      // Длительность не сохранена (задача из старой версии)
+      input_time = total_time;
+    }
+    if (input_time > 0) {
+      rate = static_cast<double>(GetInputSize()) / input_time;
+    }
   }
-  assert(time_marks.size() >= 2);
-  assert(time_marks[0] == 0);
-  assert(time_marks.back() == duration_);
-
-  chunks_.clear();
-  for (int i = 0; i < time_marks.size() - 1; ++i) {
-    std::filesystem::path ch_fname;
-    std::stringstream suffix;
-    suffix << "chunk_" << std::setw(6) << std::setfill('0') << i
-           << chunk_ext.string();
-    Chunk ch;
-    ch.FileName = task_path / suffix.str();
-    ch.StartTime = time_marks[i];
-    ch.Interval = time_marks[i + 1] - time_marks[i];
-    ch.Completed = false;
-    chunks_.push_back(ch);
+  // Оценка по основному выходному файлу. Дополнительные выходные файлы
+  // считаются такого же объёма
+  uint64_t outputs = 1 + renditions_.size();
+  completed_bytes *= outputs;
+  uint64_t remain_bytes =
+      static_cast<uint64_t>(rate * (total_time - completed_time)) * outputs;
+  uint64_t data_bytes = 0;
+  if (interim_data_file_complete_ && !interim_data_file_empty_) {
+    auto size = fs::file_size(interim_data_file_, err);
+    data_bytes = err ? 0 : size;
+  }
+  uint64_t output_bytes = completed_bytes + remain_bytes + data_bytes;
+  if (mode_ == kTaskModeDirect) {
+    // Копирование потоков: выходной файл порядка исходного
+    remain_bytes = 0;
+    output_bytes = GetInputSize();
+  } else if (mode_ == kTaskModeHls) {
+    // Фрагменты пишутся сразу в папку выходного файла
+    output_bytes = remain_bytes;
+    remain_bytes = 0;
   }
 
+  // Уже записанные файлы учтены в свободном месте. Потребуются оставшиеся
+  // фрагменты и выходной файл, запас - на неточность оценки
+  auto work_dir = interim_video_file_.parent_path();
+  auto output_dir = output_file_.parent_path();
+  auto work_space = fs::space(work_dir, err);
+  if (err) {
+    return true;
+  }
+  auto output_space = fs::space(output_dir, err);
+  if (err) {
+    return true;
+  }
+  bool same_device = SameDevice(work_dir, output_dir);
+  uint64_t work_required = remain_bytes;
+  if (same_device) {
+    work_required += output_bytes;
+  }
+  work_required += work_required / kSpaceReserveRatio;
+  uint64_t output_required = output_bytes + output_bytes / kSpaceReserveRatio;
+  if (work_required > work_space.available) {
+    std::cout << "Not enough disk space for task " << id_ << ": "
+              << work_required / kMegabyte << " MB required, "
+              << work_space.available / kMegabyte << " MB available in "
+              << work_dir.string() << std::endl;
+    return false;
+  }
+  if (!same_device && output_required > output_space.available) {
+    std::cout << "Not enough disk space for task " << id_ << ": "
+              << output_required / kMegabyte << " MB required, "
+              << output_space.available / kMegabyte << " MB available in "
+              << output_dir.string() << std::endl;
+    return false;
+  }
   return true;
 }
 
-bool Task::GenerateListFile() {
-  assert(!list_file_.empty());
-  if (list_file_.empty()) {
-    return false;
+
+bool Task::CreateScratchDir(const TaskOptions& options) {
+  std::vector<fs::path> candidates;
+  for (const auto& dir : options.Scratch) {
+    candidates.push_back(dir);
   }
-  std::ofstream f(
-      list_file_.string(), std::ios_base::out | std::ios_base::trunc);
-  for (auto it = chunks_.begin(); it != chunks_.end(); ++it) {
-    f << "file '" << it->FileName.string() << "'" << std::endl;
+  if (candidates.empty()) {
+    candidates = GetGlobalScratchDirs();
   }
-  if (!f) {
+  if (candidates.empty()) {
+    return true;
+  }
+
+  // Фрагменты занимают порядка размера исходного файла
+  auto required = GetInputSize();
+  auto dir = ChooseScratchDir(candidates, inputs_[0].FileName, required);
+  if (dir.empty()) {
+    std::cout << "WARNING: No scratch directory with enough free space. Task "
+                 "directory is used"
+              << std::endl;
+    return true;
+  }
+  scratch_dir_ = dir / (kScratchPrefix + std::to_string(id_));
+  std::error_code err;
+  fs::create_directories(scratch_dir_, err);
+  if (err) {
+    scratch_dir_.clear();
     return false;
   }
   return true;
 }
 
 
-bool Task::CreateNewTaskStorage(size_t& id, std::filesystem::path& task_path) {
+bool Task::CreateNewTaskStorage(size_t& id, std::filesystem::path& task_path,
+    std::shared_ptr<FileLock>& lock) {
   try {
     fs::path hd = fs::absolute(HomeDirLibrary::GetHomeDir());
     if (hd.empty()) {
@@ -448,8 +2697,21 @@ bool Task::CreateNewTaskStorage(size_t& id, std::filesystem::path& task_path) {
 
     task_path = hd / kTaskFolder;
     fs::create_directory(task_path);
-    // Найдём существующий максимальный номер (или ноль)
+    auto catalog_lock =
+        WaitLock(task_path / kCatalogLockFile, kCatalogLockTimeout);
+    if (!catalog_lock) {
+      std::cerr << "ERROR: Task catalog is locked by another process"
+                << std::endl;
+      return false;
+    }
+
+    // Найдём максимальный номер среди выданных ранее и существующих (или ноль)
+    auto id_path = task_path / kCatalogIdFile;
     id = 0;
+    {
+      std::ifstream idf(id_path);
+      idf >> id;
+    }
     for (const auto& item : fs::directory_iterator(task_path)) {
       if (!item.is_directory()) {
         continue;
@@ -473,9 +2735,15 @@ bool Task::CreateNewTaskStorage(size_t& id, std::filesystem::path& task_path) {
     }
 
     ++id;
+    lock = LockTask(id);
+    if (!lock) {
+      return false;
+    }
     task_path /= std::to_string(id);
     fs::create_directory(task_path);
-    return fs::is_directory(task_path);
+    std::ofstream idf(id_path, std::ios_base::trunc);
+    idf << id;
+    return idf && fs::is_directory(task_path);
   } catch (std::exception& err) {
     std::cerr << "ERROR: Can't create task: " << err.what() << std::endl;
   }
@@ -483,8 +2751,9 @@ bool Task::CreateNewTaskStorage(size_t& id, std::filesystem::path& task_path) {
 }
 
 bool Task::Save() {
+  std::lock_guard<std::recursive_mutex> lk(lock_);
   try {
-    assert(input_file_.is_absolute());
+    assert(!inputs_.empty() && inputs_[0].FileName.is_absolute());
     assert(output_file_.is_absolute());
 
     // Стандартная форматка
@@ -493,32 +2762,103 @@ bool Task::Save() {
                         {"data", {{"name", nullptr}, {"complete", false},
                                      {"empty", nullptr}}},
                         {"list", {{"name", nullptr}}}}},
-        {"chunks", nullptr}};
+        {"chunks", nullptr},
+        {"schedule", {{"priority", 0}, {"deadline", "0"}, {"speed", 0.0}}}};
 
     // Заполнение
-    j["input"]["0"]["name"] = input_file_.u8string();
+    for (size_t i = 0; i < inputs_.size(); ++i) {
+      auto is = std::to_string(i);
+      j["input"][is]["name"] = inputs_[i].FileName.u8string();
+      j["input"][is]["duration"] = std::to_string(inputs_[i].Duration);
+    }
     j["input"]["0"]["arguments"] = input_arguments_;
+    j["input"]["0"]["follow"] = follow_;
+    j["input"]["0"]["follow_idle"] = std::to_string(follow_idle_);
+    j["input"]["0"]["follow_growth"] = std::to_string(follow_growth_);
+    j["input"]["0"]["follow_writer"] = follow_writer_;
+    j["input"]["0"]["follow_size"] = std::to_string(follow_size_);
     j["output"]["0"]["name"] = output_file_.u8string();
     j["output"]["0"]["arguments"] = output_arguments_;
     j["output"]["0"]["complete"] = output_file_complete_;
+    for (size_t r = 0; r < renditions_.size(); ++r) {
+      auto& jo = j["output"][std::to_string(r + 1)];
+      jo["name"] = renditions_[r].OutputFile.u8string();
+      jo["arguments"] = renditions_[r].OutputArguments;
+      jo["complete"] = renditions_[r].Complete;
+      jo["list"]["name"] = renditions_[r].ListFile.u8string();
+    }
+    j["mode"] = mode_;
     j["interim"]["data"]["name"] = interim_data_file_.u8string();
     j["interim"]["data"]["complete"] = interim_data_file_complete_;
     j["interim"]["data"]["empty"] = interim_data_file_empty_;
     j["interim"]["video"]["name"] = interim_video_file_.u8string();
     j["interim"]["video"]["complete"] = interim_video_file_complete_;
+    j["interim"]["video"]["stream"] = stream_concat_;
+    j["interim"]["video"]["appended"] = std::to_string(appended_chunks_);
+    j["interim"]["video"]["offset"] = std::to_string(appended_offset_);
+    j["interim"]["format"] = interim_format_;
+    j["interim"]["released"] = interim_released_;
     j["interim"]["list"]["name"] = list_file_.u8string();
-
-    for (size_t i = 0; i < chunks_.size(); ++i) {
-      std::string v64;
-      auto is = std::to_string(i);
-      j["chunks"][is]["name"] = chunks_[i].FileName.u8string();
-      j["chunks"][is]["start"] = std::to_string(chunks_[i].StartTime);
-      j["chunks"][is]["duration"] = std::to_string(chunks_[i].Interval);
-      j["chunks"][is]["complete"] = chunks_[i].Completed;
+    j["interim"]["scratch"] = scratch_dir_.u8string();
+    if (streams_.Known) {
+      j["streams"]["video"] = streams_.Video;
+      j["streams"]["audio"] = streams_.Audio;
+      j["streams"]["subtitle"] = streams_.Subtitle;
+      j["streams"]["data"] = streams_.Data;
+      j["streams"]["audio_sample_rate"] = streams_.AudioSampleRate;
+      j["streams"]["video_codec"] = streams_.VideoCodec;
+      j["streams"]["pixel_format"] = streams_.PixelFormat;
+      j["streams"]["video_profile"] = streams_.VideoProfile;
+      j["streams"]["video_level"] = streams_.VideoLevel;
+      j["streams"]["video_refs"] = streams_.VideoRefs;
+      j["streams"]["sample_aspect_ratio"] = streams_.SampleAspectRatio;
+    }
+    j["schedule"]["priority"] = priority_;
+    j["schedule"]["deadline"] = std::to_string(deadline_);
+    j["schedule"]["speed"] = speed_;
+
+    auto save_chunks = [](const std::vector<Chunk>& chunks, json& jc) {
+      for (size_t i = 0; i < chunks.size(); ++i) {
+        auto is = std::to_string(i);
+        jc[is]["name"] = chunks[i].FileName.u8string();
+        jc[is]["start"] = std::to_string(chunks[i].StartTime);
+        jc[is]["duration"] = std::to_string(chunks[i].Interval);
+        jc[is]["input"] = std::to_string(chunks[i].Input);
+        jc[is]["copy"] = chunks[i].Copy;
+        jc[is]["complete"] = chunks[i].Completed;
+        jc[is]["size"] = std::to_string(chunks[i].FileSize);
+        if (chunks[i].SourcePosition != FFmpeg::kUnknownPosition) {
+          jc[is]["position"] = std::to_string(chunks[i].SourcePosition);
+        }
+        const auto& rends = chunks[i].Renditions;
+        for (size_t r = 0; r < rends.size(); ++r) {
+          auto& jr = jc[is]["renditions"][std::to_string(r)];
+          jr["name"] = rends[r].FileName.u8string();
+          jr["complete"] = rends[r].Completed;
+          jr["size"] = std::to_string(rends[r].FileSize);
+        }
+      }
+    };
+    save_chunks(chunks_, j["chunks"]);
+    if (audio_chunked_) {
+      j["audio"]["preroll"] = std::to_string(audio_preroll_);
+      j["audio"]["list"]["name"] = audio_list_file_.u8string();
+      save_chunks(audio_chunks_, j["audio"]["chunks"]);
     }
 
-    std::ofstream f(task_cfg_path_, std::ios_base::trunc);
-    f << std::setw(2) << j;
+    // Файл заменяется переименованием: планировщик читает его без блокировки
+    // задачи и не должен увидеть недописанный файл
+    auto temp_file = task_cfg_path_;
+    temp_file += ".tmp";
+    {
+      std::ofstream f(temp_file, std::ios_base::trunc);
+      f << std::setw(2) << j;
+      f.close();
+      if (!f) {
+        return false;
+      }
+    }
+    fs::rename(temp_file, task_cfg_path_);
     return true;
   } catch (const json::type_error& err) {
     std::cerr << "FORMAT ERROR: " << err.what() << std::endl;
@@ -537,18 +2877,52 @@ bool Task::Load(const std::filesystem::path& task_path_cfg) {
     auto data = json::parse(f);
     std::string strv;
     std::vector<std::string> strarrv;
-    strv = data["input"]["0"].value("name", "");
-    input_file_ = strv;
+    inputs_.clear();
+    size_t offset = 0;
+    for (size_t i = 0; data["input"].contains(std::to_string(i)); ++i) {
+      auto& ji = data["input"][std::to_string(i)];
+      Input input;
+      strv = ji.value("name", "");
+      input.FileName = strv;
+      strv = ji.value("duration", "0");
+      input.Duration = std::stoull(strv);
+      input.Offset = offset;
+      offset += input.Duration;
+      inputs_.push_back(input);
+    }
     input_arguments_.clear();
     for (auto& el : data["input"]["0"]["arguments"].items()) {
       input_arguments_.push_back(el.value());
     }
+    follow_ = data["input"]["0"].value("follow", false);
+    strv = data["input"]["0"].value("follow_idle", "0");
+    follow_idle_ = std::stoll(strv);
+    strv = data["input"]["0"].value("follow_growth", "0");
+    follow_growth_ = std::stoll(strv);
+    follow_writer_ = data["input"]["0"].value("follow_writer", false);
+    strv = data["input"]["0"].value("follow_size", "0");
+    follow_size_ = std::stoull(strv);
     strv = data["output"]["0"].value("name", "");
     output_file_ = strv;
     for (auto& el : data["output"]["0"]["arguments"].items()) {
       output_arguments_.push_back(el.value());
     }
     output_file_complete_ = data["output"]["0"]["complete"];
+    renditions_.clear();
+    for (size_t r = 1; data["output"].contains(std::to_string(r)); ++r) {
+      auto& jo = data["output"][std::to_string(r)];
+      Rendition rend;
+      strv = jo.value("name", "");
+      rend.OutputFile = strv;
+      for (auto& el : jo["arguments"].items()) {
+        rend.OutputArguments.push_back(el.value());
+      }
+      rend.Complete = jo.value("complete", false);
+      strv = jo["list"].value("name", "");
+      rend.ListFile = strv;
+      renditions_.push_back(rend);
+    }
+    mode_ = data.value("mode", kTaskModeChunked);
 
     strv = data["interim"]["data"].value("name", "");
     interim_data_file_ = strv;
@@ -559,26 +2933,95 @@ bool Task::Load(const std::filesystem::path& task_path_cfg) {
     interim_video_file_ = strv;
     interim_video_file_complete_ =
         data["interim"]["video"].value("complete", false);
+    stream_concat_ = data["interim"]["video"].value("stream", false);
+    strv = data["interim"]["video"].value("appended", "0");
+    appended_chunks_ = std::stoull(strv);
+    strv = data["interim"]["video"].value("offset", "0");
+    appended_offset_ = std::stoull(strv);
+    interim_format_ =
+        data["interim"].value("format", kInterimFormatNative);
+    interim_released_ = data["interim"].value("released", false);
     strv = data["interim"]["list"].value("name", "");
     list_file_ = strv;
+    strv = data["interim"].value("scratch", "");
+    scratch_dir_ = strv;
+
+    if (data.contains("streams")) {
+      auto& st = data["streams"];
+      streams_.Known = true;
+      streams_.AudioSampleRate = st.value("audio_sample_rate", 0);
+      streams_.Video = st.value("video", 0);
+      streams_.Audio = st.value("audio", 0);
+      streams_.Subtitle = st.value("subtitle", 0);
+      streams_.Data = st.value("data", 0);
+      streams_.VideoCodec = st.value("video_codec", "");
+      streams_.PixelFormat = st.value("pixel_format", "");
+      streams_.VideoProfile = st.value("video_profile", "");
+      streams_.VideoLevel = st.value("video_level", 0);
+      streams_.VideoRefs = st.value("video_refs", 0);
+      streams_.SampleAspectRatio = st.value("sample_aspect_ratio", "");
+    }
+    if (data.contains("schedule")) {
+      auto& sched = data["schedule"];
+      priority_ = sched.value("priority", 0);
+      strv = sched.value("deadline", "0");
+      deadline_ = std::stoll(strv);
+      speed_ = sched.value("speed", 0.0);
+    }
 
-    chunks_.clear();
-    for (auto& el : data["chunks"].items()) {
-      auto id = stoull(el.key());
-      auto j = el.value();
-      Chunk ch;
-      std::string strv;
-      strv = j.value("name", "");
-      ch.FileName = strv;
-      strv = j.value("start", " ");
-      ch.StartTime = std::stoull(strv);
-      strv = j.value("duration", " ");
-      ch.Interval = std::stoull(strv);
-      ch.Completed = j.value("complete", false);
-      if (chunks_.size() <= id) {
-        chunks_.resize(id + 1);
-      }
-      chunks_[id] = ch;
+    auto load_chunks = [](json& jc, std::vector<Chunk>& chunks) {
+      chunks.clear();
+      for (auto& el : jc.items()) {
+        auto id = stoull(el.key());
+        auto j = el.value();
+        Chunk ch;
+        std::string strv;
+        strv = j.value("name", "");
+        ch.FileName = strv;
+        strv = j.value("start", " ");
+        ch.StartTime = std::stoull(strv);
+        strv = j.value("duration", " ");
+        ch.Interval = std::stoull(strv);
+        strv = j.value("input", "0");
+        ch.Input = std::stoull(strv);
+        ch.Copy = j.value("copy", false);
+        ch.Completed = j.value("complete", false);
+        strv = j.value("size", "0");
+        ch.FileSize = std::stoull(strv);
+        strv = j.value("position", "");
+        ch.SourcePosition =
+            strv.empty() ? FFmpeg::kUnknownPosition : std::stoull(strv);
+        if (j.contains("renditions")) {
+          for (auto& er : j["renditions"].items()) {
+            auto rid = stoull(er.key());
+            auto& jr = er.value();
+            ChunkRendition rend;
+            strv = jr.value("name", "");
+            rend.FileName = strv;
+            rend.Completed = jr.value("complete", false);
+            strv = jr.value("size", "0");
+            rend.FileSize = std::stoull(strv);
+            if (ch.Renditions.size() <= rid) {
+              ch.Renditions.resize(rid + 1);
+            }
+            ch.Renditions[rid] = rend;
+          }
+        }
+        if (chunks.size() <= id) {
+          chunks.resize(id + 1);
+        }
+        chunks[id] = ch;
+      }
+    };
+    load_chunks(data["chunks"], chunks_);
+    audio_chunked_ = data.contains("audio");
+    if (audio_chunked_) {
+      auto& audio = data["audio"];
+      strv = audio.value("preroll", "0");
+      audio_preroll_ = std::stoull(strv);
+      strv = audio["list"].value("name", "");
+      audio_list_file_ = strv;
+      load_chunks(audio["chunks"], audio_chunks_);
     }
     return true;
   } catch (const json::type_error& err) {
@@ -590,10 +3033,15 @@ bool Task::Load(const std::filesystem::path& task_path_cfg) {
   return false;
 }
 
-bool Task::Validate() {
-  if (input_file_.empty()) {
+bool Task::Validate(bool probe_chunks) {
+  if (inputs_.empty()) {
     return false;
   }
+  for (const auto& ch : chunks_) {
+    if (ch.Input >= inputs_.size()) {
+      return false;
+    }
+  }
   if (output_file_.empty()) {
     return false;
   }
@@ -608,6 +3056,24 @@ bool Task::Validate() {
     }
     output_file_complete_ = false;
   }
+  for (auto& rend : renditions_) {
+    if (!fs::exists(rend.OutputFile)) {
+      rend.Complete = false;
+    }
+  }
+  for (const auto& ch : chunks_) {
+    if (ch.Renditions.size() != renditions_.size()) {
+      return false;
+    }
+  }
+  if (interim_released_) {
+    if (OutputsComplete()) {
+      // Фрагменты и промежуточные файлы удалены и больше не нужны
+      return true;
+    }
+    // Выходной файл пропал: задача выполняется заново
+    interim_released_ = false;
+  }
 
   if (interim_data_file_.empty()) {
     return false;
@@ -618,36 +3084,241 @@ bool Task::Validate() {
   } else if (!fs::exists(interim_data_file_)) {
     interim_data_file_complete_ = false;
   }
+  if (audio_chunked_ && !interim_data_file_complete_) {
+    ValidateAudioChunks();
+  }
   if (interim_video_file_.empty()) {
     return false;
   }
   if (!fs::exists(interim_video_file_)) {
     interim_video_file_complete_ = false;
   }
+  if (interim_format_ == kInterimFormatTs) {
+    // Промежуточный файл должен содержать все дописанные фрагменты. Иначе
+    // собираем его заново. Лишние байты (прерванное дописывание) будут
+    // отброшены при следующем дописывании
+    std::error_code err;
+    auto size = fs::file_size(interim_video_file_, err);
+    if (err || size < appended_offset_ || appended_chunks_ > chunks_.size()) {
+      appended_chunks_ = 0;
+      appended_offset_ = 0;
+      interim_video_file_complete_ = false;
+    }
+  }
+
+  ValidateChunks(probe_chunks);
+  return true;
+}
+
+
+void Task::ValidateChunks(bool probe_chunks) {
+  // Фрагменты, уже дописанные в промежуточный видеофайл, не проверяются
+  auto first = std::min(appended_chunks_, chunks_.size());
 
-  // Проверим существование отдельных файлов
+  // Размеры всех файлов получим одним проходом по каждой папке с фрагментами
+  std::map<fs::path, std::map<fs::path, uintmax_t>> folders;
+  for (auto it = chunks_.begin() + first; it != chunks_.end(); ++it) {
+    if (it->Completed) {
+      folders[it->FileName.parent_path()];
+    }
+  }
   for (auto it = chunks_.begin(); it != chunks_.end(); ++it) {
-    if (!fs::exists(it->FileName)) {
-      it->Completed = false;
+    for (const auto& rend : it->Renditions) {
+      if (rend.Completed) {
+        folders[rend.FileName.parent_path()];
+      }
+    }
+  }
+  for (auto& folder : folders) {
+    std::error_code err;
+    for (fs::directory_iterator dit(folder.first, err), end;
+         !err && dit != end; dit.increment(err)) {
+      if (!dit->is_regular_file(err)) {
+        continue;
+      }
+      auto size = dit->file_size(err);
+      if (err) {
+        err.clear();
+        continue;
+      }
+      folder.second[dit->path().filename()] = size;
     }
   }
 
-  return true;
+  // Файлы дополнительных выходных файлов проверяются у всех фрагментов: они
+  // не дописываются в промежуточный файл. Неготовый файл конвертируется
+  // заново вместе с основным файлом фрагмента
+  for (auto& ch : chunks_) {
+    for (auto& rend : ch.Renditions) {
+      if (!rend.Completed) {
+        ch.Completed = false;
+        continue;
+      }
+      auto& files = folders[rend.FileName.parent_path()];
+      auto fit = files.find(rend.FileName.filename());
+      if (fit == files.end() || fit->second == 0 ||
+          rend.FileSize != fit->second) {
+        rend.Completed = false;
+        ch.Completed = false;
+      }
+    }
+  }
+
+  std::vector<size_t> suspicious;
+  for (size_t i = first; i < chunks_.size(); ++i) {
+    auto& ch = chunks_[i];
+    if (!ch.Completed) {
+      continue;
+    }
+    auto& files = folders[ch.FileName.parent_path()];
+    auto fit = files.find(ch.FileName.filename());
+    if (fit == files.end() || fit->second == 0) {
+      ch.Completed = false;
+      continue;
+    }
+    if (ch.FileSize == 0) {
+      // Размер не сохранён (задача из старой версии). Проверим длительность
+      suspicious.push_back(i);
+      continue;
+    }
+    if (ch.FileSize != fit->second) {
+      // Файл обрезан или перезаписан после конвертации
+      ch.Completed = false;
+    }
+  }
+
+  if (suspicious.empty()) {
+    return;
+  }
+  if (!probe_chunks) {
+    // Без проверки подозрительные фрагменты нельзя считать готовыми
+    for (auto i : suspicious) {
+      chunks_[i].Completed = false;
+    }
+    return;
+  }
+
+  // Каждый поток меняет только свой фрагмент, синхронизация не нужна
+  RunParallel(suspicious.size(), GetProbeThreadAmount(), [&](size_t index) {
+    auto& ch = chunks_[suspicious[index]];
+    FFmpeg fm;
+    size_t duration = 0;
+    DeviceLease lease;
+    lease.Acquire({{ch.FileName, false}});
+    bool good = fm.RequestDuration(ch.FileName, duration);
+    lease.Release();
+    if (good) {
+      size_t diff = duration > ch.Interval ? duration - ch.Interval
+                                           : ch.Interval - duration;
+      good = diff <= kChunkDurationTolerance;
+    }
+    std::error_code err;
+    auto fsize = fs::file_size(ch.FileName, err);
+    if (err) {
+      good = false;
+    }
+    if (good) {
+      ch.FileSize = static_cast<size_t>(fsize);
+    } else {
+      ch.Completed = false;
+      ch.FileSize = 0;
+    }
+  });
 }
 
 
 bool Task::RunSplit() {
-  std::cout << "Phase 1/4: Extract non-video streams " << std::flush;
+  std::cout << "Phase 1/3: Extract non-video streams " << std::flush;
+  if (status_) {
+    status_->SetPhase(LiveStatus::kPhaseSplit);
+  }
   if (interim_data_file_complete_) {
     std::cout << "-- skip" << std::endl;
     return true;
   }
-  auto nonvideo = input_arguments_;
+  std::vector<std::string> nonvideo;
+  auto input_file = inputs_[0].FileName;
+  auto segments = GetSourceSegments();
+  if (segments.size() > 1 || std::get<1>(segments[0]) != 0 ||
+      std::get<2>(segments[0]) != inputs_[0].Duration) {
+    // Не-видео потоки всех исходных файлов (диапазонов) читаются подряд
+    // через concat
+    input_file = task_cfg_path_.parent_path() / kInterimInputListFile;
+    std::ofstream f(
+        input_file.string(), std::ios_base::out | std::ios_base::trunc);
+    for (const auto& seg : segments) {
+      const auto& input = inputs_[std::get<0>(seg)];
+      f << "file '" << input.FileName.string() << "'" << std::endl;
+      if (std::get<1>(seg) != 0) {
+        f << "inpoint " << TimeArgument(std::get<1>(seg)) << std::endl;
+      }
+      if (std::get<2>(seg) != input.Duration) {
+        f << "outpoint " << TimeArgument(std::get<2>(seg)) << std::endl;
+      }
+    }
+    if (!f) {
+      std::cout << "-- can't write list of input files" << std::endl;
+      return false;
+    }
+    nonvideo = {"-safe", "0", "-f", "concat"};
+  }
+  nonvideo.insert(
+      nonvideo.end(), input_arguments_.begin(), input_arguments_.end());
   nonvideo.push_back("-vn");
+  auto split_args = output_arguments_;
+  if (mode_ == kTaskModeHls) {
+    // Аудиоверсия HLS: сегменты и плейлист пишет ffmpeg, сегменты той же
+    // длительности, что и у видео
+    nonvideo.push_back("-sn");
+    nonvideo.push_back("-dn");
+    auto segment = interim_data_file_.parent_path() /
+                   (interim_data_file_.stem().string() + "_%06d" + kTsExtension);
+    split_args.insert(split_args.end(), {"-f", "hls", "-hls_time",
+        TimeArgument(kHlsSegmentSize), "-hls_playlist_type", "vod",
+        "-hls_segment_filename", segment.string()});
+  }
+  // Те же потоки того же исходного файла выделяются один раз для всех задач.
+  // Сведения о растущем файле не разделяются (см. GenerateChunks)
+  SourceStore store;
+  std::vector<std::string> data_parts;
+  if (inputs_.size() == 1 && !follow_ && mode_ != kTaskModeHls &&
+      store.Open(GetAppDir(), inputs_[0].FileName, id_)) {
+    data_parts = {interim_data_file_.extension().string(),
+        std::to_string(input_arguments_.size())};
+    data_parts.insert(data_parts.end(), input_arguments_.begin(),
+        input_arguments_.end());
+    auto data_args = GetNonVideoArguments(output_arguments_);
+    data_parts.insert(data_parts.end(), data_args.begin(), data_args.end());
+    for (const auto& seg : segments) {
+      data_parts.push_back(TimeArgument(std::get<1>(seg)));
+      data_parts.push_back(TimeArgument(std::get<2>(seg)));
+    }
+    bool empty = false;
+    if (store.RestoreData(data_parts, interim_data_file_, empty)) {
+      interim_data_file_complete_ = true;
+      interim_data_file_empty_ = empty;
+      if (!Save()) {
+        std::cout << "-- shared, but saving error" << std::endl;
+        return false;
+      }
+      std::cout << "-- shared with another task" << std::endl;
+      return true;
+    }
+  }
+  // Файл может быть жёсткой ссылкой на общий файл хранилища
+  std::error_code err;
+  fs::remove(interim_data_file_, err);
+  std::vector<IoAccess> access = {{interim_data_file_, true}};
+  for (const auto& seg : segments) {
+    access.push_back({inputs_[std::get<0>(seg)].FileName, false});
+  }
+  DeviceLease lease;
+  lease.Acquire(access);
   FFmpeg conv;
   auto start = chr::steady_clock::now();
-  auto res = conv.DoConvertation(input_file_, interim_data_file_, {}, {},
-      nonvideo, output_arguments_);  // TODO PROCESS !!!
+  auto res = conv.DoConvertation(input_file, interim_data_file_, {}, {},
+      nonvideo, split_args);  // TODO PROCESS !!!
+  lease.Release();
   auto finish = chr::steady_clock::now();
   auto interval = chr::duration_cast<chr::milliseconds>(finish - start).count();
   auto is = Microseconds2SecondsString(interval);
@@ -661,6 +3332,9 @@ bool Task::RunSplit() {
       interim_data_file_empty_ = true;
       std::cout << " (empty output) ";
     }
+    if (!data_parts.empty()) {
+      store.StoreData(data_parts, interim_data_file_, interim_data_file_empty_);
+    }
     if (!Save()) {
       std::cout << "-- complete, but saving error (" << is << " s)"
                 << std::endl;
@@ -672,23 +3346,31 @@ bool Task::RunSplit() {
   return true;
 }
 
-bool Task::RunConcatenation() {
-  std::cout << "Phase 3/4: Concatenate video chunks ... " << std::flush;
-  if (interim_video_file_complete_) {
-    std::cout << "passed" << std::endl;
+bool Task::RunConcatenationAndMerge() {
+  std::cout << "Phase 3/3: Concatenate video chunks and merge streams ... "
+            << std::flush;
+  if (status_) {
+    status_->SetPhase(LiveStatus::kPhaseConcat);
+  }
+  if (output_file_complete_) {
+    std::cout << "skip" << std::endl;
     return true;
   }
+  DeviceLease lease;
+  lease.Acquire(GetAssemblyAccess(
+      chunks_.empty() ? fs::path() : chunks_.front().FileName, output_file_));
   FFmpeg conv;
   auto start = chr::steady_clock::now();
-  bool res = conv.DoConcatenation(
-      list_file_, interim_video_file_);  // TODO check result
+  bool res = conv.ConcatenateAndMerge(list_file_,
+      interim_data_file_empty_ ? fs::path() : interim_data_file_, output_file_);
+  lease.Release();
   auto finish = chr::steady_clock::now();
   auto interval = chr::duration_cast<chr::milliseconds>(finish - start).count();
   auto is = Microseconds2SecondsString(interval);
   if (!res) {
     std::cout << "failed ";
   } else {
-    interim_video_file_complete_ = true;
+    output_file_complete_ = true;
     res = Save();
     if (!res) {
       std::cout << " complete, but saving error ";
@@ -701,36 +3383,153 @@ bool Task::RunConcatenation() {
 }
 
 
+bool Task::RunRenditions() {
+  for (size_t r = 0; r < renditions_.size(); ++r) {
+    auto& rend = renditions_[r];
+    std::cout << "Phase 3/3: Concatenate chunks of output " << r + 2
+              << " and merge streams ... " << std::flush;
+    if (rend.Complete) {
+      std::cout << "skip" << std::endl;
+      continue;
+    }
+    if (CheckInterrupted()) {
+      return false;
+    }
+    DeviceLease lease;
+    lease.Acquire(GetAssemblyAccess(
+        chunks_.empty() ? fs::path() : chunks_.front().Renditions[r].FileName,
+        rend.OutputFile));
+    FFmpeg conv;
+    auto start = chr::steady_clock::now();
+    bool res = conv.ConcatenateAndMerge(rend.ListFile,
+        interim_data_file_empty_ ? fs::path() : interim_data_file_,
+        rend.OutputFile);
+    lease.Release();
+    auto finish = chr::steady_clock::now();
+    auto interval =
+        chr::duration_cast<chr::milliseconds>(finish - start).count();
+    auto is = Microseconds2SecondsString(interval);
+    if (!res) {
+      std::cout << "failed (" << is << " s)" << std::endl;
+      return false;
+    }
+    rend.Complete = true;
+    if (!Save()) {
+      std::cout << " complete, but saving error (" << is << " s)"
+                << std::endl;
+      return false;
+    }
+    std::cout << " success (" << is << " s)" << std::endl;
+  }
+  return true;
+}
+
+
+bool Task::RunDirect() {
+  std::cout << "Direct conversion (stream copy) ... " << std::flush;
+  if (status_) {
+    status_->SetPhase(LiveStatus::kPhaseDirect);
+  }
+  if (output_file_complete_) {
+    std::cout << "skip" << std::endl;
+    return true;
+  }
+  DeviceLease lease;
+  lease.Acquire({{inputs_[0].FileName, false}, {output_file_, true}});
+  FFmpeg conv;
+  auto start = chr::steady_clock::now();
+  auto res = conv.DoConvertation(inputs_[0].FileName, output_file_, {}, {},
+      input_arguments_, output_arguments_);
+  lease.Release();
+  auto finish = chr::steady_clock::now();
+  auto interval = chr::duration_cast<chr::milliseconds>(finish - start).count();
+  auto is = Microseconds2SecondsString(interval);
+  if (res != FFmpeg::kProcessSuccess) {
+    std::cout << "failed (" << is << " s)" << std::endl;
+    return false;
+  }
+  output_file_complete_ = true;
+  if (!Save()) {
+    std::cout << "complete, but saving error (" << is << " s)" << std::endl;
+    return false;
+  }
+  std::cout << "success (" << is << " s)" << std::endl;
+  ReleaseInterimFiles();
+  return true;
+}
+
+
+bool Task::RunJoin() {
+  // Завершение дописывания фрагментов второй фазы: слияние потоков остаётся
+  // третьей фазой (RunMerge)
+  std::cout << "Phase 2/3: Join video chunks ... " << std::flush;
+  if (status_) {
+    status_->SetPhase(LiveStatus::kPhaseJoin);
+  }
+  auto start = chr::steady_clock::now();
+  bool res = AppendCompletedChunks() && interim_video_file_complete_;
+  auto finish = chr::steady_clock::now();
+  auto interval = chr::duration_cast<chr::milliseconds>(finish - start).count();
+  auto is = Microseconds2SecondsString(interval);
+  std::cout << (res ? "success " : "failed ") << "(" << is << " s)"
+            << std::endl;
+  return res;
+}
+
+
 bool Task::RunMerge() {
-  std::cout << "Phase 4/4: Merge streams ... " << std::flush;
+  std::cout << "Phase 3/3: Merge streams ... " << std::flush;
+  if (status_) {
+    status_->SetPhase(LiveStatus::kPhaseMerge);
+  }
   if (output_file_complete_) {
     std::cout << "skip" << std::endl;
     return true;
   }
 
-  if (interim_data_file_empty_) {
-    // Простое копирование файла с видео
-    std::cout << " (copying) ";
-    try {
-      fs::copy_file(interim_video_file_, output_file_,
-          fs::copy_options::overwrite_existing);
-      output_file_complete_ = true;
-      if (Save()) {
-        std::cout << " success" << std::endl;
-        return true;
-      }
-      std::cout << " complete, but saving error " << std::endl;
-    } catch (fs::filesystem_error& err) {
-      std::cout << " failed: " << err.what() << std::endl;
+  if (interim_data_file_empty_ &&
+      interim_video_file_.extension() == output_file_.extension()) {
+    // Промежуточный файл с видео и есть результат. Он больше не нужен, поэтому
+    // может быть переименован
+    DeviceLease lease;
+    lease.Acquire(GetAssemblyAccess(interim_video_file_, output_file_));
+    TransferMethod method;
+    bool transferred =
+        TransferFile(interim_video_file_, output_file_, true, method);
+    lease.Release();
+    if (!transferred) {
+      std::cout << " failed" << std::endl;
+      return false;
     }
-
+    switch (method) {
+      case kTransferRename:
+        std::cout << " (renamed) ";
+        break;
+      case kTransferReflink:
+        std::cout << " (reflinked) ";
+        break;
+      default:
+        std::cout << " (copied) ";
+        break;
+    }
+    output_file_complete_ = true;
+    if (Save()) {
+      std::cout << " success" << std::endl;
+      return true;
+    }
+    std::cout << " complete, but saving error " << std::endl;
     return false;
   }
 
+  DeviceLease lease;
+  lease.Acquire(GetAssemblyAccess(interim_video_file_, output_file_));
   FFmpeg conv;
   auto start = chr::steady_clock::now();
-  bool res = conv.MergeVideoAndData(
-      interim_video_file_, interim_data_file_, output_file_);
+  // Промежуточный видеофайл в другом контейнере (MPEG-TS) перепаковывается
+  // даже без остальных потоков
+  bool res = conv.MergeVideoAndData(interim_video_file_,
+      interim_data_file_empty_ ? fs::path() : interim_data_file_, output_file_);
+  lease.Release();
   auto finish = chr::steady_clock::now();
   auto interval = chr::duration_cast<chr::milliseconds>(finish - start).count();
   auto is = Microseconds2SecondsString(interval);
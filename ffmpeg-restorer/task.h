@@ -1,14 +1,58 @@
 #ifndef TASK_H
 #define TASK_H
 
+#include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <cstring>
 #include <filesystem>
+#include <functional>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <tuple>
+#include <utility>
 #include <vector>
 
+#include "chunkcache.h"
+#include "iolimits.h"
+#include "status.h"
 
-const std::string kTaskFolder = ".ffmpegrr";
 
+const std::string kTaskFolder = ".ffmpegrr";
+// Период, через который задача с растущим исходным файлом (add --follow)
+// снова проверяет его рост
+const std::chrono::seconds kFollowPollInterval(5);
+
+class FileLock;
+
+
+/*! Параметры создания задачи, не относящиеся к аргументам ffmpeg */
+struct TaskOptions {
+  int Priority;  //!< Приоритет, задачи с большим значением выполняются раньше
+  long long Deadline;  //!< Срок готовности (секунды от эпохи), 0 - не задан
+  bool StreamConcat;  //!< Дописывать готовые фрагменты в промежуточный файл
+                      //!< по мере конвертации
+  std::string InterimFormat;  //!< Формат фрагментов, пустой - по умолчанию
+  std::vector<std::string> Scratch;  //!< Папки для временных файлов, пустой -
+                                     //!< из конфигурационного файла
+  std::vector<std::string> Ranges;  //!< Конвертируемые диапазоны времени вида
+                                    //!< НАЧАЛО-КОНЕЦ, пустой - весь файл
+  bool SmartRender;  //!< Копировать целые группы кадров, перекодировать только
+                     //!< неполные группы на границах диапазонов
+  bool Follow;  //!< Исходный файл ещё записывается, фрагменты добавляются по
+                //!< мере его роста
+  long long FollowIdle;  //!< Запись считается законченной, если файл не растёт
+                         //!< столько секунд, 0 - без ограничения
+
+  TaskOptions()
+      : Priority(0),
+        Deadline(0),
+        StreamConcat(false),
+        SmartRender(false),
+        Follow(false),
+        FollowIdle(0) {}
+};
 
 class Task {
  public:
@@ -19,26 +63,61 @@ class Task {
   Task& operator=(Task&& arg);
   virtual ~Task();
 
+  /*! Данные задачи для планирования очерёдности выполнения */
+  struct ScheduleInfo {
+    size_t Id;
+    int Priority;
+    long long Deadline;  //!< Секунды от эпохи, 0 - не задан
+    size_t Eta;  //!< Оценка оставшегося времени конвертации, в микросекундах
+  };
+
   /*! Создать (инициализировать) задачу через аргументы ffmpeg
   \param argc, argv список аргументов командной строки, относящихся к конвертации
+  \param options параметры задачи (приоритет и т.д.)
   \return признак, что создание прошло успешно */
-  bool CreateFromArguments(int argc, char** argv);
+  bool CreateFromArguments(
+      int argc, char** argv, const TaskOptions& options = TaskOptions());
 
   /*! Создать (загрузить с диска) задачу через идентификатор
   \param id идентификатор задачи, получается через другие внешние функции
+  \param probe_chunks признак, что подозрительные фрагменты (без сохранённого
+  размера) дополнительно проверяются по длительности через ffprobe
   \return признак успешности создания */
-  bool CreateFromID(size_t id);
+  bool CreateFromID(size_t id, bool probe_chunks = true);
 
   /*! Удалить задачу вместе с промежуточными файлами. Если задача с заданным
-  номером не существует, то удаление считается успешным
+  номером не существует, то удаление считается успешным. Вызывающий должен
+  удерживать блокировку задачи (см. LockTask)
   \param id идентификатор задачи
   \return признак успешного удаления */
   static bool DeleteTask(size_t id);
 
+  /*! Захватить блокировку задачи. Блокировка удерживается при выполнении,
+  создании и удалении задачи, пока существует возвращаемый объект
+  \param id идентификатор задачи
+  \return объект блокировки или nullptr, если задача занята другим процессом */
+  static std::shared_ptr<FileLock> LockTask(size_t id);
+
+  /*! Проверить, что папка задачи существует
+  \param id идентификатор задачи
+  \return признак существования задачи */
+  static bool TaskExists(size_t id);
+
   /*! Запустить задачу на выполнение. Это синхронный вызов, который делает всю
   конвертацию. Конвертацию можно прервать через Ctrl+C или другим способом
+  \param status публикуемое состояние обработки, может быть nullptr
+  \param interrupted функция-признак запроса на прерывание задачи. Проверяется
+  на границах фрагментов и фаз, готовые фрагменты сохраняются. Может быть пустой
   \return признак, что вся конвертация выполнена полностью успешно */
-  bool Run();
+  bool Run(LiveStatus* status = nullptr,
+      std::function<bool()> interrupted = nullptr);
+
+  /*! Проверить, что оставшейся части задачи хватит свободного места на диске.
+  Оценивается пиковое потребление: ещё не сконвертированные фрагменты в папке
+  временных файлов и весь выходной файл (на том же или своём устройстве).
+  При нехватке места выводит сообщение
+  \return признак достаточного места */
+  bool CheckDiskSpace() const;
 
   /*! Очистить всю информацию о задаче */
   void Clear();
@@ -49,18 +128,100 @@ class Task {
   \return массив с идентификаторами задач */
   static std::vector<size_t> GetTasks();
 
+  /*! Получить список задач в порядке выполнения: по убыванию приоритета, затем
+  задачи со сроком готовности по возрастанию запаса времени (срок минус оценка
+  оставшегося времени), затем остальные по возрастанию номера
+  \return упорядоченный список задач */
+  static std::vector<ScheduleInfo> GetSchedule();
+
+  /*! Проверить, есть ли задача с более высоким приоритетом, ради которой
+  текущую задачу нужно вытеснить (на границе фрагмента)
+  \param id, priority идентификатор и приоритет текущей задачи
+  \param eligible проверка, что задача может быть взята в работу
+  \return признак наличия вытесняющей задачи */
+  static bool HasPreemptingTask(size_t id, int priority,
+      const std::function<bool(size_t)>& eligible);
+
+  /*! Проверить, что выполнение остановлено до роста исходного файла (add
+  --follow): готовые фрагменты сконвертированы, новых данных ещё нет. Задача
+  не завершена, её нужно повторить через kFollowPollInterval, а пока
+  выполнять другие задачи
+  \return признак ожидания роста */
+  bool IsWaitingSource() const { return waiting_source_; }
+
+  /*! Выдать приоритет задачи */
+  int GetPriority() const { return priority_; }
+
 
   /*! Выдать признак что задача завершена
   \return признак завершенной задачи */
   bool TaskCompleted();
 
+  /*! Выдать идентификатор задачи
+  \return идентификатор созданной задачи */
+  size_t GetID() const { return id_; }
+
  private:
+  /*! Файл фрагмента для дополнительного выходного файла */
+  struct ChunkRendition {
+    std::filesystem::path FileName;
+    bool Completed;
+    size_t FileSize;
+  };
+
   /*! Описание одного кусочка конвертации */
   struct Chunk {
     std::filesystem::path FileName;
     size_t StartTime;
     size_t Interval;
-    bool Completed;
+    size_t Input;  //!< Номер исходного файла. Время начала - от начала этого
+                   //!< файла
+    bool Copy;  //!< Видео копируется без перекодирования (целые группы кадров
+                //!< от ключевого кадра до ключевого кадра)
+    bool Completed;  //!< Готовы файлы фрагмента для всех выходных файлов
+    size_t FileSize;  //!< Размер готового файла фрагмента, 0 - неизвестен
+    size_t SourcePosition;  //!< Смещение ключевого кадра начала фрагмента в
+                            //!< исходном файле, FFmpeg::kUnknownPosition -
+                            //!< неизвестно
+    std::vector<ChunkRendition> Renditions;  //!< Файлы фрагмента для
+                                             //!< дополнительных выходных
+                                             //!< файлов, в порядке renditions_
+  };
+
+  /*! Исходный файл задачи. Исходные файлы образуют общую шкалу времени в
+  порядке следования, фрагменты не пересекают границы файлов */
+  struct Input {
+    std::filesystem::path FileName;
+    size_t Duration;  //!< Длительность, в мкс
+    size_t Offset;  //!< Начало файла на общей шкале времени, в мкс
+  };
+
+  /*! Дополнительный выходной файл задачи. Фрагменты для него получаются тем же
+  процессом ffmpeg, что и фрагменты основного выходного файла: исходный файл
+  читается и декодируется один раз. Не-видео потоки общие, они готовятся по
+  аргументам основного выходного файла */
+  struct Rendition {
+    std::filesystem::path OutputFile;
+    std::vector<std::string> OutputArguments;
+    bool Complete;
+    std::filesystem::path ListFile;  //!< Список фрагментов для объединения
+  };
+
+  /*! Состав потоков исходного файла */
+  struct StreamLayout {
+    bool Known;  //!< Признак, что состав получен через ffprobe
+    size_t Video;
+    size_t Audio;
+    size_t Subtitle;
+    size_t Data;  //!< Потоки данных и вложения
+    size_t AudioSampleRate;  //!< Общая частота звуковых потоков, 0 - разная
+                             //!< или неизвестна
+    std::string VideoCodec;  //!< Кодек первого видеопотока
+    std::string PixelFormat;  //!< Формат пикселей первого видеопотока
+    std::string VideoProfile;  //!< Профиль кодека первого видеопотока
+    int VideoLevel;  //!< Уровень кодека первого видеопотока
+    size_t VideoRefs;  //!< Число опорных кадров первого видеопотока
+    std::string SampleAspectRatio;  //!< Форма пикселя первого видеопотока
   };
 
 
@@ -68,22 +229,64 @@ class Task {
   std::filesystem::path
       task_cfg_path_;  //!< Полное имя файла с настройками по задаче
   size_t id_;
+  LiveStatus* status_;  //!< Публикуемое состояние на время выполнения задачи
+  std::function<bool()> interrupted_;  //!< Проверка запроса на прерывание
+  ChunkCache cache_;  //!< Кэш готовых фрагментов на время выполнения задачи
+  bool waiting_source_;  //!< Выполнение остановлено до роста исходного файла
 
   // Сохраняемая информация по задаче
-  std::filesystem::path input_file_;
+  std::vector<Input> inputs_;  //!< Исходные файлы, не пустой список
+  bool follow_;  //!< Единственный исходный файл ещё растёт: фрагменты после
+                 //!< последнего добавляются по мере записи
+  long long follow_idle_;  //!< Предельное время без роста файла, в секундах,
+                           //!< 0 - без ограничения
+  long long follow_growth_;  //!< Время последнего роста файла (секунды от
+                             //!< эпохи), 0 - ещё не проверялся
+  bool follow_writer_;  //!< Замечен процесс, открывший файл на запись
+  uintmax_t follow_size_;  //!< Размер растущего исходного файла при последней
+                           //!< проверке
   std::filesystem::path output_file_;
   bool output_file_complete_;
   std::filesystem::path list_file_;
+  std::filesystem::path scratch_dir_;  //!< Папка для фрагментов и промежуточных
+                                       //!< файлов вне папки задачи, пустая -
+                                       //!< они хранятся в папке задачи
   std::filesystem::path interim_video_file_;
   bool interim_video_file_complete_;
+  std::string mode_;  //!< Способ выполнения: chunked (по фрагментам), direct
+                     //!< (один проход ffmpeg для копирования потоков) или hls
+                     //!< (фрагменты - сегменты выходного плейлиста)
+  std::string interim_format_;  //!< Формат фрагментов: native (как у выходного
+                                //!< файла), ts (MPEG-TS), fmp4 (фрагментированный
+                                //!< MP4) или mkv (Matroska без индекса)
+  bool stream_concat_;  //!< Фрагменты дописываются в промежуточный видеофайл
+                        //!< по мере готовности непрерывного начала
+  size_t appended_chunks_;  //!< Количество фрагментов в промежуточном файле
+  size_t appended_offset_;  //!< Размер промежуточного файла с этими фрагментами
+  bool interim_released_;  //!< Выходной файл готов, фрагменты и промежуточные
+                           //!< файлы удалены
   std::filesystem::path interim_data_file_;
   bool interim_data_file_complete_;
   bool interim_data_file_empty_;  // Признак, что промежуточный файл с данными
                                   // будет отсутствовать (пустой)
+  StreamLayout streams_;
+  bool audio_chunked_;  //!< Звук декодируется фрагментами параллельно с видео
+  size_t audio_preroll_;  //!< Запас до и после звукового фрагмента, в мкс.
+                          //!< Декодируется и отрезается по отсчётам
+  std::filesystem::path audio_list_file_;
+  std::vector<Chunk> audio_chunks_;  //!< Звуковые фрагменты в PCM. Границы -
+                                     //!< целые отсчёты
   size_t duration_;
+  int priority_;
+  long long deadline_;  //!< Срок готовности (секунды от эпохи), 0 - не задан
+  double speed_;  //!< Измеренная скорость конвертации, 0 - неизвестна
+
+  std::recursive_mutex lock_;  //!< Синхронизация изменения и сохранения задачи
+                               //!< при параллельной обработке звука
   std::vector<std::string> input_arguments_;  //!< Аргументы конвертации
   std::vector<std::string> output_arguments_;  //!< Аргументы конвертации
   std::vector<Chunk> chunks_;
+  std::vector<Rendition> renditions_;  //!< Дополнительные выходные файлы
 
 
   /*! Обмен данными двух экземпляров */
@@ -92,25 +295,237 @@ class Task {
   /*! Копирование данных из одного экземпляра в другой */
   void Copy(Task& arg_to, const Task& arg_from);
 
-  /*! Разбить конвертацию на кусочки
-  TODO Описание */
-  bool GenerateChunks(const std::filesystem::path& task_path,
-      const std::filesystem::path& chunk_ext);
+  /*! Проверить запрос на прерывание выполнения задачи. При наличии запроса
+  выводит сообщение
+  \return признак, что выполнение нужно прервать */
+  bool CheckInterrupted();
 
-  /*! Сгенерировать файл-список фрагментов для последующего объединения */
+  /*! Выполнить все фазы конвертации задачи
+  \return признак, что вся конвертация выполнена полностью успешно */
+  bool RunPhases();
+
+  /*! Сконвертировать видеофрагмент (со всеми его выходными файлами) и
+  сохранить результат. Выводит окончание строки прогресса фрагмента
+  \param index номер фрагмента
+  \param inarg аргументы ffmpeg для исходного файла
+  \param drop_cache признак, что прочитанный участок источника можно убрать
+  из кэша (источник больше никто не читает)
+  \param converted, elapsed длительность сконвертированного в этом запуске
+  и время его конвертации, в мкс. Увеличиваются при успехе
+  \return признак успешной конвертации */
+  bool ConvertChunk(size_t index, const std::vector<std::string>& inarg,
+      bool drop_cache, size_t& converted, size_t& elapsed);
+
+  /*! Выдать файлы, читаемые и записываемые при конвертации видеофрагмента,
+  для занятия их устройств (см. DeviceLease)
+  \param index номер фрагмента
+  \return список обращений к файлам */
+  std::vector<IoAccess> GetChunkAccess(size_t index) const;
+
+  /*! Выдать файлы, читаемые и записываемые при сборке выходного файла, для
+  занятия их устройств (см. DeviceLease)
+  \param video промежуточный видеофайл или любой из объединяемых фрагментов:
+  фрагменты лежат в одной папке
+  \param output собираемый файл
+  \return список обращений к файлам */
+  std::vector<IoAccess> GetAssemblyAccess(const std::filesystem::path& video,
+      const std::filesystem::path& output) const;
+
+  /*! Опубликовать прогресс конвертации видеофрагментов
+  \param converted длительность фрагментов, сконвертированных с момента
+  запуска задачи, в микросекундах
+  \param elapsed время конвертации этих фрагментов, в микросекундах */
+  void PublishProgress(size_t converted, size_t elapsed);
+
+  /*! Записать плейлист HLS по готовым фрагментам-сегментам. В плейлист
+  попадают готовые фрагменты с начала, до первого неготового. Пока готовы не
+  все, плейлист имеет тип EVENT и дополняется по мере конвертации. Если у
+  источника есть звук, сегменты видео перечисляются в плейлисте видео, а
+  выходной файл - основной плейлист со ссылками на него и на аудиоверсию
+  (interim_data_file_, см. RunSplit)
+  \return признак успешной записи */
+  bool WritePlaylist();
+
+  /*! Оценить скорость потока HLS для основного плейлиста
+  \return скорость, бит/с */
+  uint64_t GetHlsBandwidth() const;
+
+  /*! Проверить готовность основного и всех дополнительных выходных файлов
+  \return признак готовности */
+  bool OutputsComplete() const;
+
+  /*! Удалить фрагменты и промежуточные файлы готовой задачи. Сначала в задаче
+  сохраняется отметка об удалении, поэтому возобновление их не требует */
+  void ReleaseInterimFiles();
+
+  /*! Оценить оставшееся время конвертации видео по измеренной скорости
+  \return оценка в микросекундах */
+  size_t EstimateRemaining() const;
+
+  /*! Суммарный размер исходных файлов
+  \return размер в байтах, 0 - неизвестен */
+  uint64_t GetInputSize() const;
+
+  /*! Папка приложения, в которой хранится задача
+  \return полный путь к папке */
+  std::filesystem::path GetAppDir() const;
+
+  /*! Разбить конвертацию на кусочки по каждому исходному файлу. Для растущего
+  файла (follow_) выделяются только фрагменты, за концом которых уже есть
+  данные
+  \param ranges конвертируемые диапазоны общей шкалы времени исходных файлов
+  (начало и конец, в мкс) в порядке вывода, пустой - все файлы целиком.
+  Границы кадров ищутся только внутри диапазонов
+  \param smart признак умного рендеринга: участки между ключевыми кадрами
+  копируются, перекодируются только участки на границах диапазонов */
+  bool GenerateChunks(
+      const std::vector<std::pair<size_t, size_t>>& ranges, bool smart);
+
+  /*! Разбить участок исходного файла на фрагменты и добавить их в конец списка
+  \param input номер исходного файла
+  \param start, end границы участка от начала файла, в мкс
+  \param smart признак умного рендеринга (см. GenerateChunks)
+  \param open_end признак, что данные продолжаются за концом участка (файл
+  растёт): остаток после последней найденной границы не выделяется */
+  void PlanChunks(
+      size_t input, size_t start, size_t end, bool smart, bool open_end);
+
+  /*! Выдать участок исходного файла, читаемый при конвертации фрагмента.
+  Границы берутся по смещениям ключевых кадров, неизвестные оцениваются
+  пропорционально времени. Участки соседних фрагментов не пересекаются
+  \param index номер фрагмента
+  \param offset, length возвращают начало и длину участка, в байтах
+  \return признак, что участок определён */
+  bool GetChunkSourceRange(size_t index, uint64_t& offset, uint64_t& length)
+      const;
+
+  /*! Подсказать ядру чтение в кэш участков исходного файла для следующих
+  неготовых фрагментов в пределах kPrefetchBudget байт. Вызывается на время
+  конвертации текущего фрагмента
+  \param first номер первого фрагмента после текущего */
+  void PrefetchChunks(size_t first) const;
+
+  /*! Выдать имя файла фрагмента: в папке промежуточных файлов или, для HLS,
+  рядом с плейлистом
+  \param index номер фрагмента
+  \return полное имя файла */
+  std::filesystem::path ChunkFileName(size_t index) const;
+
+  /*! Проверить рост исходного файла (follow_) и добавить новые фрагменты.
+  Запись считается законченной при появлении файла-метки <исходный>.end,
+  когда записывавший процесс закрыл файл (см. GetFileWriteState) или когда
+  файл не растёт дольше follow_idle_. Тогда выделяется остаток и follow_
+  снимается. Иначе остановка роста - ожидание, а не конец файла
+  \param waiting возвращает признак, что новых фрагментов пока нет
+  \return признак успеха, false - ошибка */
+  bool FollowSource(bool& waiting);
+
+  /*! Выдать участки исходных файлов, покрытые фрагментами: подряд идущие
+  фрагменты одного файла объединяются
+  \return список участков (номер файла, начало, конец), в мкс */
+  std::vector<std::tuple<size_t, size_t, size_t>> GetSourceSegments() const;
+
+  /*! Выдать позицию фрагмента в выходном файле
+  \param chunk фрагмент из chunks_
+  \return суммарная длительность предшествующих фрагментов, в мкс */
+  size_t GetOutputPosition(const Chunk& chunk) const;
+
+  /*! Выбрать и создать папку для фрагментов и промежуточных файлов задачи
+  среди указанных в параметрах или в конфигурационном файле. Если папки не
+  заданы или не подходят, файлы хранятся в папке задачи
+  \param options параметры задачи
+  \return признак успешного создания выбранной папки */
+  bool CreateScratchDir(const TaskOptions& options);
+
+  /*! Получить общий состав потоков исходных файлов. Если кроме видео потоков
+  нет ни в одном файле, то выделение не-видео потоков не требуется
+  \return признак успешного получения */
+  bool InspectStreams();
+
+  /*! Получить состав потоков одного исходного файла
+  \param input исходный файл
+  \param layout возвращает состав потоков
+  \return признак успешного получения */
+  bool InspectInputStreams(
+      const std::filesystem::path& input, StreamLayout& layout);
+
+  /*! Разобрать состав потоков из описания ffprobe (см.
+  FFmpeg::RequestStreamInfo)
+  \param info описание потоков в JSON
+  \param layout возвращает состав потоков
+  \return признак успешного разбора */
+  static bool ParseStreamInfo(const std::string& info, StreamLayout& layout);
+
+  /*! Проверить, что перекодированный фрагмент можно объединять со
+  скопированными: параметры видео (кодек, профиль, уровень, число опорных
+  кадров, форма пикселя) совпадают с исходными
+  \param file файл фрагмента
+  \param mismatch возвращает описание расхождения
+  \return признак совпадения */
+  bool MatchSourceVideo(
+      const std::filesystem::path& file, std::string& mismatch) const;
+
+  /*! Разбить звук на фрагменты по границам видеофрагментов, выровненным на
+  целые отсчёты. Возможно, если кроме видео есть только звуковые потоки с
+  общей частотой, а звук перекодируется без графа фильтров
+  \param task_path папка для фрагментов
+  \return признак, что звук будет обрабатываться фрагментами */
+  bool GenerateAudioChunks(const std::filesystem::path& task_path);
+
+  /*! Сгенерировать файл-список звуковых фрагментов */
+  bool GenerateAudioListFile();
+
+  /*! Проверить готовые звуковые фрагменты по сохранённому размеру */
+  void ValidateAudioChunks();
+
+  /*! Декодировать звуковые фрагменты в PCM. Выполняется в отдельном потоке
+  параллельно с конвертацией видео
+  \param stop признак остановки: проверяется перед каждым фрагментом */
+  void RunAudioChunks(const std::atomic<bool>& stop);
+
+  /*! Закодировать объединённые звуковые фрагменты одним проходом в
+  промежуточный файл с не-видео потоками
+  \return признак успешного кодирования */
+  bool RunAudioConcatenation();
+
+  /*! Добавить во фрагменты, ещё не имеющие их, файлы для дополнительных
+  выходных файлов. Имена получаются из имени фрагмента номером выходного файла
+  \param chunk_ext расширение фрагментов, пустое - по выходному файлу
+  \param task_path папка для файлов-списков фрагментов */
+  void GenerateRenditionChunks(const std::filesystem::path& chunk_ext,
+      const std::filesystem::path& task_path);
+
+  /*! Сгенерировать файлы-списки фрагментов (основной и для дополнительных
+  выходных файлов) для последующего объединения */
   bool GenerateListFile();
 
+  /*! Сформировать аргументы ffmpeg для выходного файла фрагмента
+  \param chunk фрагмент
+  \param arguments аргументы выходного файла задачи
+  \return аргументы конвертации */
+  std::vector<std::string> ChunkOutputArguments(
+      const Chunk& chunk, const std::vector<std::string>& arguments) const;
+
+  /*! Дописать в промежуточный видеофайл готовые фрагменты MPEG-TS,
+  продолжающие непрерывное начало. Смещение записи сохраняется в задаче после
+  каждого фрагмента
+  \return признак успешного дописывания */
+  bool AppendCompletedChunks();
+
   /*! Выделить не-видеоданные в отдельный файл */
   // bool ExtractNonVideo();
 
 
   /*! Создать новую папку с уникальным номером в хранилище задач. Пути и
-  размещение файлов описаны в notes/storage.txt. В случае ошибки содержимое
-  возвращаемых аргументов не определено
+  размещение файлов описаны в notes/storage.txt. Номер выделяется под
+  блокировкой каталога задач и никогда не используется повторно. В случае
+  ошибки содержимое возвращаемых аргументов не определено
   \param id возвращает созданный (уникальный) идентификатор задачи
   \param task_path возвращает путь для размещения всех файлов задачи
+  \param lock возвращает захваченную блокировку новой задачи
   \return признак успешного создания хранилища */
-  bool CreateNewTaskStorage(size_t& id, std::filesystem::path& task_path);
+  bool CreateNewTaskStorage(size_t& id, std::filesystem::path& task_path,
+      std::shared_ptr<FileLock>& lock);
 
   /*! Сохранить изменённое состояние задачи в конфигурационном файле
   \return признак успешной записи */
@@ -123,18 +538,47 @@ class Task {
   bool Load(const std::filesystem::path& task_path_cfg);
 
   /*! Провести проверки по загруженным данным по задаче
+  \param probe_chunks признак проверки длительности подозрительных фрагментов
   \return признак, что задача провалидирована/исправлена и может быть выполнена */
-  bool Validate();
-
-  /*! Проведём выделение аудио и др. данных
+  bool Validate(bool probe_chunks);
+
+  /*! Проверить файлы готовых фрагментов. Размеры файлов получаются одним
+  проходом по папкам с фрагментами. Пустые, отсутствующие и изменившие размер
+  фрагменты помечаются как неготовые. Фрагменты без сохранённого размера
+  (старые задачи) считаются подозрительными и при probe_chunks проверяются по
+  длительности параллельно
+  \param probe_chunks признак проверки длительности подозрительных фрагментов */
+  void ValidateChunks(bool probe_chunks);
+
+  /*! Проведём выделение аудио и др. данных. Для HLS звук кодируется одним
+  проходом в аудиоверсию: плейлист interim_data_file_ и его сегменты рядом с
+  выходным файлом
   \return признак успешного выделения */
   bool RunSplit();
 
-  /*! Сделаем объединение видеофрагментов
+  /*! Объединение видеофрагментов и остальных потоков сразу в выходной файл,
+  за один проход чтения/записи
+  \return признак успешного объединения */
+  bool RunConcatenationAndMerge();
+
+  /*! Объединение фрагментов каждого дополнительного выходного файла с общими
+  не-видео потоками
+  \return признак успешного объединения */
+  bool RunRenditions();
+
+  /*! Конвертация за один проход ffmpeg без фрагментов. Используется, когда
+  видео только копируется: перепаковка ограничена скоростью диска, и деление
+  на фрагменты лишь добавляет проходы чтения/записи
+  \return признак успешной конвертации */
+  bool RunDirect();
+
+  /*! Объединение фрагментов MPEG-TS в промежуточный видеофайл дописыванием
+  байт, без запуска ffmpeg
   \return признак успешного объединения */
-  bool RunConcatenation();
+  bool RunJoin();
 
-  /*! Объединение потоков в единый файл
+  /*! Объединение потоков из промежуточного видеофайла в единый файл.
+  Используется для задач, в которых промежуточный видеофайл уже собран
   \return признак успешного объединения */
   bool RunMerge();
 };
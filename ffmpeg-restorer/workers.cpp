@@ -0,0 +1,44 @@
+#include "workers.h"
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+const size_t kMaxProbeThreads = 8;
+
+
+size_t GetProbeThreadAmount() {
+  size_t hc = std::thread::hardware_concurrency();
+  return std::max<size_t>(1, std::min(hc, kMaxProbeThreads));
+}
+
+
+void RunParallel(
+    size_t amount, size_t threads, const std::function<void(size_t)>& func) {
+  if (amount == 0) {
+    return;
+  }
+  threads = std::max<size_t>(1, std::min(threads, amount));
+  std::atomic<size_t> next(0);
+  auto worker = [&]() {
+    for (size_t i = next++; i < amount; i = next++) {
+      func(i);
+    }
+  };
+
+  if (threads == 1) {
+    worker();
+    return;
+  }
+
+  std::vector<std::thread> pool;
+  pool.reserve(threads - 1);
+  for (size_t i = 1; i < threads; ++i) {
+    pool.emplace_back(worker);
+  }
+  worker();  // Текущий поток тоже участвует в обработке
+  for (auto& t : pool) {
+    t.join();
+  }
+}
@@ -0,0 +1,23 @@
+#ifndef WORKERS_H
+#define WORKERS_H
+
+#include <cstddef>
+#include <functional>
+
+
+/*! Выдать рекомендуемое количество параллельных потоков для вспомогательных
+операций (запросы ffprobe и т.п.)
+\return количество потоков, не меньше 1 */
+size_t GetProbeThreadAmount();
+
+/*! Выполнить функцию для каждого индекса из диапазона [0, amount) в
+нескольких потоках. Функция вызывается ровно один раз для каждого индекса,
+порядок вызовов не определён. Вызов синхронный: возврат происходит после
+обработки всех индексов. Функция не должна выбрасывать исключения
+\param amount количество индексов для обработки
+\param threads максимальное количество потоков
+\param func функция обработки одного индекса */
+void RunParallel(
+    size_t amount, size_t threads, const std::function<void(size_t)>& func);
+
+#endif  // WORKERS_H